@@ -0,0 +1,37 @@
+//
+//  alloccount.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+// not compiled with alloccount.h, these are the real allocation functions
+
+long long allocationCount = 0;
+
+void *alloc_count_malloc(size_t size)
+{
+    allocationCount++;
+    return malloc(size);
+}
+
+void *alloc_count_calloc(size_t count, size_t size)
+{
+    allocationCount++;
+    return calloc(count, size);
+}
+
+void *alloc_count_realloc(void *ptr, size_t size)
+{
+    allocationCount++;
+    return realloc(ptr, size);
+}
+
+char *alloc_count_strdup(const char *string)
+{
+    allocationCount++;
+    return strdup(string);
+}
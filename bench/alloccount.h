@@ -0,0 +1,29 @@
+//
+//  alloccount.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+/* Included before every source file of the benchmarks (with -include) to count the allocations made by the
+   bcfgenemapper code. The allocations made inside htslib are not counted. */
+
+#ifndef bcfgenemapper_alloccount_h
+#define bcfgenemapper_alloccount_h
+
+#include <stdlib.h>
+#include <string.h>
+
+extern long long allocationCount;
+
+void *alloc_count_malloc(size_t size);
+void *alloc_count_calloc(size_t count, size_t size);
+void *alloc_count_realloc(void *ptr, size_t size);
+char *alloc_count_strdup(const char *string);
+
+#define malloc(size) alloc_count_malloc(size)
+#define calloc(count, size) alloc_count_calloc(count, size)
+#define realloc(ptr, size) alloc_count_realloc(ptr, size)
+#define strdup(string) alloc_count_strdup(string)
+
+#endif
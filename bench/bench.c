@@ -0,0 +1,332 @@
+//
+//  bench.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+/* Microbenchmarks of the gene mapping, complement and csv formatting code on synthetic inputs. Every benchmark
+   prints the time and the number of allocations per operation. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <htslib/vcf.h>
+
+#include "genemapper.h"
+#include "csvformatter.h"
+#include "nucleotide.h"
+#include "main.h"
+
+extern long long allocationCount;
+
+static int32_t geneCount = 20;
+static int32_t exonsPerGene = 12;
+static int32_t operationCount = 1000000;
+static int32_t sequenceLength = 64;
+static int32_t sampleCount = 2000;
+static int32_t recordCount = 2000;
+
+static double bench_seconds(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    double startSeconds;
+    long long startAllocationCount;
+} bench_timer_t;
+
+static void bench_start(bench_timer_t *timer)
+{
+    timer->startAllocationCount = allocationCount;
+    timer->startSeconds = bench_seconds();
+}
+
+static void bench_report(bench_timer_t *timer, const char *name, long long operations)
+{
+    double seconds = bench_seconds() - timer->startSeconds;
+    long long allocations = allocationCount - timer->startAllocationCount;
+    printf("%-44s %12lld %12.1f %12.3f\n", name, operations, seconds * 1e9 / (double)operations, (double)allocations / (double)operations);
+}
+
+// every operation in the benchmarks uses the result, so that it can't be optimized away
+static volatile int32_t benchSink;
+
+static bcf_hdr_t *bench_header(int32_t headerSampleCount)
+{
+    bcf_hdr_t *header = bcf_hdr_init("w");
+    bcf_hdr_append(header, "##contig=<ID=1>");
+    bcf_hdr_append(header, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    bcf_hdr_append(header, GENEMAP_INFO_HEADER);
+    bcf_hdr_append(header, GENEMAP_NAME_INFO_HEADER);
+    bcf_hdr_append(header, GENEMAP_STRAND_INFO_HEADER);
+    
+    int32_t i;
+    for (i = 0; i < headerSampleCount; i++) {
+        char sampleName[32];
+        sprintf(sampleName, "sample%d", (int)i);
+        bcf_hdr_add_sample(header, sampleName);
+    }
+    bcf_hdr_add_sample(header, NULL);
+    bcf_hdr_sync(header);
+    
+    return header;
+}
+
+// genes one after the other on contig 1, every other gene on the (-)strand, the exons are 150 long, 1000 apart
+static gene_mapper_t *bench_gene_mapper(bcf_hdr_t *header, int32_t *genomeLengthOut)
+{
+    gene_mapper_t *geneMapper = gene_mapper_init();
+    
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < geneCount; i++) {
+        char geneName[32];
+        sprintf(geneName, "gene%d", (int)i);
+        gene_mapper_add_gene(geneMapper, geneName, "1");
+        int32_t geneStart = i * exonsPerGene * 1000;
+        for (j = 0; j < exonsPerGene; j++) {
+            int32_t exonStart = geneStart + j * 1000;
+            if (i % 2) {
+                exonStart = geneStart + (exonsPerGene - 1 - j) * 1000;
+                gene_mapper_add_gene_exon(geneMapper, i, exon_range(exonStart + 149, exonStart));
+            } else {
+                gene_mapper_add_gene_exon(geneMapper, i, exon_range(exonStart, exonStart + 149));
+            }
+        }
+    }
+    
+    gene_mapper_set_header(geneMapper, header);
+    gene_mapper_build_index(geneMapper);
+    *genomeLengthOut = geneCount * exonsPerGene * 1000;
+    return geneMapper;
+}
+
+static void bench_gene_mapper_functions(void)
+{
+    bcf_hdr_t *header = bench_header(0);
+    int32_t genomeLength = 0;
+    gene_mapper_t *geneMapper = bench_gene_mapper(header, &genomeLength);
+    
+    int32_t *positions = (int32_t *)malloc(sizeof(int32_t) * operationCount);
+    int32_t i;
+    for (i = 0; i < operationCount; i++) {
+        positions[i] = rand() % genomeLength;
+    }
+    
+    bench_timer_t timer;
+    gene_mapping_t mapping;
+    int32_t mappedCount = 0;
+    bench_start(&timer);
+    for (i = 0; i < operationCount; i++) {
+        mappedCount += gene_mapper_map_position(geneMapper, 0, positions[i], &mapping) != -1;
+    }
+    bench_report(&timer, "gene_mapper_map_position", operationCount);
+    benchSink = mappedCount;
+    
+    // positions across the genome, sorted
+    int32_t step = genomeLength / operationCount + 1;
+    mappedCount = 0;
+    bench_start(&timer);
+    for (i = 0; i < operationCount; i++) {
+        mappedCount += gene_mapper_map_position(geneMapper, 0, i * step, &mapping) != -1;
+    }
+    bench_report(&timer, "gene_mapper_map_position (sorted)", operationCount);
+    benchSink = mappedCount;
+    
+    int32_t *genePositions = (int32_t *)malloc(sizeof(int32_t) * operationCount);
+    for (i = 0; i < operationCount; i++) {
+        positions[i] = i * step;
+    }
+    bench_start(&timer);
+    mappedCount = gene_mapper_map_positions(geneMapper, 0, positions, operationCount, genePositions, NULL);
+    bench_report(&timer, "gene_mapper_map_positions (sorted)", operationCount);
+    benchSink = mappedCount;
+    free(genePositions);
+    
+    int32_t geneLength = geneMapper->genes[0]->length;
+    for (i = 0; i < operationCount; i++) {
+        positions[i] = rand() % geneLength;
+    }
+    int32_t genomePositionSum = 0;
+    bench_start(&timer);
+    for (i = 0; i < operationCount; i++) {
+        genomePositionSum += gene_mapper_reversemap_position(geneMapper, i % geneCount, positions[i]);
+    }
+    bench_report(&timer, "gene_mapper_reversemap_position", operationCount);
+    benchSink = genomePositionSum;
+    
+    // the same positions, sorted, in batches of a gene
+    int32_t *genomePositions = (int32_t *)malloc(sizeof(int32_t) * operationCount);
+    for (i = 0; i < operationCount; i++) {
+        positions[i] = (int32_t)((int64_t)i * geneLength / operationCount);
+    }
+    genomePositionSum = 0;
+    bench_start(&timer);
+    gene_mapper_reversemap_positions(geneMapper, 0, positions, genomePositions, operationCount);
+    for (i = 0; i < operationCount; i++) {
+        genomePositionSum += genomePositions[i];
+    }
+    bench_report(&timer, "gene_mapper_reversemap_positions (sorted)", operationCount);
+    benchSink = genomePositionSum;
+    free(genomePositions);
+    
+    free(positions);
+    gene_mapper_destroy(geneMapper);
+    bcf_hdr_destroy(header);
+}
+
+static void bench_complement_functions(void)
+{
+    static const char nucleotides[] = "ACGTacgt";
+    char *sequence = (char *)malloc(sequenceLength + 1);
+    char *complement = (char *)malloc(sequenceLength + 1);
+    int32_t i;
+    for (i = 0; i < sequenceLength; i++) {
+        sequence[i] = nucleotides[rand() % 8];
+    }
+    sequence[sequenceLength] = 0;
+    
+    bench_timer_t timer;
+    int32_t complementSum = 0;
+    bench_start(&timer);
+    for (i = 0; i < operationCount; i++) {
+        complementSum += complement_nucleotide_sequence(sequence)[i % sequenceLength];
+    }
+    bench_report(&timer, "complement_nucleotide_sequence", operationCount);
+    
+    bench_start(&timer);
+    for (i = 0; i < operationCount; i++) {
+        complement_nucleotides(sequence, complement, sequenceLength);
+        complementSum += complement[i % sequenceLength];
+    }
+    bench_report(&timer, "complement_nucleotides", operationCount);
+    
+    bench_start(&timer);
+    for (i = 0; i < operationCount; i++) {
+        reverse_complement_nucleotides(sequence, complement, sequenceLength);
+        complementSum += complement[i % sequenceLength];
+    }
+    bench_report(&timer, "reverse_complement_nucleotides", operationCount);
+    benchSink = complementSum;
+    
+    free(sequence);
+    free(complement);
+}
+
+static void bench_csv_formatter_functions(void)
+{
+    bcf_hdr_t *header = bench_header(sampleCount);
+    
+    // SNPs on distinct gene positions with random, mostly phased, genotypes
+    static const char *alleles[] = {"A,C", "G,T", "C,T", "A,G"};
+    bcf1_t **records = (bcf1_t **)malloc(sizeof(bcf1_t *) * recordCount);
+    int32_t *genotypes = (int32_t *)malloc(sizeof(int32_t) * sampleCount * 2);
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < recordCount; i++) {
+        bcf1_t *record = bcf_init();
+        record->rid = 0;
+        record->pos = i;
+        bcf_update_alleles_str(header, record, alleles[i % 4]);
+        int32_t genePosition = i + 1;
+        bcf_update_info_int32(header, record, GENEMAP, &genePosition, 1);
+        bcf_update_info_string(header, record, GENEMAP_NAME, "gene0");
+        bcf_update_info_string(header, record, GENEMAP_STRAND, (i % 2) ? minusstrandString : plusstrandString);
+        for (j = 0; j < sampleCount; j++) {
+            int phased = rand() % 10 != 0;
+            genotypes[j*2] = bcf_gt_unphased(rand() % 2);
+            genotypes[j*2+1] = phased ? bcf_gt_phased(rand() % 2) : bcf_gt_unphased(rand() % 2);
+        }
+        bcf_update_genotypes(header, record, genotypes, sampleCount * 2);
+        records[i] = record;
+    }
+    free(genotypes);
+    
+    csv_formatter_t *csvFormatter = csv_formatter_init(header);
+    bench_timer_t timer;
+    bench_start(&timer);
+    for (i = 0; i < recordCount; i++) {
+        csv_formatter_add_record(csvFormatter, header, records[i]);
+    }
+    bench_report(&timer, "csv_formatter_add_record", recordCount);
+    
+    FILE *nullFp = fopen("/dev/null", "w");
+    csv_writer_t *csvWriter = csv_writer_init(nullFp);
+    bench_start(&timer);
+    csv_formatter_print(csvFormatter, csvWriter);
+    csv_writer_flush(csvWriter);
+    bench_report(&timer, "csv_formatter_print (per record)", recordCount);
+    csv_writer_destroy(csvWriter);
+    fclose(nullFp);
+    
+    csv_formatter_destroy(csvFormatter);
+    for (i = 0; i < recordCount; i++) {
+        bcf_destroy(records[i]);
+    }
+    free(records);
+    bcf_hdr_destroy(header);
+}
+
+static void print_usage(FILE *fp, int exit_code)
+{
+    fprintf(fp, "Usage: bcfgenemapper_bench [options]\n\n"
+            "  -g number  Genes, default 20.\n"
+            "  -e number  Exons per gene, default 12.\n"
+            "  -n number  Operations of the mapping and complement benchmarks, default 1000000.\n"
+            "  -l number  Length of the complemented sequence, default 64.\n"
+            "  -s number  Samples of the csv benchmarks, default 2000.\n"
+            "  -r number  Records of the csv benchmarks, default 2000.\n"
+            "Allocations made by htslib are not counted.\n");
+    exit(exit_code);
+}
+
+int main(int argc, char * const *argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "g:e:n:l:s:r:h")) != -1) {
+        int32_t value = (c == 'h' || c == '?') ? 0 : atoi(optarg);
+        switch (c) {
+            case 'g':
+                geneCount = value;
+                break;
+            case 'e':
+                exonsPerGene = value;
+                break;
+            case 'n':
+                operationCount = value;
+                break;
+            case 'l':
+                sequenceLength = value;
+                break;
+            case 's':
+                sampleCount = value;
+                break;
+            case 'r':
+                recordCount = value;
+                break;
+            case 'h':
+                print_usage(stdout, 0);
+            default:
+                print_usage(stderr, 1);
+        }
+        if (value < 1) {
+            fprintf(stderr, "Invalid value: '%s'.\n", optarg);
+            print_usage(stderr, 1);
+        }
+    }
+    
+    srand(1);
+    printf("%-44s %12s %12s %12s\n", "benchmark", "operations", "ns/op", "allocs/op");
+    bench_gene_mapper_functions();
+    bench_complement_functions();
+    bench_csv_formatter_functions();
+    
+    return 0;
+}
@@ -0,0 +1,247 @@
+//
+//  gencohort.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+/* Writes a synthetic, sorted, cohort VCF/BCF with random SNPs around the exons of exon files, to measure the
+   throughput of bcfgenemapper. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <htslib/vcf.h>
+#include <htslib/hts.h>
+
+#include "genemapper.h"
+
+#define GENCOHORT_MAX_EXON_FILES 16
+#define GENCOHORT_FLANK 50000 // the positions outside the exons are at most this far from them
+
+static int compare_positions(const void *position1Ptr, const void *position2Ptr)
+{
+    int32_t position1 = *(const int32_t *)position1Ptr;
+    int32_t position2 = *(const int32_t *)position2Ptr;
+    return (position1 > position2) - (position1 < position2);
+}
+
+static double random_fraction(void)
+{
+    return (double)rand() / ((double)RAND_MAX + 1.0);
+}
+
+static int32_t region_index(genomic_region_t *regions, int32_t regionCount, int32_t position) // -1 if the position is in no region
+{
+    int32_t i;
+    for (i = 0; i < regionCount; i++) {
+        if (position >= regions[i].start && position <= regions[i].end) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void print_usage(FILE *fp, int exit_code)
+{
+    fprintf(fp, "Usage: gencohort [options] -e exonfile [-e exonfile...]\n\n"
+            "  -o filename  Output file, default stdout.\n"
+            "  -O b|u|z|v   Output type, default v.\n"
+            "  -s number    Samples, default 100.\n"
+            "  -r number    Records, default 100000.\n"
+            "  -f fraction  Fraction of the records in the exons, default 0.1.\n"
+            "  -c contig    Contig of the records, default 1.\n"
+            "  -i           Write a CSI index, for the b and z output types.\n"
+            "  -S number    Random seed, default 1.\n");
+    exit(exit_code);
+}
+
+int main(int argc, char * const *argv)
+{
+    const char *exonFilenames[GENCOHORT_MAX_EXON_FILES];
+    int32_t exonFileCount = 0;
+    const char *outputFilename = "-";
+    const char *outputType = "v";
+    const char *contig = "1";
+    int32_t sampleCount = 100;
+    int32_t recordCount = 100000;
+    double exonFraction = 0.1;
+    int writeIndex = 0;
+    int c;
+    
+    srand(1);
+    while ((c = getopt(argc, argv, "e:o:O:s:r:f:c:iS:h")) != -1) {
+        switch (c) {
+            case 'e':
+                if (exonFileCount == GENCOHORT_MAX_EXON_FILES) {
+                    fprintf(stderr, "Too many exon files.\n");
+                    print_usage(stderr, 1);
+                }
+                exonFilenames[exonFileCount] = optarg;
+                exonFileCount++;
+                break;
+            case 'o':
+                outputFilename = optarg;
+                break;
+            case 'O':
+                outputType = optarg;
+                break;
+            case 's':
+                sampleCount = atoi(optarg);
+                break;
+            case 'r':
+                recordCount = atoi(optarg);
+                break;
+            case 'f':
+                exonFraction = atof(optarg);
+                break;
+            case 'c':
+                contig = optarg;
+                break;
+            case 'i':
+                writeIndex = 1;
+                break;
+            case 'S':
+                srand((unsigned int)atoi(optarg));
+                break;
+            case 'h':
+                print_usage(stdout, 0);
+            default:
+                print_usage(stderr, 1);
+        }
+    }
+    if (exonFileCount == 0 || sampleCount < 1 || recordCount < 1 || exonFraction < 0 || exonFraction > 1 || strlen(outputType) != 1) {
+        print_usage(stderr, 1);
+    }
+    if (writeIndex && (strcmp(outputFilename, "-") == 0 || (outputType[0] != 'b' && outputType[0] != 'z'))) {
+        fprintf(stderr, "Only compressed output files can be indexed.\n");
+        print_usage(stderr, 1);
+    }
+    
+    // the exons of all the files, merged
+    gene_mapper_t *geneMapper = gene_mapper_init();
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < exonFileCount; i++) {
+        FILE *exonFp = fopen(exonFilenames[i], "r");
+        if (exonFp == NULL) {
+            fprintf(stderr, "Unable to open exon file. '%s'.\n", exonFilenames[i]);
+            exit(1);
+        }
+        gene_mapper_t *fileGeneMapper = gene_mapper_file_init(exonFp);
+        fclose(exonFp);
+        for (j = 0; j < gene_mapper_gene_count(fileGeneMapper); j++) {
+            gene_t *gene = fileGeneMapper->genes[j];
+            gene_mapper_add_gene(geneMapper, gene->name, NULL);
+            int32_t k;
+            for (k = 0; k < gene->exonCount; k++) {
+                gene_mapper_add_exon(geneMapper, gene->exons[k]);
+            }
+        }
+        gene_mapper_destroy(fileGeneMapper);
+    }
+    int32_t regionCount = 0;
+    genomic_region_t *regions = gene_mapper_genomic_regions(geneMapper, &regionCount);
+    if (regionCount == 0) {
+        fprintf(stderr, "No exons in the exon files.\n");
+        exit(1);
+    }
+    int32_t firstPosition = regions[0].start > GENCOHORT_FLANK ? regions[0].start - GENCOHORT_FLANK : 0;
+    int32_t lastPosition = regions[regionCount - 1].end + GENCOHORT_FLANK;
+    int64_t exonLength = 0;
+    for (i = 0; i < regionCount; i++) {
+        exonLength += regions[i].end - regions[i].start + 1;
+    }
+    
+    int32_t *positions = (int32_t *)malloc(sizeof(int32_t) * recordCount);
+    for (i = 0; i < recordCount; i++) {
+        if (random_fraction() < exonFraction) {
+            int64_t exonPosition = (int64_t)(random_fraction() * (double)exonLength);
+            for (j = 0; exonPosition > regions[j].end - regions[j].start; j++) {
+                exonPosition -= regions[j].end - regions[j].start + 1;
+            }
+            positions[i] = regions[j].start + (int32_t)exonPosition;
+        } else {
+            do {
+                positions[i] = firstPosition + (int32_t)(random_fraction() * (double)(lastPosition - firstPosition + 1));
+            } while (region_index(regions, regionCount, positions[i]) != -1);
+        }
+    }
+    qsort(positions, recordCount, sizeof(int32_t), compare_positions);
+    
+    char mode[] = "w?";
+    mode[1] = outputType[0];
+    htsFile *outFile = hts_open(outputFilename, mode);
+    if (outFile == NULL) {
+        fprintf(stderr, "Unable to open output file '%s'.\n", outputFilename);
+        exit(1);
+    }
+    
+    bcf_hdr_t *header = bcf_hdr_init("w");
+    kstring_t headerLine = {0, 0, NULL};
+    ksprintf(&headerLine, "##contig=<ID=%s>", contig);
+    bcf_hdr_append(header, headerLine.s);
+    free(headerLine.s);
+    bcf_hdr_append(header, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    for (i = 0; i < sampleCount; i++) {
+        char sampleName[32];
+        sprintf(sampleName, "sample%d", (int)i);
+        bcf_hdr_add_sample(header, sampleName);
+    }
+    bcf_hdr_add_sample(header, NULL);
+    bcf_hdr_sync(header);
+    if (bcf_hdr_write(outFile, header) != 0) {
+        fprintf(stderr, "Unable to write the header to '%s'.\n", outputFilename);
+        exit(1);
+    }
+    if (writeIndex && bcf_idx_init(outFile, header, 14, NULL) != 0) {
+        fprintf(stderr, "Unable to index '%s'.\n", outputFilename);
+        exit(1);
+    }
+    
+    // phased genotypes with a random alternate allele frequency, and a few missing genotypes
+    static const char nucleotides[] = "ACGT";
+    int32_t *genotypes = (int32_t *)malloc(sizeof(int32_t) * sampleCount * 2);
+    bcf1_t *record = bcf_init();
+    for (i = 0; i < recordCount; i++) {
+        bcf_clear(record);
+        record->rid = 0;
+        record->pos = positions[i];
+        int32_t reference = rand() % 4;
+        char alleles[] = {nucleotides[reference], ',', nucleotides[(reference + 1 + rand() % 3) % 4], 0};
+        bcf_update_alleles_str(header, record, alleles);
+        
+        double alternateFrequency = 0.01 + random_fraction() * 0.49;
+        for (j = 0; j < sampleCount * 2; j++) {
+            if (random_fraction() < 0.01) {
+                genotypes[j] = bcf_gt_missing;
+            } else if (j % 2) {
+                genotypes[j] = bcf_gt_phased(random_fraction() < alternateFrequency);
+            } else {
+                genotypes[j] = bcf_gt_unphased(random_fraction() < alternateFrequency);
+            }
+        }
+        bcf_update_genotypes(header, record, genotypes, sampleCount * 2);
+        if (bcf_write(outFile, header, record) != 0) {
+            fprintf(stderr, "Unable to write to '%s'.\n", outputFilename);
+            exit(1);
+        }
+    }
+    
+    if (writeIndex && bcf_idx_save(outFile) != 0) {
+        fprintf(stderr, "Unable to save the index of '%s'.\n", outputFilename);
+        exit(1);
+    }
+    
+    bcf_destroy(record);
+    free(genotypes);
+    bcf_hdr_destroy(header);
+    hts_close(outFile);
+    free(positions);
+    free(regions);
+    gene_mapper_destroy(geneMapper);
+    
+    return 0;
+}
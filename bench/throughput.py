@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+#
+#  throughput.py
+#  bcfgenemapper
+#
+#  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+#
+
+"""End-to-end throughput of bcfgenemapper on a synthetic cohort made by gencohort.
+
+Runs the bcfgenemapper binary in every output mode on the same input, and reports the
+records/s, input MB/s, peak RSS and wall time of the fastest of the repeated runs.
+The results can be saved as a baseline, and compared to a baseline to flag the modes
+whose throughput dropped more than a threshold (the exit code is then 1)."""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+# name, bcfgenemapper options, the output file name is appended to the options that end with -o or -c
+MODES = [
+    ("bcf", ["-O", "b", "-o"], "out.bcf"),
+    ("ubcf", ["-O", "u", "-o"], "out.bcf"),
+    ("vcf.gz", ["-O", "z", "-o"], "out.vcf.gz"),
+    ("vcf", ["-O", "v", "-o"], "out.vcf"),
+    ("csv", ["-c"], "out.csv"),
+    ("strip", ["-s", "-O", "b", "-o"], "out.bcf"),
+]
+
+
+def write_gene_file(path, exon_files, contig):
+    with open(path, "w") as gene_file:
+        for exon_file in exon_files:
+            name = os.path.basename(exon_file)
+            if name.endswith("Exons"):
+                name = name[:-len("Exons")]
+            gene_file.write("Gene: %s %s\n" % (name, contig))
+            with open(exon_file) as exons:
+                gene_file.write(exons.read().rstrip("\n") + "\n")
+
+
+def run(command):
+    """Returns the wall time in seconds and the peak RSS in bytes of the command."""
+    start = time.monotonic()
+    process = subprocess.Popen(command, stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(process.pid, 0)
+    seconds = time.monotonic() - start
+    exit_code = os.waitstatus_to_exitcode(status)
+    if exit_code != 0:
+        sys.exit("'%s' failed with exit code %d" % (" ".join(command), exit_code))
+    peak_rss = usage.ru_maxrss if sys.platform == "darwin" else usage.ru_maxrss * 1024
+    return seconds, peak_rss
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--bcfgenemapper", default=os.path.join(REPO_DIR, "bcfgenemapper"))
+    parser.add_argument("--gencohort", default=os.path.join(BENCH_DIR, "gencohort"))
+    parser.add_argument("--exons", nargs="+", default=[os.path.join(REPO_DIR, "RHDExons"), os.path.join(REPO_DIR, "RHCEExons")])
+    parser.add_argument("--samples", type=int, default=1000)
+    parser.add_argument("--records", type=int, default=20000)
+    parser.add_argument("--exon-fraction", type=float, default=0.1)
+    parser.add_argument("--index", action="store_true", help="index the input, so that --strip and --csv only read the exons")
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--repeat", type=int, default=3, help="runs per mode, the fastest is reported")
+    parser.add_argument("--modes", nargs="+", choices=[mode[0] for mode in MODES], default=[mode[0] for mode in MODES])
+    parser.add_argument("--save-baseline", metavar="FILE", help="write the results to this JSON file")
+    parser.add_argument("--baseline", metavar="FILE", help="compare the results to this JSON file")
+    parser.add_argument("--threshold", type=float, default=0.1, help="records/s drop flagged as a regression, default 0.1 (10%%)")
+    arguments = parser.parse_args()
+
+    work_dir = tempfile.mkdtemp(prefix="bcfgenemapper-throughput-")
+    try:
+        contig = "1"
+        gene_path = os.path.join(work_dir, "genes")
+        write_gene_file(gene_path, arguments.exons, contig)
+
+        input_path = os.path.join(work_dir, "cohort.bcf")
+        command = [arguments.gencohort, "-O", "b", "-o", input_path, "-s", str(arguments.samples),
+                   "-r", str(arguments.records), "-f", str(arguments.exon_fraction), "-c", contig]
+        for exon_file in arguments.exons:
+            command += ["-e", exon_file]
+        if arguments.index:
+            command.append("-i")
+        subprocess.check_call(command)
+        input_megabytes = os.path.getsize(input_path) / 1e6
+
+        configuration = {
+            "samples": arguments.samples,
+            "records": arguments.records,
+            "exon_fraction": arguments.exon_fraction,
+            "index": arguments.index,
+            "threads": arguments.threads,
+        }
+        results = {}
+        print("%-8s %12s %10s %12s %10s" % ("mode", "records/s", "MB/s", "peak RSS MB", "wall s"))
+        for name, options, output_name in MODES:
+            if name not in arguments.modes:
+                continue
+            command = [arguments.bcfgenemapper, "-e", gene_path, "-t", str(arguments.threads)]
+            command += options + [os.path.join(work_dir, output_name), input_path]
+            runs = [run(command) for _ in range(arguments.repeat)]
+            seconds = min(run_seconds for run_seconds, _ in runs)
+            peak_rss = max(run_peak_rss for _, run_peak_rss in runs)
+            results[name] = {
+                "records_per_second": arguments.records / seconds,
+                "megabytes_per_second": input_megabytes / seconds,
+                "peak_rss_bytes": peak_rss,
+                "wall_seconds": seconds,
+            }
+            print("%-8s %12.0f %10.2f %12.1f %10.3f" % (name, arguments.records / seconds, input_megabytes / seconds, peak_rss / 1e6, seconds))
+    finally:
+        shutil.rmtree(work_dir)
+
+    if arguments.save_baseline:
+        with open(arguments.save_baseline, "w") as baseline_file:
+            json.dump({"configuration": configuration, "results": results}, baseline_file, indent=2, sort_keys=True)
+            baseline_file.write("\n")
+
+    if arguments.baseline:
+        with open(arguments.baseline) as baseline_file:
+            baseline = json.load(baseline_file)
+        if baseline.get("configuration") != configuration:
+            print("warning: the baseline was measured with a different configuration: %s" % baseline.get("configuration"))
+        regressions = []
+        for name, result in results.items():
+            if name not in baseline["results"]:
+                continue
+            baseline_rate = baseline["results"][name]["records_per_second"]
+            change = result["records_per_second"] / baseline_rate - 1
+            flag = ""
+            if change < -arguments.threshold:
+                flag = "  REGRESSION"
+                regressions.append(name)
+            print("%-8s %+7.1f%% records/s compared to the baseline%s" % (name, change * 100, flag))
+        if regressions:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
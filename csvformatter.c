@@ -7,12 +7,35 @@
 //
 
 #include <stdio.h>
+#include <htslib/khash_str2int.h>
 
 #include "csvformatter.h"
+#include "nucleotide.h"
 #include "main.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSV_FORMATTER_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 static const char *emptyString = "";
 
+int csv_format_parse(const char *formatString, csv_format_t *formatOut)
+{
+    if (strcmp(formatString, "wide") == 0) {
+        *formatOut = csvformatwide;
+    } else if (strcmp(formatString, "long") == 0) {
+        *formatOut = csvformatlong;
+    } else if (strcmp(formatString, "ndjson") == 0) {
+        *formatOut = csvformatndjson;
+    } else if (strcmp(formatString, "matrix") == 0) {
+        *formatOut = csvformatmatrix;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
 csv_formatter_sample_t *csv_formatter_sample_init(const char *sampleName, char allele)
 {
     csv_formatter_sample_t *newSample = (csv_formatter_sample_t *)malloc(sizeof(csv_formatter_sample_t));
@@ -34,17 +57,14 @@ void csv_formatter_sample_destroy(csv_formatter_sample_t* sample)
     free(sample);
 }
 
-csv_formatter_variation_list_t *csv_formatter_variation_list_init(int32_t sampleCount, int32_t position)
+csv_formatter_variation_list_t *csv_formatter_variation_list_init(const char *sequenceName, int32_t position, int32_t genotypeRow)
 {
     csv_formatter_variation_list_t *newVariations = (csv_formatter_variation_list_t *)malloc(sizeof(csv_formatter_variation_list_t));
+    memset(newVariations, 0, sizeof(csv_formatter_variation_list_t));
     
     newVariations->position = position;
-    newVariations->variationsCount = sampleCount;
-    newVariations->variations = (const char **)malloc(sizeof(char *) * sampleCount);
-    int32_t i;
-    for (i = 0; i < newVariations->variationsCount; i++) {
-        newVariations->variations[i] = emptyString;
-    }
+    newVariations->sequenceName = sequenceName;
+    newVariations->genotypeRow = genotypeRow;
     
     return newVariations;
 }
@@ -52,29 +72,52 @@ csv_formatter_variation_list_t *csv_formatter_variation_list_init(int32_t sample
 void csv_formatter_variation_list_destroy(csv_formatter_variation_list_t *variationList)
 {
     int i;
-    for (i = 0; i < variationList->variationsCount; i++) {
-        if (variationList->variations[i] != emptyString) {
-            free((char *)variationList->variations[i]);
-        }
+    for (i = 0; i < variationList->alleleCount; i++) {
+        free(variationList->alleles[i]);
     }
-    free(variationList->variations);
+    free(variationList->alleles);
     free(variationList);
 }
 
-void csv_formatter_variation_list_add(csv_formatter_variation_list_t *variationList, const char * variation, int32_t sampleIndex)
+csv_formatter_genotype_t csv_formatter_variation_list_add_allele(csv_formatter_variation_list_t *variationList, const char *allele)
 {
-    if (variationList->variationsCount <= sampleIndex) {
-        fprintf(stderr, "[%s:%d %s] sampleIndex %d out of bounds\n", __FILE__, __LINE__, __FUNCTION__, sampleIndex);
-        abort();
+    int32_t i;
+    for (i = 0; i < variationList->alleleCount; i++) {
+        if (strcmp(variationList->alleles[i], allele) == 0) {
+            return (csv_formatter_genotype_t)(CSV_FORMATTER_GENOTYPE_FIRST_ALLELE + i);
+        }
     }
     
-    if (variationList->variations[sampleIndex] != emptyString) {
-        free((char *)variationList->variations[sampleIndex]);
+    if (variationList->alleleCount == CSV_FORMATTER_GENOTYPE_MAX_ALLELES) {
+        fprintf(stderr, "[%s:%d %s] too many alleles at position %d\n", __FILE__, __LINE__, __FUNCTION__, (int)variationList->position);
+        abort();
     }
+    if (variationList->alleleCount == variationList->allelesAllocated) {
+        variationList->allelesAllocated = variationList->allelesAllocated ? variationList->allelesAllocated * 2 : 4;
+        variationList->alleles = (char **)realloc(variationList->alleles, sizeof(char *) * variationList->allelesAllocated);
+    }
+    char *newAllele = (char *)malloc(strlen(allele) + 1);
+    strcpy(newAllele, allele);
+    variationList->alleles[variationList->alleleCount] = newAllele;
+    variationList->alleleCount++;
     
-    char *newVariation = (char *)malloc(strlen(variation) + 1);
-    strcpy(newVariation, variation);
-    variationList->variations[sampleIndex] = newVariation;
+    return (csv_formatter_genotype_t)(CSV_FORMATTER_GENOTYPE_FIRST_ALLELE + variationList->alleleCount - 1);
+}
+
+// returns the text of a genotype code that is not unphased
+static const char *csv_formatter_variation_list_genotype_string(csv_formatter_variation_list_t *variationList, csv_formatter_genotype_t genotype)
+{
+    genotype &= ~CSV_FORMATTER_GENOTYPE_UNPHASED;
+    switch (genotype) {
+        case CSV_FORMATTER_GENOTYPE_EMPTY:
+            return emptyString;
+        case CSV_FORMATTER_GENOTYPE_MISSING:
+            return "N";
+        case CSV_FORMATTER_GENOTYPE_VECTOR_END:
+            return "-";
+        default:
+            return variationList->alleles[genotype - CSV_FORMATTER_GENOTYPE_FIRST_ALLELE];
+    }
 }
 
 csv_formatter_t *csv_formatter_init(bcf_hdr_t *bcfHeader)
@@ -100,9 +143,80 @@ csv_formatter_t *csv_formatter_init(bcf_hdr_t *bcfHeader)
     newFormatter->variationLists = (csv_formatter_variation_list_t **)malloc(sizeof(csv_formatter_variation_list_t *));
     memset(newFormatter->variationLists, 0, sizeof(csv_formatter_variation_list_t **));
     
+    newFormatter->genotypeRowsAllocated = 1;
+    newFormatter->genotypes = (csv_formatter_genotype_t *)malloc(sizeof(csv_formatter_genotype_t) * (newFormatter->sampleCount + 1));
+    
+    newFormatter->sequenceNameHash = khash_str2int_init();
+    
+    return newFormatter;
+}
+
+csv_formatter_t *csv_formatter_stream_init(bcf_hdr_t *bcfHeader, csv_format_t format, csv_writer_t *csvWriter)
+{
+    if (format != csvformatlong && format != csvformatndjson) {
+        fprintf(stderr, "[%s:%d %s] only the long and ndjson formats can be streamed\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    
+    csv_formatter_t *newFormatter = csv_formatter_init(bcfHeader);
+    newFormatter->format = format;
+    newFormatter->streamWriter = csvWriter;
+    newFormatter->essentialPositionHash = khash_str2int_init();
+    
+    if (format == csvformatlong) {
+        csv_writer_puts(csvWriter, "Gene\tPosition\tSample\tHaplotype\tGenotype\tPhased\n");
+    }
+    
     return newFormatter;
 }
 
+int32_t csv_formatter_add_samples(csv_formatter_t* csvFormatter, bcf_hdr_t *bcfHeader)
+{
+    if (csvFormatter->genotypeRowCount || csvFormatter->spillFileCount) {
+        fprintf(stderr, "[%s:%d %s] samples can't be added once records are added\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    
+    int32_t firstSampleIndex = csvFormatter->sampleCount;
+    csvFormatter->sampleCount += bcf_hdr_nsamples(bcfHeader) * 2;
+    csvFormatter->samples = (csv_formatter_sample_t **)realloc(csvFormatter->samples, sizeof(csv_formatter_sample_t*) * csvFormatter->sampleCount);
+    
+    int i;
+    for (i=0; i<bcf_hdr_nsamples(bcfHeader); i++)
+    {
+        char *name = bcfHeader->samples[i];
+        
+        csvFormatter->samples[firstSampleIndex + i*2] = csv_formatter_sample_init(name, 1);
+        csvFormatter->samples[firstSampleIndex + i*2+1] = csv_formatter_sample_init(name, 2);
+    }
+    
+    csvFormatter->genotypes = (csv_formatter_genotype_t *)realloc(csvFormatter->genotypes,
+                                                                  sizeof(csv_formatter_genotype_t) * (size_t)csvFormatter->genotypeRowsAllocated * (csvFormatter->sampleCount + 1));
+    
+    return firstSampleIndex;
+}
+
+// returns the formatter's copy of the sequence name
+static const char *csv_formatter_sequence_name(csv_formatter_t* csvFormatter, const char *sequenceName)
+{
+    int sequenceNameIndex;
+    if (khash_str2int_get(csvFormatter->sequenceNameHash, sequenceName, &sequenceNameIndex) == 0) {
+        return csvFormatter->sequenceNames[sequenceNameIndex];
+    }
+    
+    if (csvFormatter->sequenceNameCount == csvFormatter->sequenceNamesAllocated) {
+        csvFormatter->sequenceNamesAllocated = csvFormatter->sequenceNamesAllocated ? csvFormatter->sequenceNamesAllocated * 2 : 4;
+        csvFormatter->sequenceNames = (char **)realloc(csvFormatter->sequenceNames, sizeof(char *) * csvFormatter->sequenceNamesAllocated);
+    }
+    char *newSequenceName = (char *)malloc(strlen(sequenceName) + 1);
+    strcpy(newSequenceName, sequenceName);
+    csvFormatter->sequenceNames[csvFormatter->sequenceNameCount] = newSequenceName;
+    khash_str2int_set(csvFormatter->sequenceNameHash, newSequenceName, csvFormatter->sequenceNameCount);
+    csvFormatter->sequenceNameCount++;
+    
+    return newSequenceName;
+}
+
 
 void csv_formatter_destroy(csv_formatter_t* csvFormatter)
 {
@@ -118,6 +232,29 @@ void csv_formatter_destroy(csv_formatter_t* csvFormatter)
         csv_formatter_variation_list_destroy(csvFormatter->variationLists[i]);
     }
     free(csvFormatter->variationLists);
+    free(csvFormatter->genotypes);
+    free(csvFormatter->complement);
+    free(csvFormatter->genemapPositionArray);
+    free(csvFormatter->infoString);
+    free(csvFormatter->alleleGenotypes);
+    
+    khash_str2int_destroy(csvFormatter->sequenceNameHash);
+    for (i = 0; i < csvFormatter->sequenceNameCount; i++) {
+        free(csvFormatter->sequenceNames[i]);
+    }
+    free(csvFormatter->sequenceNames);
+    
+    if (csvFormatter->essentialPositionHash) {
+        khash_str2int_destroy_free(csvFormatter->essentialPositionHash);
+    }
+    if (csvFormatter->mergedPositionHash) {
+        khash_str2int_destroy_free(csvFormatter->mergedPositionHash);
+    }
+    free(csvFormatter->positionKey);
+    for (i = 0; i < csvFormatter->spillFileCount; i++) {
+        fclose(csvFormatter->spillFiles[i]);
+    }
+    free(csvFormatter->spillFiles);
     
     free(csvFormatter);
 }
@@ -126,6 +263,9 @@ static int compare_variant_lists(const void * variantList1Ptr, const void *varia
 {
     csv_formatter_variation_list_t *variantList1 = *(csv_formatter_variation_list_t **)variantList1Ptr;
     csv_formatter_variation_list_t *variantList2 = *(csv_formatter_variation_list_t **)variantList2Ptr;
+    if (variantList1->sequenceName != variantList2->sequenceName) {
+        return strcmp(variantList1->sequenceName, variantList2->sequenceName);
+    }
     if (variantList1->position < variantList2->position) {
         return -1;
     } else if (variantList1->position == variantList2->position) {
@@ -137,9 +277,11 @@ static int compare_variant_lists(const void * variantList1Ptr, const void *varia
 
 void csv_formatter_collapse_variant_lists(csv_formatter_t* csvFormatter)
 {
+    int64_t startTime = stats_start(csvFormatter->stats);
     csv_formatter_sort_variant_lists(csvFormatter);
     
     if (csvFormatter->variationListsCount == 0) {
+        stats_stop(csvFormatter->stats, statsstagecsvcollapse, startTime);
         return;
     }
     
@@ -151,38 +293,49 @@ void csv_formatter_collapse_variant_lists(csv_formatter_t* csvFormatter)
     int i;
     int j = 0;
     for (i = 1; i < csvFormatter->variationListsCount; i++) {
-        if (csvFormatter->variationLists[i]->position != currentVariationList->position) {
+        if (csvFormatter->variationLists[i]->position != currentVariationList->position ||
+            csvFormatter->variationLists[i]->sequenceName != currentVariationList->sequenceName) {
             j++;
             collapsedVariationLists[j] = csvFormatter->variationLists[i];
             currentVariationList = collapsedVariationLists[j];
         } else {
-            int k;
-            if (strcmp(currentVariationList->variations[0], csvFormatter->variationLists[i]->variations[0]) == 0) {
-                for (k = 0; k < currentVariationList->variationsCount; k++) {
-                    if (currentVariationList->variations[k] == NULL || currentVariationList->variations[k] == emptyString) {
-                        currentVariationList->variations[k] = csvFormatter->variationLists[i]->variations[k];
-                    } else {
-                        if (csvFormatter->variationLists[i]->variations[k] != emptyString) {
-                            free((char *)csvFormatter->variationLists[i]->variations[k]);
-                        }
+            csv_formatter_variation_list_t *variationList = csvFormatter->variationLists[i];
+            csv_formatter_genotype_t *currentGenotypes = csv_formatter_genotypes(csvFormatter, currentVariationList);
+            csv_formatter_genotype_t *genotypes = csv_formatter_genotypes(csvFormatter, variationList);
+            const char *currentReference = csv_formatter_variation_list_genotype_string(currentVariationList, currentGenotypes[0]);
+            const char *reference = csv_formatter_variation_list_genotype_string(variationList, genotypes[0]);
+            if (strcmp(currentReference, reference) == 0) {
+                // the alleles are numbered per variation list, so codes are translated to the alleles of the current list
+                csv_formatter_genotype_t *genotypeMap = (csv_formatter_genotype_t *)malloc(sizeof(csv_formatter_genotype_t) * (variationList->alleleCount + CSV_FORMATTER_GENOTYPE_FIRST_ALLELE));
+                int k;
+                for (k = 0; k < CSV_FORMATTER_GENOTYPE_FIRST_ALLELE; k++) {
+                    genotypeMap[k] = (csv_formatter_genotype_t)k;
+                }
+                for (k = 0; k < variationList->alleleCount; k++) {
+                    genotypeMap[k + CSV_FORMATTER_GENOTYPE_FIRST_ALLELE] = csv_formatter_variation_list_add_allele(currentVariationList, variationList->alleles[k]);
+                }
+                for (k = 0; k < csvFormatter->sampleCount + 1; k++) {
+                    if (currentGenotypes[k] == CSV_FORMATTER_GENOTYPE_EMPTY) {
+                        currentGenotypes[k] = genotypeMap[genotypes[k] & ~CSV_FORMATTER_GENOTYPE_UNPHASED] | (genotypes[k] & CSV_FORMATTER_GENOTYPE_UNPHASED);
                     }
                 }
-                free(csvFormatter->variationLists[i]);
+                free(genotypeMap);
+                csv_formatter_variation_list_destroy(variationList);
             } else {
                 const char *genomicNt = NULL;
                 const char *variantNt = NULL;
-                if (currentVariationList->variations[1] == NULL || currentVariationList->variations[1] == emptyString) {
-                    genomicNt = currentVariationList->variations[0];
-                    variantNt = csvFormatter->variationLists[i]->variations[0];
+                if (currentGenotypes[1] == CSV_FORMATTER_GENOTYPE_EMPTY) {
+                    genomicNt = currentReference;
+                    variantNt = reference;
                 } else {
-                    variantNt = currentVariationList->variations[0];
-                    genomicNt = csvFormatter->variationLists[i]->variations[0];
+                    variantNt = currentReference;
+                    genomicNt = reference;
                 }
                 j++;
-                collapsedVariationLists[j] = csvFormatter->variationLists[i];
+                collapsedVariationLists[j] = variationList;
                 currentVariationList = collapsedVariationLists[j];
-                fprintf(stderr, "***WARNING*** The Genomic Reference nucleotide at position %d '%s', is different from the Varient Call nucleotide '%s'.\n",
-                        (int)currentVariationList->position, genomicNt, variantNt);
+                fprintf(stderr, "***WARNING*** The Genomic Reference nucleotide at position %d of %s '%s', is different from the Varient Call nucleotide '%s'.\n",
+                        (int)currentVariationList->position, currentVariationList->sequenceName, genomicNt, variantNt);
             }
         }
     }
@@ -191,6 +344,7 @@ void csv_formatter_collapse_variant_lists(csv_formatter_t* csvFormatter)
     csvFormatter->variationLists = collapsedVariationLists;
     csvFormatter->variationListsAllocated = csvFormatter->variationListsCount;
     csvFormatter->variationListsCount = j + 1;
+    stats_stop(csvFormatter->stats, statsstagecsvcollapse, startTime);
 }
 
 void csv_formatter_sort_variant_lists(csv_formatter_t* csvFormatter)
@@ -198,7 +352,20 @@ void csv_formatter_sort_variant_lists(csv_formatter_t* csvFormatter)
     qsort(csvFormatter->variationLists, csvFormatter->variationListsCount, sizeof(csv_formatter_variation_list_t *), compare_variant_lists);
 }
 
-static csv_formatter_variation_list_t *csv_formatter_new_variation_list(csv_formatter_t* csvFormatter, int32_t genemapPosition) {
+// returns the index of a new row of empty genotypes
+static int32_t csv_formatter_new_genotype_row(csv_formatter_t* csvFormatter)
+{
+    if (csvFormatter->genotypeRowCount == csvFormatter->genotypeRowsAllocated) {
+        csvFormatter->genotypeRowsAllocated *= 2;
+        csvFormatter->genotypes = (csv_formatter_genotype_t *)realloc(csvFormatter->genotypes,
+                                                                      sizeof(csv_formatter_genotype_t) * (size_t)csvFormatter->genotypeRowsAllocated * (csvFormatter->sampleCount + 1));
+    }
+    memset(csvFormatter->genotypes + (size_t)csvFormatter->genotypeRowCount * (csvFormatter->sampleCount + 1), 0, sizeof(csv_formatter_genotype_t) * (csvFormatter->sampleCount + 1));
+    csvFormatter->genotypeRowCount++;
+    return csvFormatter->genotypeRowCount - 1;
+}
+
+static csv_formatter_variation_list_t *csv_formatter_new_variation_list(csv_formatter_t* csvFormatter, const char *sequenceName, int32_t genemapPosition) {
     if (csvFormatter->variationListsCount == csvFormatter->variationListsAllocated) {
         csvFormatter->variationListsAllocated *= 2;
         csvFormatter->variationLists = (csv_formatter_variation_list_t **)realloc(csvFormatter->variationLists, sizeof(csv_formatter_variation_list_t *) * csvFormatter->variationListsAllocated);
@@ -206,220 +373,922 @@ static csv_formatter_variation_list_t *csv_formatter_new_variation_list(csv_form
                sizeof(csv_formatter_variation_list_t *) * (csvFormatter->variationListsAllocated - csvFormatter->variationListsCount));
     }
     csvFormatter->variationListsCount++;
-    csvFormatter->variationLists[csvFormatter->variationListsCount - 1] = csv_formatter_variation_list_init(csvFormatter->sampleCount + 1, genemapPosition);
+    csvFormatter->variationLists[csvFormatter->variationListsCount - 1] = csv_formatter_variation_list_init(csv_formatter_sequence_name(csvFormatter, sequenceName), genemapPosition,
+                                                                                                              csv_formatter_new_genotype_row(csvFormatter));
     return csvFormatter->variationLists[csvFormatter->variationListsCount - 1];
 }
 
-void csv_formatter_add_record(csv_formatter_t* csvFormatter, bcf_hdr_t *header, bcf1_t *record)
+// moves the variation list, which can come from another formatter, to csvFormatter
+static void csv_formatter_append_variation_list(csv_formatter_t* csvFormatter, csv_formatter_variation_list_t *variationList, const csv_formatter_genotype_t *genotypes)
+{
+    if (csvFormatter->variationListsCount == csvFormatter->variationListsAllocated) {
+        csvFormatter->variationListsAllocated *= 2;
+        csvFormatter->variationLists = (csv_formatter_variation_list_t **)realloc(csvFormatter->variationLists, sizeof(csv_formatter_variation_list_t *) * csvFormatter->variationListsAllocated);
+    }
+    variationList->sequenceName = csv_formatter_sequence_name(csvFormatter, variationList->sequenceName);
+    variationList->genotypeRow = csv_formatter_new_genotype_row(csvFormatter);
+    memcpy(csv_formatter_genotypes(csvFormatter, variationList), genotypes, sizeof(csv_formatter_genotype_t) * (csvFormatter->sampleCount + 1));
+    csvFormatter->variationLists[csvFormatter->variationListsCount] = variationList;
+    csvFormatter->variationListsCount++;
+}
+
+/* Once the genotypes use more than the memory limit, the variation lists are sorted and written to a temporary
+   file. When printing, the files are merged, and the merged positions are transposed a block at a time. */
+
+static void csv_formatter_add_spill_file(csv_formatter_t* csvFormatter, FILE *spillFp)
+{
+    if (csvFormatter->spillFileCount == csvFormatter->spillFilesAllocated) {
+        csvFormatter->spillFilesAllocated = csvFormatter->spillFilesAllocated ? csvFormatter->spillFilesAllocated * 2 : 4;
+        csvFormatter->spillFiles = (FILE **)realloc(csvFormatter->spillFiles, sizeof(FILE *) * csvFormatter->spillFilesAllocated);
+    }
+    csvFormatter->spillFiles[csvFormatter->spillFileCount] = spillFp;
+    csvFormatter->spillFileCount++;
+}
+
+static void csv_formatter_spill_write(FILE *spillFp, const void *data, size_t size)
+{
+    if (size && fwrite(data, size, 1, spillFp) != 1) {
+        fprintf(stderr, "Unable to write the temporary csv file.\n");
+        exit(1);
+    }
+}
+
+static int csv_formatter_spill_read(FILE *spillFp, void *data, size_t size)
+{
+    if (size && fread(data, size, 1, spillFp) != 1) {
+        if (ferror(spillFp)) {
+            fprintf(stderr, "Unable to read the temporary csv file.\n");
+            exit(1);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void csv_formatter_spill_write_string(FILE *spillFp, const char *string)
+{
+    int32_t length = (int32_t)strlen(string);
+    csv_formatter_spill_write(spillFp, &length, sizeof(int32_t));
+    csv_formatter_spill_write(spillFp, string, length);
+}
+
+static char *csv_formatter_spill_read_string(FILE *spillFp)
+{
+    int32_t length = 0;
+    if (csv_formatter_spill_read(spillFp, &length, sizeof(int32_t)) != 0) {
+        return NULL;
+    }
+    char *string = (char *)malloc(length + 1);
+    if (csv_formatter_spill_read(spillFp, string, length) != 0) {
+        fprintf(stderr, "[%s:%d %s] truncated temporary csv file\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    string[length] = 0;
+    return string;
+}
+
+// writes the variation lists in memory, sorted, to a new temporary file
+static void csv_formatter_spill(csv_formatter_t* csvFormatter)
+{
+    FILE *spillFp = tmpfile();
+    if (spillFp == NULL) {
+        fprintf(stderr, "Unable to create a temporary csv file.\n");
+        exit(1);
+    }
+    
+    csv_formatter_sort_variant_lists(csvFormatter);
+    
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < csvFormatter->variationListsCount; i++) {
+        csv_formatter_variation_list_t *variationList = csvFormatter->variationLists[i];
+        csv_formatter_spill_write_string(spillFp, variationList->sequenceName);
+        csv_formatter_spill_write(spillFp, &variationList->position, sizeof(int32_t));
+        csv_formatter_spill_write(spillFp, &variationList->alleleCount, sizeof(int32_t));
+        for (j = 0; j < variationList->alleleCount; j++) {
+            csv_formatter_spill_write_string(spillFp, variationList->alleles[j]);
+        }
+        csv_formatter_spill_write(spillFp, csv_formatter_genotypes(csvFormatter, variationList), sizeof(csv_formatter_genotype_t) * (csvFormatter->sampleCount + 1));
+        csv_formatter_variation_list_destroy(variationList);
+    }
+    csvFormatter->variationListsCount = 0;
+    csvFormatter->genotypeRowCount = 0;
+    
+    csv_formatter_add_spill_file(csvFormatter, spillFp);
+}
+
+static void csv_formatter_spill_if_needed(csv_formatter_t* csvFormatter)
+{
+    if (csvFormatter->memoryLimit &&
+        (size_t)csvFormatter->genotypeRowCount * (csvFormatter->sampleCount + 1) * sizeof(csv_formatter_genotype_t) >= csvFormatter->memoryLimit) {
+        csv_formatter_spill(csvFormatter);
+    }
+}
+
+// returns the next variation list of the temporary file, or NULL at the end of the file, genotypesOut gets the genotypes
+static csv_formatter_variation_list_t *csv_formatter_read_spilled_variation_list(csv_formatter_t* csvFormatter, FILE *spillFp, csv_formatter_genotype_t *genotypesOut)
+{
+    char *sequenceName = csv_formatter_spill_read_string(spillFp);
+    if (sequenceName == NULL) {
+        return NULL;
+    }
+    
+    int32_t position = 0;
+    int32_t alleleCount = 0;
+    if (csv_formatter_spill_read(spillFp, &position, sizeof(int32_t)) != 0 || csv_formatter_spill_read(spillFp, &alleleCount, sizeof(int32_t)) != 0) {
+        fprintf(stderr, "[%s:%d %s] truncated temporary csv file\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    
+    csv_formatter_variation_list_t *variationList = csv_formatter_variation_list_init(csv_formatter_sequence_name(csvFormatter, sequenceName), position, -1);
+    free(sequenceName);
+    variationList->alleleCount = alleleCount;
+    variationList->allelesAllocated = alleleCount;
+    variationList->alleles = (char **)malloc(sizeof(char *) * alleleCount);
+    int32_t i;
+    for (i = 0; i < alleleCount; i++) {
+        variationList->alleles[i] = csv_formatter_spill_read_string(spillFp);
+    }
+    if (csv_formatter_spill_read(spillFp, genotypesOut, sizeof(csv_formatter_genotype_t) * (csvFormatter->sampleCount + 1)) != 0) {
+        fprintf(stderr, "[%s:%d %s] truncated temporary csv file\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    
+    return variationList;
+}
+
+void csv_formatter_set_memory_limit(csv_formatter_t* csvFormatter, size_t memoryLimit)
+{
+    csvFormatter->memoryLimit = memoryLimit;
+    csv_formatter_spill_if_needed(csvFormatter);
+}
+
+void csv_formatter_merge(csv_formatter_t* csvFormatter, csv_formatter_t* sourceCsvFormatter)
+{
+    if (csvFormatter->streamWriter || sourceCsvFormatter->streamWriter) {
+        fprintf(stderr, "[%s:%d %s] can't merge streaming formatters\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    if (csvFormatter->sampleCount != sourceCsvFormatter->sampleCount) {
+        fprintf(stderr, "[%s:%d %s] can't merge formatters with %d and %d samples\n", __FILE__, __LINE__, __FUNCTION__, (int)csvFormatter->sampleCount, (int)sourceCsvFormatter->sampleCount);
+        abort();
+    }
+    
+    int32_t i;
+    for (i = 0; i < sourceCsvFormatter->variationListsCount; i++) {
+        csv_formatter_variation_list_t *variationList = sourceCsvFormatter->variationLists[i];
+        csv_formatter_append_variation_list(csvFormatter, variationList, csv_formatter_genotypes(sourceCsvFormatter, variationList));
+    }
+    sourceCsvFormatter->variationListsCount = 0;
+    sourceCsvFormatter->genotypeRowCount = 0;
+    
+    for (i = 0; i < sourceCsvFormatter->spillFileCount; i++) {
+        csv_formatter_add_spill_file(csvFormatter, sourceCsvFormatter->spillFiles[i]);
+    }
+    sourceCsvFormatter->spillFileCount = 0;
+    
+    csv_formatter_spill_if_needed(csvFormatter);
+}
+
+// returns the "name:position" key of the position, in a buffer owned by the formatter
+static const char *csv_formatter_position_key(csv_formatter_t* csvFormatter, const char *sequenceName, int32_t position)
+{
+    size_t keyLength = strlen(sequenceName) + 16;
+    if (keyLength > csvFormatter->positionKeyAllocated) {
+        csvFormatter->positionKeyAllocated = keyLength;
+        csvFormatter->positionKey = (char *)realloc(csvFormatter->positionKey, csvFormatter->positionKeyAllocated);
+    }
+    sprintf(csvFormatter->positionKey, "%s:%d", sequenceName, (int)position);
+    return csvFormatter->positionKey;
+}
+
+// adds the variation list at index to the merged position hash, unless there already is a variation list at its position
+static void csv_formatter_hash_merged_position(csv_formatter_t* csvFormatter, int32_t index)
+{
+    csv_formatter_variation_list_t *variationList = csvFormatter->variationLists[index];
+    const char *positionKey = csv_formatter_position_key(csvFormatter, variationList->sequenceName, variationList->position);
+    if (khash_str2int_has_key(csvFormatter->mergedPositionHash, positionKey) == 0) {
+        char *newPositionKey = (char *)malloc(strlen(positionKey) + 1);
+        strcpy(newPositionKey, positionKey);
+        khash_str2int_set(csvFormatter->mergedPositionHash, newPositionKey, index);
+    }
+}
+
+static void csv_formatter_rebuild_merged_position_hash(csv_formatter_t* csvFormatter)
+{
+    if (csvFormatter->mergedPositionHash) {
+        khash_str2int_destroy_free(csvFormatter->mergedPositionHash);
+    }
+    csvFormatter->mergedPositionHash = khash_str2int_init();
+    int32_t i;
+    for (i = 0; i < csvFormatter->variationListsCount; i++) {
+        csv_formatter_hash_merged_position(csvFormatter, i);
+    }
+    csvFormatter->mergedPositionHashCount = csvFormatter->variationListsCount;
+}
+
+// returns the variation list at the position, or NULL if there is none, sequenceName must be the formatter's copy
+static csv_formatter_variation_list_t *csv_formatter_merged_variation_list(csv_formatter_t* csvFormatter, const char *sequenceName, int32_t position)
+{
+    // the variation lists are reordered when they are sorted, and removed when they are collapsed or spilled
+    if (csvFormatter->mergedPositionHash == NULL || csvFormatter->mergedPositionHashCount != csvFormatter->variationListsCount) {
+        csv_formatter_rebuild_merged_position_hash(csvFormatter);
+    }
+    
+    int index;
+    if (khash_str2int_get(csvFormatter->mergedPositionHash, csv_formatter_position_key(csvFormatter, sequenceName, position), &index) != 0) {
+        return NULL;
+    }
+    if (index >= csvFormatter->variationListsCount ||
+        csvFormatter->variationLists[index]->sequenceName != sequenceName || csvFormatter->variationLists[index]->position != position) {
+        csv_formatter_rebuild_merged_position_hash(csvFormatter);
+        if (khash_str2int_get(csvFormatter->mergedPositionHash, csv_formatter_position_key(csvFormatter, sequenceName, position), &index) != 0) {
+            return NULL;
+        }
+    }
+    return csvFormatter->variationLists[index];
+}
+
+// adds the genotypes of the variation list, which is destroyed, to the row of its position
+static void csv_formatter_merge_variation_list_samples(csv_formatter_t* csvFormatter, csv_formatter_variation_list_t *variationList, const csv_formatter_genotype_t *genotypes,
+                                                       int32_t sampleIndex, int32_t sampleCount)
+{
+    const char *sequenceName = csv_formatter_sequence_name(csvFormatter, variationList->sequenceName);
+    csv_formatter_variation_list_t *mergedVariationList = csv_formatter_merged_variation_list(csvFormatter, sequenceName, variationList->position);
+    if (mergedVariationList && genotypes[0] != CSV_FORMATTER_GENOTYPE_EMPTY) {
+        // a different reference gets its own row, which is reported when the variation lists are collapsed
+        csv_formatter_genotype_t mergedReference = csv_formatter_genotypes(csvFormatter, mergedVariationList)[0];
+        if (mergedReference != CSV_FORMATTER_GENOTYPE_EMPTY &&
+            strcmp(csv_formatter_variation_list_genotype_string(mergedVariationList, mergedReference), csv_formatter_variation_list_genotype_string(variationList, genotypes[0])) != 0) {
+            mergedVariationList = NULL;
+        }
+    }
+    if (mergedVariationList == NULL) {
+        mergedVariationList = csv_formatter_new_variation_list(csvFormatter, sequenceName, variationList->position);
+        csv_formatter_hash_merged_position(csvFormatter, csvFormatter->variationListsCount - 1);
+        csvFormatter->mergedPositionHashCount = csvFormatter->variationListsCount;
+    }
+    
+    // the alleles are numbered per variation list, so codes are translated to the alleles of the merged list
+    if (variationList->alleleCount + CSV_FORMATTER_GENOTYPE_FIRST_ALLELE > csvFormatter->alleleGenotypesAllocated) {
+        csvFormatter->alleleGenotypesAllocated = variationList->alleleCount + CSV_FORMATTER_GENOTYPE_FIRST_ALLELE;
+        csvFormatter->alleleGenotypes = (csv_formatter_genotype_t *)realloc(csvFormatter->alleleGenotypes, sizeof(csv_formatter_genotype_t) * csvFormatter->alleleGenotypesAllocated);
+    }
+    csv_formatter_genotype_t *genotypeMap = csvFormatter->alleleGenotypes;
+    int32_t i;
+    for (i = 0; i < CSV_FORMATTER_GENOTYPE_FIRST_ALLELE; i++) {
+        genotypeMap[i] = (csv_formatter_genotype_t)i;
+    }
+    for (i = 0; i < variationList->alleleCount; i++) {
+        genotypeMap[i + CSV_FORMATTER_GENOTYPE_FIRST_ALLELE] = csv_formatter_variation_list_add_allele(mergedVariationList, variationList->alleles[i]);
+    }
+    
+    csv_formatter_genotype_t *mergedGenotypes = csv_formatter_genotypes(csvFormatter, mergedVariationList);
+    if (mergedGenotypes[0] == CSV_FORMATTER_GENOTYPE_EMPTY) {
+        mergedGenotypes[0] = genotypeMap[genotypes[0]];
+    }
+    mergedGenotypes += sampleIndex + 1;
+    for (i = 0; i < sampleCount; i++) {
+        if (mergedGenotypes[i] == CSV_FORMATTER_GENOTYPE_EMPTY) {
+            mergedGenotypes[i] = genotypeMap[genotypes[i+1] & ~CSV_FORMATTER_GENOTYPE_UNPHASED] | (genotypes[i+1] & CSV_FORMATTER_GENOTYPE_UNPHASED);
+        }
+    }
+    
+    csv_formatter_variation_list_destroy(variationList);
+}
+
+void csv_formatter_merge_samples(csv_formatter_t* csvFormatter, csv_formatter_t* sourceCsvFormatter, int32_t sampleIndex)
+{
+    if (csvFormatter->streamWriter || sourceCsvFormatter->streamWriter) {
+        fprintf(stderr, "[%s:%d %s] can't merge streaming formatters\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    if (sampleIndex < 0 || sampleIndex + sourceCsvFormatter->sampleCount > csvFormatter->sampleCount) {
+        fprintf(stderr, "[%s:%d %s] can't merge %d samples from sample %d of a formatter with %d samples\n", __FILE__, __LINE__, __FUNCTION__,
+                (int)sourceCsvFormatter->sampleCount, (int)sampleIndex, (int)csvFormatter->sampleCount);
+        abort();
+    }
+    
+    int32_t i;
+    for (i = 0; i < sourceCsvFormatter->variationListsCount; i++) {
+        csv_formatter_variation_list_t *variationList = sourceCsvFormatter->variationLists[i];
+        csv_formatter_merge_variation_list_samples(csvFormatter, variationList, csv_formatter_genotypes(sourceCsvFormatter, variationList), sampleIndex, sourceCsvFormatter->sampleCount);
+        csv_formatter_spill_if_needed(csvFormatter);
+    }
+    sourceCsvFormatter->variationListsCount = 0;
+    sourceCsvFormatter->genotypeRowCount = 0;
+    
+    // the spilled variation lists of source are read back, because their rows don't have the samples of csvFormatter
+    csv_formatter_genotype_t *spilledGenotypes = (csv_formatter_genotype_t *)malloc(sizeof(csv_formatter_genotype_t) * (sourceCsvFormatter->sampleCount + 1));
+    for (i = 0; i < sourceCsvFormatter->spillFileCount; i++) {
+        FILE *spillFp = sourceCsvFormatter->spillFiles[i];
+        rewind(spillFp);
+        csv_formatter_variation_list_t *variationList;
+        while ((variationList = csv_formatter_read_spilled_variation_list(sourceCsvFormatter, spillFp, spilledGenotypes)) != NULL) {
+            csv_formatter_merge_variation_list_samples(csvFormatter, variationList, spilledGenotypes, sampleIndex, sourceCsvFormatter->sampleCount);
+            csv_formatter_spill_if_needed(csvFormatter);
+        }
+        fclose(spillFp);
+    }
+    sourceCsvFormatter->spillFileCount = 0;
+    free(spilledGenotypes);
+}
+
+static void csv_formatter_print_json_string(csv_writer_t *csvWriter, const char *string)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    const char *run = string; // characters that don't need to be escaped are written together
+    
+    csv_writer_putc(csvWriter, '"');
+    for (; *string; string++) {
+        unsigned char c = (unsigned char)*string;
+        if (c == '"' || c == '\\' || c < 0x20) {
+            csv_writer_write(csvWriter, run, string - run);
+            run = string + 1;
+            if (c < 0x20) {
+                char escape[6] = {'\\', 'u', '0', '0', hexDigits[c >> 4], hexDigits[c & 0xf]};
+                csv_writer_write(csvWriter, escape, sizeof(escape));
+            } else {
+                csv_writer_putc(csvWriter, '\\');
+                csv_writer_putc(csvWriter, (char)c);
+            }
+        }
+    }
+    csv_writer_write(csvWriter, run, string - run);
+    csv_writer_putc(csvWriter, '"');
+}
+
+static void csv_formatter_stream_genotype(csv_formatter_t* csvFormatter, csv_formatter_variation_list_t *variationList,
+                                          const char *sampleName, int haplotype, csv_formatter_genotype_t genotype)
+{
+    csv_writer_t *csvWriter = csvFormatter->streamWriter;
+    const char *genotypeString = csv_formatter_variation_list_genotype_string(variationList, genotype);
+    int phased = (genotype & CSV_FORMATTER_GENOTYPE_UNPHASED) == 0;
+    
+    if (csvFormatter->format == csvformatlong) {
+        csv_writer_puts(csvWriter, variationList->sequenceName);
+        csv_writer_putc(csvWriter, '\t');
+        csv_writer_put_int(csvWriter, variationList->position);
+        csv_writer_putc(csvWriter, '\t');
+        csv_writer_puts(csvWriter, sampleName);
+        csv_writer_putc(csvWriter, '\t');
+        csv_writer_put_int(csvWriter, haplotype);
+        csv_writer_putc(csvWriter, '\t');
+        csv_writer_puts(csvWriter, genotypeString);
+        csv_writer_puts(csvWriter, phased?"\t1\n":"\t0\n");
+    } else {
+        csv_writer_puts(csvWriter, "{\"gene\":");
+        csv_formatter_print_json_string(csvWriter, variationList->sequenceName);
+        csv_writer_puts(csvWriter, ",\"position\":");
+        csv_writer_put_int(csvWriter, variationList->position);
+        csv_writer_puts(csvWriter, ",\"sample\":");
+        csv_formatter_print_json_string(csvWriter, sampleName);
+        csv_writer_puts(csvWriter, ",\"haplotype\":");
+        csv_writer_put_int(csvWriter, haplotype);
+        csv_writer_puts(csvWriter, ",\"genotype\":");
+        csv_formatter_print_json_string(csvWriter, genotypeString);
+        csv_writer_puts(csvWriter, phased?",\"phased\":true}\n":",\"phased\":false}\n");
+    }
+}
+
+// writes the variation lists that were added and forgets them, the reference is written as haplotype 0 of the "reference" sample
+static void csv_formatter_stream_variation_lists(csv_formatter_t* csvFormatter)
+{
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < csvFormatter->variationListsCount; i++) {
+        csv_formatter_variation_list_t *variationList = csvFormatter->variationLists[i];
+        csv_formatter_genotype_t *genotypes = csv_formatter_genotypes(csvFormatter, variationList);
+        
+        // only the essential positions are remembered, the key is not kept since it is already in the hash
+        if (khash_str2int_size(csvFormatter->essentialPositionHash)) {
+            const char *positionKey = csv_formatter_position_key(csvFormatter, variationList->sequenceName, variationList->position);
+            if (khash_str2int_has_key(csvFormatter->essentialPositionHash, positionKey)) {
+                khash_str2int_set(csvFormatter->essentialPositionHash, positionKey, 1);
+            }
+        }
+        
+        if (genotypes[0] != CSV_FORMATTER_GENOTYPE_EMPTY) {
+            csv_formatter_stream_genotype(csvFormatter, variationList, csvFormatter->referenceSample->sampleName, 0, genotypes[0]);
+        }
+        for (j = 0; j < csvFormatter->sampleCount; j++) {
+            if (genotypes[j+1] != CSV_FORMATTER_GENOTYPE_EMPTY) {
+                csv_formatter_stream_genotype(csvFormatter, variationList, csvFormatter->samples[j]->sampleName, csvFormatter->samples[j]->allele, genotypes[j+1]);
+            }
+        }
+        csv_formatter_variation_list_destroy(variationList);
+    }
+    csvFormatter->variationListsCount = 0;
+    csvFormatter->genotypeRowCount = 0;
+}
+
+/* The genotypes are decoded from the GT values of the FORMAT buffer of the record, which are int8, int16 or int32 values of
+   (allele index + 1) << 1 | phased. 0 and 1 are missing, and the vector end pads the genotype of a haploid sample. */
+
+// returns the genotype code of a GT value, without the phase
+static inline csv_formatter_genotype_t csv_formatter_gt_genotype(const csv_formatter_genotype_t *alleleGenotypes, int32_t alleleCount, int32_t value, int32_t vectorEnd)
+{
+    if (value == vectorEnd) {
+        return CSV_FORMATTER_GENOTYPE_VECTOR_END;
+    }
+    int32_t allele = (value >> 1) - 1;
+    if (allele < 0 || allele >= alleleCount) {
+        return CSV_FORMATTER_GENOTYPE_MISSING;
+    }
+    return alleleGenotypes[allele];
+}
+
+#define CSV_FORMATTER_DECODE_GT(type_t, vectorEnd) { \
+    const type_t *values = (const type_t *)gtValues; \
+    for (i = sampleStart; i < sampleEnd; i++) { \
+        int32_t value1 = values[i*2]; \
+        int32_t value2 = values[i*2+1]; \
+        csv_formatter_genotype_t unphased = (value2 & 1) ? 0 : CSV_FORMATTER_GENOTYPE_UNPHASED; \
+        genotypes[i*2] = csv_formatter_gt_genotype(alleleGenotypes, alleleCount, value1, vectorEnd) | unphased; \
+        genotypes[i*2+1] = csv_formatter_gt_genotype(alleleGenotypes, alleleCount, value2, vectorEnd) | unphased; \
+    } \
+}
+
+// decodes the diploid GT values of the samples from sampleStart to sampleEnd, the unphased flag is set on both haplotypes
+static void csv_formatter_decode_gt(csv_formatter_genotype_t *genotypes, const uint8_t *gtValues, int type, int32_t sampleStart, int32_t sampleEnd,
+                                    const csv_formatter_genotype_t *alleleGenotypes, int32_t alleleCount)
+{
+    int32_t i;
+    switch (type) {
+        case BCF_BT_INT8:
+            CSV_FORMATTER_DECODE_GT(int8_t, bcf_int8_vector_end);
+            break;
+        case BCF_BT_INT16:
+            CSV_FORMATTER_DECODE_GT(int16_t, bcf_int16_vector_end);
+            break;
+        default:
+            CSV_FORMATTER_DECODE_GT(int32_t, bcf_int32_vector_end);
+            break;
+    }
+}
+
+#ifdef CSV_FORMATTER_X86_SIMD
+
+/* Decodes 8 samples at a time by looking up the 16 bytes of their int8 values in tables of the low and high bytes of the
+   genotype codes of the values below 16 (missing and the first 7 alleles). Blocks with other values are decoded one value at
+   a time. Returns the number of samples that were decoded. */
+__attribute__((target("ssse3")))
+static int32_t csv_formatter_decode_gt_int8_ssse3(csv_formatter_genotype_t *genotypes, const uint8_t *gtValues, int32_t sampleCount,
+                                                  const csv_formatter_genotype_t *alleleGenotypes, int32_t alleleCount)
+{
+    uint8_t lowBytes[16];
+    uint8_t highBytes[16];
+    int32_t i;
+    for (i = 0; i < 16; i++) {
+        csv_formatter_genotype_t genotype = csv_formatter_gt_genotype(alleleGenotypes, alleleCount, i, bcf_int8_vector_end);
+        lowBytes[i] = (uint8_t)(genotype & 0xff);
+        highBytes[i] = (uint8_t)(genotype >> 8);
+    }
+    __m128i lowTable = _mm_loadu_si128((const __m128i *)lowBytes);
+    __m128i highTable = _mm_loadu_si128((const __m128i *)highBytes);
+    __m128i tableMax = _mm_set1_epi8(15);
+    __m128i secondPhase = _mm_set1_epi16(0x0100); // phase bit of the second value of each sample
+    __m128i unphasedFlag = _mm_set1_epi8((char)(CSV_FORMATTER_GENOTYPE_UNPHASED >> 8));
+    
+    for (i = 0; i + 8 <= sampleCount; i += 8) {
+        __m128i values = _mm_loadu_si128((const __m128i *)(gtValues + i*2));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(values, tableMax), tableMax)) != 0xffff) {
+            csv_formatter_decode_gt(genotypes, gtValues, BCF_BT_INT8, i, i + 8, alleleGenotypes, alleleCount);
+            continue;
+        }
+        __m128i low = _mm_shuffle_epi8(lowTable, values);
+        __m128i high = _mm_shuffle_epi8(highTable, values);
+        __m128i unphased = _mm_cmpeq_epi16(_mm_and_si128(values, secondPhase), _mm_setzero_si128());
+        high = _mm_or_si128(high, _mm_and_si128(unphased, unphasedFlag));
+        _mm_storeu_si128((__m128i *)(genotypes + i*2), _mm_unpacklo_epi8(low, high));
+        _mm_storeu_si128((__m128i *)(genotypes + i*2 + 8), _mm_unpackhi_epi8(low, high));
+    }
+    
+    return i;
+}
+
+#endif
+
+static void csv_formatter_add_record_variations(csv_formatter_t* csvFormatter, bcf_hdr_t *header, bcf1_t *record)
 {
     if (bcf_is_snp(record) == 0) { // only handle SNPs for now
         fprintf(stderr, "***WARNING*** The CSV formater can only handle SNPs\n");
         return;
     }
     
-    bcf_unpack(record, BCF_UN_ALL);
+    bcf_unpack(record, BCF_UN_SHR); // bcf_get_fmt unpacks the FORMAT block, the GT values are then decoded in place instead of being copied to an int32 array
     
-    int32_t *genemapPositionArray = NULL;
-    int genemapPositionArrayLength = 0;
+    // the info is read in buffers owned by the formatter, which are reused for every record
     int genemapPositionCount = 0;
-    genemapPositionCount = bcf_get_info_int32(header, record, GENEMAP, &genemapPositionArray, &genemapPositionArrayLength);
+    genemapPositionCount = bcf_get_info_int32(header, record, GENEMAP, &csvFormatter->genemapPositionArray, &csvFormatter->genemapPositionArrayLength);
     if (genemapPositionCount == -1) {
         fprintf(stderr, "***WARNING*** No gene mapping defined in the bcf header\n");
-        free(genemapPositionArray);
       return;
     } else if (genemapPositionCount == -2) {
         fprintf(stderr, "***WARNING*** Wrong gene mapping type in the header\n");
-        free(genemapPositionArray);
       return;
     } else if (genemapPositionCount == -3) {
         fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with no gene mappings\n");
-        free(genemapPositionArray);
        return;
     } else if (genemapPositionCount < 0) {
         fprintf(stderr, "***WARNING*** Unknown error occured while reading the gene mappings\n");
-        free(genemapPositionArray);
         return;
     }
     
     if (genemapPositionCount > 1) {
         fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with multiple gene mappings\n");
-        free(genemapPositionArray);
         return;
     }
     if (genemapPositionCount < 1) {
         fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with 0 gene mappings\n");
-        free(genemapPositionArray);
        return;
     }
     
-    int32_t genemapPosition = genemapPositionArray[0];
-    free(genemapPositionArray);
-    genemapPositionArray = NULL;
+    int32_t genemapPosition = csvFormatter->genemapPositionArray[0];
    
-    char *genemapStrandString = NULL;
-    int genemapStrandStringLength = 0;
     int genemapStrandStringCount = 0;
-    genemapStrandStringCount = bcf_get_info_string(header, record, GENEMAP_STRAND, &genemapStrandString, &genemapStrandStringLength);
+    genemapStrandStringCount = bcf_get_info_string(header, record, GENEMAP_STRAND, &csvFormatter->infoString, &csvFormatter->infoStringLength);
     if (genemapStrandStringCount == -1) {
         fprintf(stderr, "***WARNING*** No gene mapping strand defined in the bcf header\n");
-        free(genemapStrandString);
        return;
     } else if (genemapStrandStringCount == -2) {
         fprintf(stderr, "***WARNING*** Wrong gene mapping strand type in the header\n");
-        free(genemapStrandString);
        return;
     } else if (genemapStrandStringCount == -3) {
         fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with no gene mapping strand\n");
-        free(genemapStrandString);
         return;
     } else if (genemapStrandStringCount < 0) {
         fprintf(stderr, "***WARNING*** Unknown error occured while reading the gene mappings strand\n");
-        free(genemapStrandString);
         return;
     }
     
     if (genemapStrandStringCount > 1) {
         fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with multiple gene mapping strands\n");
-        free(genemapStrandString);
         return;
     }
     if (genemapStrandStringCount < 1) {
         fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with 0 gene mapping strands\n");
-        free(genemapStrandString);
         return;
     }
     
-    char genemapStrand = genemapStrandString[0];
-    free(genemapStrandString);
-    genemapStrandString = NULL;
+    char genemapStrand = csvFormatter->infoString[0];
 
     if (genemapStrand != plusstrand && genemapStrand != minusstrand) {
         fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with an illegal gene mapping strand\n");
         return;
     }
     
-    csv_formatter_variation_list_t *variationList = csv_formatter_new_variation_list(csvFormatter, genemapPosition);
+    if (bcf_get_info_string(header, record, GENEMAP_NAME, &csvFormatter->infoString, &csvFormatter->infoStringLength) < 1) {
+        fprintf(stderr, "***WARNING*** Trying to CSV format a variant call with no gene mapping name\n");
+        return;
+    }
     
-    int *genotypesArray = NULL;
-    int genotypesCount = 0;
-    int genotypesArrayLength = 0;
+    csv_formatter_variation_list_t *variationList = csv_formatter_new_variation_list(csvFormatter, csvFormatter->infoString, genemapPosition);
     
-    genotypesCount = bcf_get_genotypes(header, record, &genotypesArray, &genotypesArrayLength);
-    if (genotypesCount < 0) {
+    bcf_fmt_t *gtFormat = bcf_get_fmt(header, record, "GT");
+    if (gtFormat == NULL || (gtFormat->type != BCF_BT_INT8 && gtFormat->type != BCF_BT_INT16 && gtFormat->type != BCF_BT_INT32)) {
         fprintf(stderr, "Error getting genotypes\n");
-        free(genotypesArray);
         exit(1);
     }
-    if (genotypesCount != csvFormatter->sampleCount) {
+    if (gtFormat->n != 2 || record->n_sample * 2 != csvFormatter->sampleCount) {
         fprintf(stderr, "***WARNING*** Not diploid\n");
-        free(genotypesArray);
         return;
     }
     
-    // add reference variant
-    char *referenceVariation = record->d.allele[0];
-    char *referenceVariationComplement = NULL;
+    // the alleles are complemented once, the genotypes only reference them
+    if (record->n_allele > csvFormatter->alleleGenotypesAllocated) {
+        csvFormatter->alleleGenotypesAllocated = record->n_allele;
+        csvFormatter->alleleGenotypes = (csv_formatter_genotype_t *)realloc(csvFormatter->alleleGenotypes, sizeof(csv_formatter_genotype_t) * csvFormatter->alleleGenotypesAllocated);
+    }
+    csv_formatter_genotype_t *alleleGenotypes = csvFormatter->alleleGenotypes;
+    int i;
+    for (i = 0; i < record->n_allele; i++) {
+        const char *allele = record->d.allele[i];
+        if (genemapStrand == minusstrand) {
+            size_t alleleLength = strlen(allele);
+            if (alleleLength + 1 > csvFormatter->complementAllocated) {
+                csvFormatter->complementAllocated = alleleLength + 1;
+                csvFormatter->complement = (char *)realloc(csvFormatter->complement, csvFormatter->complementAllocated);
+            }
+            complement_nucleotides(allele, csvFormatter->complement, alleleLength);
+            csvFormatter->complement[alleleLength] = 0;
+            allele = csvFormatter->complement;
+        }
+        alleleGenotypes[i] = csv_formatter_variation_list_add_allele(variationList, allele);
+    }
+    
+    csv_formatter_genotype_t *genotypes = csv_formatter_genotypes(csvFormatter, variationList);
+    genotypes[0] = alleleGenotypes[0]; // reference
     
-    if (genemapStrand == minusstrand) {
-        referenceVariationComplement = (char *)malloc(strlen(referenceVariation) + 1);
-        strcpy(referenceVariationComplement, complement_nucleotide_sequence(referenceVariation));
-        referenceVariation = referenceVariationComplement;
+    int32_t sampleIndex = 0;
+#ifdef CSV_FORMATTER_X86_SIMD
+    if (gtFormat->type == BCF_BT_INT8 && __builtin_cpu_supports("ssse3")) {
+        sampleIndex = csv_formatter_decode_gt_int8_ssse3(genotypes + 1, gtFormat->p, record->n_sample, alleleGenotypes, record->n_allele);
+    }
+#endif
+    csv_formatter_decode_gt(genotypes + 1, gtFormat->p, gtFormat->type, sampleIndex, record->n_sample, alleleGenotypes, record->n_allele); // +1 because of reference genome
+
+}
+
+void csv_formatter_add_record(csv_formatter_t* csvFormatter, bcf_hdr_t *header, bcf1_t *record)
+{
+    csv_formatter_add_record_variations(csvFormatter, header, record);
+    if (csvFormatter->streamWriter) {
+        csv_formatter_stream_variation_lists(csvFormatter);
+    } else {
+        csv_formatter_spill_if_needed(csvFormatter);
+    }
+}
+
+#include <signal.h>
+
+void csv_formatter_add_essential_position(csv_formatter_t* csvFormatter, const char *sequenceName, int32_t position)
+{
+    if (csvFormatter->streamWriter == NULL) { // the wide format collapses the position with its variants
+        return;
+    }
+    const char *positionKey = csv_formatter_position_key(csvFormatter, sequenceName, position);
+    if (khash_str2int_has_key(csvFormatter->essentialPositionHash, positionKey) == 0) {
+        char *newPositionKey = (char *)malloc(strlen(positionKey) + 1);
+        strcpy(newPositionKey, positionKey);
+        khash_str2int_set(csvFormatter->essentialPositionHash, newPositionKey, 0);
+    }
+}
+
+void csv_formatter_add_postition(csv_formatter_t* csvFormatter, const char *sequenceName, int32_t position, const char *referenceNuceotide)
+{
+    if (csvFormatter->streamWriter) { // only write the positions that had no variant
+        int streamed = 0;
+        khash_str2int_get(csvFormatter->essentialPositionHash, csv_formatter_position_key(csvFormatter, sequenceName, position), &streamed);
+        if (streamed) {
+            return;
+        }
     }
     
-    csv_formatter_variation_list_add(variationList, referenceVariation, 0);
-    free(referenceVariationComplement);
+    csv_formatter_variation_list_t *variationList = csv_formatter_new_variation_list(csvFormatter, sequenceName, position);
     
-    int i;
-    for (i = 0; i < csvFormatter->sampleCount / 2; i++) {
-        int genotypeIndex1 = genotypesArray[i*2];
-        int genotypeIndex2 = genotypesArray[(i*2)+1];
-        const char *genotype1 = NULL;
-        const char *genotype2 = NULL;
-        if (genotypeIndex1 == bcf_gt_missing) {
-            genotype1 = "N";
-        } else if (genotypeIndex1 == bcf_int32_vector_end) {
-            genotype1 = "-";
-        } else {
-            genotype1 = record->d.allele[bcf_gt_allele(genotypeIndex1)];
+    csv_formatter_genotypes(csvFormatter, variationList)[0] = csv_formatter_variation_list_add_allele(variationList, referenceNuceotide);
+    
+    if (csvFormatter->streamWriter) {
+        csv_formatter_stream_variation_lists(csvFormatter);
+    } else {
+        csv_formatter_spill_if_needed(csvFormatter);
+    }
+}
+
+/* The cells of the wide format, a tab and the text of a genotype code, are rendered once for all the genotype codes of
+   the variation lists in memory, and the rows are written by copying them. */
+typedef struct {
+    char *text;
+    size_t textLength;
+    size_t textAllocated;
+    size_t *cellOffsets; // start of the cell of each genotype code of each variation list, and the end of the last cell
+    size_t cellCount;
+    size_t cellsAllocated;
+    size_t *listCells; // index of the first cell of each variation list
+    int32_t listCellsAllocated;
+} csv_formatter_cells_t;
+
+static void csv_formatter_render_cells(csv_formatter_t* csvFormatter, csv_formatter_cells_t *cells)
+{
+    cells->textLength = 0;
+    cells->cellCount = 0;
+    if (csvFormatter->variationListsCount > cells->listCellsAllocated) {
+        cells->listCellsAllocated = csvFormatter->variationListsCount;
+        cells->listCells = (size_t *)realloc(cells->listCells, sizeof(size_t) * cells->listCellsAllocated);
+    }
+    
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < csvFormatter->variationListsCount; i++) {
+        csv_formatter_variation_list_t *variationList = csvFormatter->variationLists[i];
+        cells->listCells[i] = cells->cellCount;
+        for (j = 0; j < variationList->alleleCount + CSV_FORMATTER_GENOTYPE_FIRST_ALLELE; j++) {
+            const char *genotypeString = csv_formatter_variation_list_genotype_string(variationList, (csv_formatter_genotype_t)j);
+            size_t genotypeLength = strlen(genotypeString);
+            if (cells->cellCount + 2 > cells->cellsAllocated) {
+                cells->cellsAllocated = cells->cellsAllocated ? cells->cellsAllocated * 2 : 1024;
+                cells->cellOffsets = (size_t *)realloc(cells->cellOffsets, sizeof(size_t) * cells->cellsAllocated);
+            }
+            while (cells->textLength + genotypeLength + 1 > cells->textAllocated) {
+                cells->textAllocated = cells->textAllocated ? cells->textAllocated * 2 : 4096;
+                cells->text = (char *)realloc(cells->text, cells->textAllocated);
+            }
+            cells->cellOffsets[cells->cellCount] = cells->textLength;
+            cells->cellCount++;
+            cells->text[cells->textLength] = '\t';
+            memcpy(cells->text + cells->textLength + 1, genotypeString, genotypeLength);
+            cells->textLength += genotypeLength + 1;
         }
-        if (genotypeIndex2 == bcf_gt_missing) {
-            genotype2 = "N";
-        } else if (genotypeIndex2 == bcf_int32_vector_end) {
-            genotype1 = "-";
-        } else {
-            genotype2 = record->d.allele[bcf_gt_allele(genotypeIndex2)];
+    }
+    if (cells->cellCount + 1 > cells->cellsAllocated) {
+        cells->cellsAllocated = cells->cellCount + 1;
+        cells->cellOffsets = (size_t *)realloc(cells->cellOffsets, sizeof(size_t) * cells->cellsAllocated);
+    }
+    cells->cellOffsets[cells->cellCount] = cells->textLength;
+}
+
+static void csv_formatter_cells_free(csv_formatter_cells_t *cells)
+{
+    free(cells->text);
+    free(cells->cellOffsets);
+    free(cells->listCells);
+}
+
+// prints the name of a row of the wide format, row 0 is the header, row 1 the reference and the others the haplotypes
+static void csv_formatter_print_row_name(csv_formatter_t* csvFormatter, csv_writer_t *csvWriter, int32_t row)
+{
+    if (row == 0) {
+        csv_writer_puts(csvWriter, "Sample");
+    } else if (row == 1) {
+        csv_writer_puts(csvWriter, csvFormatter->referenceSample->sampleName);
+    } else {
+        csv_writer_puts(csvWriter, csvFormatter->samples[row - 2]->sampleName);
+        csv_writer_write(csvWriter, " (", 2);
+        csv_writer_put_int(csvWriter, csvFormatter->samples[row - 2]->allele);
+        csv_writer_putc(csvWriter, ')');
+    }
+}
+
+// prints the cells of a row of the wide format for the variation lists in memory, which are rendered in cells
+static void csv_formatter_print_row_cells(csv_formatter_t* csvFormatter, csv_formatter_cells_t *cells, csv_writer_t *csvWriter, int32_t row)
+{
+    int32_t i;
+    for (i = 0; i < csvFormatter->variationListsCount; i++) {
+        csv_formatter_variation_list_t *variationList = csvFormatter->variationLists[i];
+        if (row == 0) {
+            csv_writer_putc(csvWriter, '\t');
+            if (csvFormatter->sequenceNameCount > 1) { // only name the positions when there are several genes
+                csv_writer_puts(csvWriter, variationList->sequenceName);
+                csv_writer_putc(csvWriter, ':');
+            }
+            csv_writer_put_int(csvWriter, variationList->position);
+            continue;
         }
         
-        char *genotype1Complement = NULL;
-        char *genotype2Complement = NULL;
-        if (genemapStrand == minusstrand) {
-            genotype1Complement = (char *)malloc(strlen(genotype1) + 1);
-            strcpy(genotype1Complement, complement_nucleotide_sequence(genotype1));
-            genotype1 = genotype1Complement;
-            genotype2Complement = (char *)malloc(strlen(genotype2) + 1);
-            strcpy(genotype2Complement, complement_nucleotide_sequence(genotype2));
-            genotype2 = genotype2Complement;
+        csv_formatter_genotype_t *genotypes = csv_formatter_genotypes(csvFormatter, variationList);
+        const size_t *cellOffsets = cells->cellOffsets + cells->listCells[i];
+        int32_t column = row - 1;
+        if (genotypes[column] & CSV_FORMATTER_GENOTYPE_UNPHASED) { // both haplotypes of the sample, without their tabs
+            int32_t firstHaplotype = ((column - 1) & ~1) + 1;
+            csv_formatter_genotype_t genotype1 = genotypes[firstHaplotype] & ~CSV_FORMATTER_GENOTYPE_UNPHASED;
+            csv_formatter_genotype_t genotype2 = genotypes[firstHaplotype + 1] & ~CSV_FORMATTER_GENOTYPE_UNPHASED;
+            csv_writer_write(csvWriter, "\t(", 2);
+            csv_writer_write(csvWriter, cells->text + cellOffsets[genotype1] + 1, cellOffsets[genotype1 + 1] - cellOffsets[genotype1] - 1);
+            csv_writer_write(csvWriter, ", ", 2);
+            csv_writer_write(csvWriter, cells->text + cellOffsets[genotype2] + 1, cellOffsets[genotype2 + 1] - cellOffsets[genotype2] - 1);
+            csv_writer_putc(csvWriter, ')');
+        } else {
+            csv_formatter_genotype_t genotype = genotypes[column];
+            csv_writer_write(csvWriter, cells->text + cellOffsets[genotype], cellOffsets[genotype + 1] - cellOffsets[genotype]);
+        }
+    }
+}
+
+void csv_formatter_for_each_block(csv_formatter_t* csvFormatter, csv_formatter_block_function_t blockFunction, void *context)
+{
+    if (csvFormatter->spillFileCount == 0) {
+        csv_formatter_collapse_variant_lists(csvFormatter);
+        blockFunction(csvFormatter, context);
+        return;
+    }
+    
+    csv_formatter_spill(csvFormatter); // the variation lists still in memory
+    
+    int32_t spillFileCount = csvFormatter->spillFileCount;
+    size_t rowLength = csvFormatter->sampleCount + 1;
+    
+    csv_formatter_variation_list_t **nextVariationLists = (csv_formatter_variation_list_t **)malloc(sizeof(csv_formatter_variation_list_t *) * spillFileCount);
+    csv_formatter_genotype_t *nextGenotypes = (csv_formatter_genotype_t *)malloc(sizeof(csv_formatter_genotype_t) * rowLength * spillFileCount);
+    int32_t i;
+    for (i = 0; i < spillFileCount; i++) {
+        rewind(csvFormatter->spillFiles[i]);
+        nextVariationLists[i] = csv_formatter_read_spilled_variation_list(csvFormatter, csvFormatter->spillFiles[i], nextGenotypes + rowLength * i);
+    }
+    
+    while (1) {
+        int32_t next = -1;
+        for (i = 0; i < spillFileCount; i++) {
+            if (nextVariationLists[i] && (next == -1 || compare_variant_lists(&nextVariationLists[i], &nextVariationLists[next]) < 0)) {
+                next = i;
+            }
         }
         
-        char *concat_genotype = NULL;
-        if (bcf_gt_is_phased(genotypeIndex2) == 0) {
-            concat_genotype = (char *)malloc(strlen(genotype1) + strlen(genotype2) + 5);
-            sprintf(concat_genotype, "(%s, %s)", genotype1, genotype2);
-            genotype1 = concat_genotype;
-            genotype2 = concat_genotype;
+        // a block ends once it is over the memory limit, but the variation lists of a position are kept together so that they can be collapsed
+        if (csvFormatter->variationListsCount &&
+            (next == -1 || ((size_t)csvFormatter->genotypeRowCount * rowLength * sizeof(csv_formatter_genotype_t) >= csvFormatter->memoryLimit &&
+                            compare_variant_lists(&csvFormatter->variationLists[csvFormatter->variationListsCount - 1], &nextVariationLists[next]) != 0))) {
+            csv_formatter_collapse_variant_lists(csvFormatter);
+            blockFunction(csvFormatter, context);
+            
+            for (i = 0; i < csvFormatter->variationListsCount; i++) {
+                csv_formatter_variation_list_destroy(csvFormatter->variationLists[i]);
+            }
+            csvFormatter->variationListsCount = 0;
+            csvFormatter->genotypeRowCount = 0;
         }
         
-        csv_formatter_variation_list_add(variationList, genotype1, (i*2)+1); // +1 because of reference genome
-        csv_formatter_variation_list_add(variationList, genotype2, (i*2)+2);
+        if (next == -1) {
+            break;
+        }
         
-        free(concat_genotype);
-        free(genotype1Complement);
-        free(genotype2Complement);
+        csv_formatter_append_variation_list(csvFormatter, nextVariationLists[next], nextGenotypes + rowLength * next);
+        nextVariationLists[next] = csv_formatter_read_spilled_variation_list(csvFormatter, csvFormatter->spillFiles[next], nextGenotypes + rowLength * next);
     }
+    free(nextVariationLists);
+    free(nextGenotypes);
     
-    free(genotypesArray);
+    for (i = 0; i < spillFileCount; i++) {
+        fclose(csvFormatter->spillFiles[i]);
+    }
+    csvFormatter->spillFileCount = 0;
 }
 
-#include <signal.h>
+// the cells of each block of positions are printed row by row in blockFp, and rowOffsets has where each row starts
+typedef struct {
+    csv_writer_t *blockWriter;
+    csv_formatter_cells_t cells;
+    int32_t rowCount;
+    int32_t blockCount;
+    int32_t blocksAllocated;
+    int64_t *rowOffsets;
+} csv_formatter_print_blocks_t;
 
-void csv_formatter_add_postition(csv_formatter_t* csvFormatter, int32_t position, const char *referenceNuceotide)
+static void csv_formatter_print_block(csv_formatter_t* csvFormatter, void *context)
 {
-    csv_formatter_variation_list_t *variationList = csv_formatter_new_variation_list(csvFormatter, position);
+    csv_formatter_print_blocks_t *printBlocks = (csv_formatter_print_blocks_t *)context;
+    int32_t rowCount = printBlocks->rowCount;
     
-    char *nt = (char *)malloc(strlen(referenceNuceotide) + 1);
-    strcpy(nt, referenceNuceotide);
-    variationList->variations[0] = nt;
+    if (printBlocks->blockCount == printBlocks->blocksAllocated) {
+        printBlocks->blocksAllocated = printBlocks->blocksAllocated ? printBlocks->blocksAllocated * 2 : 16;
+        printBlocks->rowOffsets = (int64_t *)realloc(printBlocks->rowOffsets, sizeof(int64_t) * (rowCount + 1) * printBlocks->blocksAllocated);
+    }
+    int64_t *rowOffsets = printBlocks->rowOffsets + printBlocks->blockCount * (rowCount + 1);
+    csv_formatter_render_cells(csvFormatter, &printBlocks->cells);
+    int32_t row;
+    for (row = 0; row < rowCount; row++) {
+        rowOffsets[row] = csv_writer_tell(printBlocks->blockWriter);
+        csv_formatter_print_row_cells(csvFormatter, &printBlocks->cells, printBlocks->blockWriter, row);
+    }
+    rowOffsets[rowCount] = csv_writer_tell(printBlocks->blockWriter);
+    printBlocks->blockCount++;
 }
 
-void csv_formatter_print(csv_formatter_t* csvFormatter, FILE *fp)
+static void csv_formatter_print_spilled(csv_formatter_t* csvFormatter, csv_writer_t *csvWriter)
 {
-    int i;
-    int j;
+    FILE *blockFp = tmpfile();
+    if (blockFp == NULL) {
+        fprintf(stderr, "Unable to create a temporary csv file.\n");
+        exit(1);
+    }
+    csv_formatter_print_blocks_t printBlocks;
+    memset(&printBlocks, 0, sizeof(csv_formatter_print_blocks_t));
+    printBlocks.blockWriter = csv_writer_init(blockFp);
+    printBlocks.rowCount = csvFormatter->sampleCount + 2; // header, reference and haplotypes
     
-    csv_formatter_collapse_variant_lists(csvFormatter);
+    csv_formatter_for_each_block(csvFormatter, csv_formatter_print_block, &printBlocks);
+    csv_formatter_cells_free(&printBlocks.cells);
+    csv_writer_destroy(printBlocks.blockWriter);
     
-    fprintf(fp, "Sample");
-    for (i = 0; i< csvFormatter->variationListsCount; i++) {
-        fprintf(fp, "\t%d", (int)csvFormatter->variationLists[i]->position);
+    int32_t rowCount = printBlocks.rowCount;
+    int64_t *rowOffsets = printBlocks.rowOffsets;
+    int32_t row;
+    for (row = 0; row < rowCount; row++) {
+        csv_formatter_print_row_name(csvFormatter, csvWriter, row);
+        int32_t block;
+        for (block = 0; block < printBlocks.blockCount; block++) {
+            int64_t offset = rowOffsets[block * (rowCount + 1) + row];
+            csv_writer_write_file(csvWriter, blockFp, offset, rowOffsets[block * (rowCount + 1) + row + 1] - offset);
+        }
+        csv_writer_putc(csvWriter, '\n');
     }
-    fprintf(fp, "\n");
+    
+    free(rowOffsets);
+    fclose(blockFp);
+}
 
-    fprintf(fp, "%s", csvFormatter->referenceSample->sampleName);
-    for (i = 0; i < csvFormatter->variationListsCount; i++) {
-        fprintf(fp, "\t%s", csvFormatter->variationLists[i]->variations[0]);
-    }
-    fprintf(fp, "\n");
+void csv_formatter_print(csv_formatter_t* csvFormatter, csv_writer_t *csvWriter)
+{
+    int64_t startTime = stats_start(csvFormatter->stats);
     
-    for (i = 0; i < csvFormatter->sampleCount; i++) {
-        fprintf(fp, "%s (%d)", csvFormatter->samples[i]->sampleName, csvFormatter->samples[i]->allele);
-        for (j = 0; j < csvFormatter->variationListsCount; j++) {
-            fprintf(fp, "\t%s", csvFormatter->variationLists[j]->variations[i+1]);
+    if (csvFormatter->streamWriter) {
+        csv_writer_flush(csvFormatter->streamWriter);
+    } else if (csvFormatter->spillFileCount) {
+        csv_formatter_print_spilled(csvFormatter, csvWriter);
+    } else {
+        csv_formatter_collapse_variant_lists(csvFormatter);
+        
+        csv_formatter_cells_t cells;
+        memset(&cells, 0, sizeof(csv_formatter_cells_t));
+        csv_formatter_render_cells(csvFormatter, &cells);
+        int32_t row;
+        for (row = 0; row < csvFormatter->sampleCount + 2; row++) {
+            csv_formatter_print_row_name(csvFormatter, csvWriter, row);
+            csv_formatter_print_row_cells(csvFormatter, &cells, csvWriter, row);
+            csv_writer_putc(csvWriter, '\n');
         }
-        fprintf(fp, "\n");
+        csv_formatter_cells_free(&cells);
     }
+    
+    stats_stop(csvFormatter->stats, statsstagecsvprint, startTime);
 }
-
-
-
-
-
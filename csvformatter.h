@@ -11,18 +11,42 @@
 
 #include <stdio.h>
 #include <htslib/vcf.h>
+#include "stats.h"
+#include "csvwriter.h"
+
+typedef enum {
+    csvformatwide, // a column per position, written by csv_formatter_print
+    csvformatlong, // a row per position, sample and haplotype, written as the records are added
+    csvformatndjson, // same as long, as a JSON object per line
+    csvformatmatrix // the genotypes of the wide format in a binary genotype matrix file, written by genotype_matrix_write
+} csv_format_t;
+
+int csv_format_parse(const char *formatString, csv_format_t *formatOut); // returns 0 if the format is valid
 
 typedef struct {
     const char *sampleName;
     char allele; // 0 or 1
 } csv_formatter_sample_t;
 
+/* Genotypes are stored as codes in a matrix with a row per variation list and a column per haplotype, the first
+   column is the reference. Codes from CSV_FORMATTER_GENOTYPE_FIRST_ALLELE index the alleles of the variation list. */
+typedef uint16_t csv_formatter_genotype_t;
+
+#define CSV_FORMATTER_GENOTYPE_EMPTY 0
+#define CSV_FORMATTER_GENOTYPE_MISSING 1 // printed as "N"
+#define CSV_FORMATTER_GENOTYPE_VECTOR_END 2 // printed as "-"
+#define CSV_FORMATTER_GENOTYPE_FIRST_ALLELE 3
+#define CSV_FORMATTER_GENOTYPE_UNPHASED 0x8000 // set on both haplotypes of an unphased genotype, which are printed together
+#define CSV_FORMATTER_GENOTYPE_MAX_ALLELES (CSV_FORMATTER_GENOTYPE_UNPHASED - CSV_FORMATTER_GENOTYPE_FIRST_ALLELE)
+
 typedef struct {
     int32_t position;
-    char *sequenceName;;
+    const char *sequenceName; // name of the gene, owned by the csv formatter
+    int32_t genotypeRow; // row of the genotypes in the csv formatter's matrix
     
-    int32_t variationsCount; // this will be the number of samples
-    const char **variations;
+    int32_t alleleCount;
+    int32_t allelesAllocated;
+    char **alleles; // already complemented if the gene is on the (-)strand
 } csv_formatter_variation_list_t;
 
 typedef struct {
@@ -31,26 +55,88 @@ typedef struct {
     int32_t sampleCount;
     csv_formatter_sample_t **samples;
     
+    int32_t genotypeRowCount;
+    int32_t genotypeRowsAllocated;
+    csv_formatter_genotype_t *genotypes; // genotypeRowCount rows of sampleCount + 1 codes
+    char *complement; // reused to complement the alleles
+    size_t complementAllocated;
+    int32_t *genemapPositionArray; // reused to read the info of the records
+    int genemapPositionArrayLength;
+    char *infoString;
+    int infoStringLength;
+    csv_formatter_genotype_t *alleleGenotypes; // reused for the genotype codes of the alleles of a record
+    int32_t alleleGenotypesAllocated;
+    
     int32_t variationListsCount;
     int32_t variationListsAllocated;
     csv_formatter_variation_list_t **variationLists;
+    
+    int32_t sequenceNameCount;
+    int32_t sequenceNamesAllocated;
+    char **sequenceNames;
+    void *sequenceNameHash;
+    
+    csv_format_t format;
+    csv_writer_t *streamWriter; // NULL for the wide format
+    void *essentialPositionHash; // "name:position" of the essential positions to 1 once a variant was written there, for the streamed formats
+    char *positionKey; // reused to build the "name:position" keys
+    size_t positionKeyAllocated;
+    
+    void *mergedPositionHash; // "name:position" to the index of its variation list, for csv_formatter_merge_samples
+    int32_t mergedPositionHashCount; // variation lists in mergedPositionHash, it is rebuilt if the lists changed since
+    
+    size_t memoryLimit; // bytes of genotypes kept in memory before they are written to temporary files, 0 for no limit
+    int32_t spillFileCount;
+    int32_t spillFilesAllocated;
+    FILE **spillFiles; // sorted variation lists
+    
+    stats_t *stats; // times the collapsing and printing if set
 } csv_formatter_t;
 
 csv_formatter_sample_t *csv_formatter_sample_init(const char *sampleName, char allele);
 void csv_formatter_sample_destroy(csv_formatter_sample_t* sample);
 
-csv_formatter_variation_list_t *csv_formatter_variation_list_init(int32_t sampleCount, int32_t position);
+csv_formatter_variation_list_t *csv_formatter_variation_list_init(const char *sequenceName, int32_t position, int32_t genotypeRow);
 void csv_formatter_variation_list_destroy(csv_formatter_variation_list_t *variationList);
-void csv_formatter_variation_list_add(csv_formatter_variation_list_t *variationList, const char * variation, int32_t sampleIndex);
+// returns the genotype code of the allele, the allele is added if the variation list doesn't have it yet
+csv_formatter_genotype_t csv_formatter_variation_list_add_allele(csv_formatter_variation_list_t *variationList, const char *allele);
 
 csv_formatter_t *csv_formatter_init(bcf_hdr_t *bcfHeader);
+// writes the long or ndjson format to csvWriter as the records are added, without keeping them in memory
+csv_formatter_t *csv_formatter_stream_init(bcf_hdr_t *bcfHeader, csv_format_t format, csv_writer_t *csvWriter);
 void csv_formatter_destroy(csv_formatter_t* csvFormatter);
+static inline int csv_formatter_is_streaming(csv_formatter_t* csvFormatter) {return csvFormatter->streamWriter != NULL;}
+void csv_formatter_set_memory_limit(csv_formatter_t* csvFormatter, size_t memoryLimit); // for the wide format, 0 for no limit
+// adds the samples of the header after the samples of the formatter, before any record is added, returns the index of the first new haplotype
+int32_t csv_formatter_add_samples(csv_formatter_t* csvFormatter, bcf_hdr_t *bcfHeader);
+
+// the row of genotypes of the variation list, only valid until the next variation list is added
+static inline csv_formatter_genotype_t *csv_formatter_genotypes(csv_formatter_t* csvFormatter, csv_formatter_variation_list_t *variationList)
+{
+    return csvFormatter->genotypes + (size_t)variationList->genotypeRow * (csvFormatter->sampleCount + 1);
+}
 
 void csv_formatter_collapse_variant_lists(csv_formatter_t* csvFormatter);
 void csv_formatter_sort_variant_lists(csv_formatter_t* csvFormatter);
 
+/* Calls blockFunction for blocks of the sorted and collapsed variation lists, which are the variation lists of the
+   formatter during the call. All the variation lists are in one block and they are kept if nothing was written to
+   temporary files, otherwise they are read back in blocks that fit in the memory limit and they are forgotten. */
+typedef void (*csv_formatter_block_function_t)(csv_formatter_t* csvFormatter, void *context);
+void csv_formatter_for_each_block(csv_formatter_t* csvFormatter, csv_formatter_block_function_t blockFunction, void *context);
+
+// moves the variations of source, which must have the same samples, to csvFormatter, only for the wide format
+void csv_formatter_merge(csv_formatter_t* csvFormatter, csv_formatter_t* sourceCsvFormatter);
+/* moves the variations of source to csvFormatter, the haplotypes of source are the haplotypes of csvFormatter from
+   sampleIndex, only for the wide format. The genotypes of a position csvFormatter already has are added to its row,
+   so the formatters of files with different samples are merged in a row per position. */
+void csv_formatter_merge_samples(csv_formatter_t* csvFormatter, csv_formatter_t* sourceCsvFormatter, int32_t sampleIndex);
+
 void csv_formatter_add_record(csv_formatter_t* csvFormatter, bcf_hdr_t *header, bcf1_t *record);
-void csv_formatter_add_postition(csv_formatter_t* csvFormatter, int32_t position, const char *referenceNuceotide);
-void csv_formatter_print(csv_formatter_t* csvFormatter, FILE *fp);
+// the streamed formats only write an essential position added with csv_formatter_add_postition if no variant was written there,
+// so the essential positions are registered before the records are added
+void csv_formatter_add_essential_position(csv_formatter_t* csvFormatter, const char *sequenceName, int32_t position);
+void csv_formatter_add_postition(csv_formatter_t* csvFormatter, const char *sequenceName, int32_t position, const char *referenceNuceotide);
+void csv_formatter_print(csv_formatter_t* csvFormatter, csv_writer_t *csvWriter); // only flushes the writer if the formatter is streaming
 
 #endif
@@ -0,0 +1,142 @@
+//
+//  csvwriter.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "csvwriter.h"
+
+int csv_writer_filename_is_compressed(const char *filename)
+{
+    size_t length = strlen(filename);
+    return (length > 3 && strcmp(filename + length - 3, ".gz") == 0) || (length > 4 && strcmp(filename + length - 4, ".bgz") == 0);
+}
+
+static csv_writer_t *csv_writer_alloc(void)
+{
+    csv_writer_t *newWriter = (csv_writer_t *)malloc(sizeof(csv_writer_t));
+    memset(newWriter, 0, sizeof(csv_writer_t));
+
+    newWriter->buffer = (char *)malloc(CSV_WRITER_BUFFER_SIZE);
+    newWriter->filename = "csv file";
+
+    return newWriter;
+}
+
+csv_writer_t *csv_writer_init(FILE *fp)
+{
+    csv_writer_t *newWriter = csv_writer_alloc();
+    newWriter->fp = fp;
+    return newWriter;
+}
+
+csv_writer_t *csv_writer_open(const char *filename, int threadCount)
+{
+    FILE *fp = NULL;
+    BGZF *bgzf = NULL;
+
+    if (csv_writer_filename_is_compressed(filename)) {
+        bgzf = bgzf_open(filename, "w");
+        if (bgzf == NULL) {
+            return NULL;
+        }
+        if (threadCount > 1) {
+            bgzf_mt(bgzf, threadCount, 256);
+        }
+    } else {
+        fp = fopen(filename, "w");
+        if (fp == NULL) {
+            return NULL;
+        }
+    }
+
+    csv_writer_t *newWriter = csv_writer_alloc();
+    newWriter->fp = fp;
+    newWriter->bgzf = bgzf;
+    newWriter->ownsOutput = 1;
+    newWriter->filename = filename;
+
+    return newWriter;
+}
+
+void csv_writer_destroy(csv_writer_t *csvWriter)
+{
+    csv_writer_flush(csvWriter);
+
+    int result = 0;
+    if (csvWriter->bgzf) {
+        result = bgzf_close(csvWriter->bgzf);
+    } else if (csvWriter->ownsOutput) {
+        result = fclose(csvWriter->fp);
+    } else {
+        result = fflush(csvWriter->fp);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Unable to write the csv file '%s'.\n", csvWriter->filename);
+        exit(1);
+    }
+
+    free(csvWriter->buffer);
+    free(csvWriter);
+}
+
+static void csv_writer_output(csv_writer_t *csvWriter, const char *data, size_t length)
+{
+    if (length == 0) {
+        return;
+    }
+
+    int failed;
+    if (csvWriter->bgzf) {
+        failed = bgzf_write(csvWriter->bgzf, data, length) != (ssize_t)length;
+    } else {
+        failed = fwrite(data, 1, length, csvWriter->fp) != length;
+    }
+    if (failed) {
+        fprintf(stderr, "Unable to write the csv file '%s'.\n", csvWriter->filename);
+        exit(1);
+    }
+    csvWriter->flushedLength += (int64_t)length;
+}
+
+void csv_writer_flush(csv_writer_t *csvWriter)
+{
+    csv_writer_output(csvWriter, csvWriter->buffer, csvWriter->length);
+    csvWriter->length = 0;
+}
+
+void csv_writer_write_long(csv_writer_t *csvWriter, const char *data, size_t length)
+{
+    csv_writer_flush(csvWriter);
+    if (length >= CSV_WRITER_BUFFER_SIZE) {
+        csv_writer_output(csvWriter, data, length);
+    } else {
+        memcpy(csvWriter->buffer, data, length);
+        csvWriter->length = length;
+    }
+}
+
+void csv_writer_write_file(csv_writer_t *csvWriter, FILE *fp, int64_t offset, int64_t length)
+{
+    fseeko(fp, (off_t)offset, SEEK_SET);
+    while (length > 0) {
+        if (csvWriter->length == CSV_WRITER_BUFFER_SIZE) {
+            csv_writer_flush(csvWriter);
+        }
+        size_t readLength = CSV_WRITER_BUFFER_SIZE - csvWriter->length;
+        if ((int64_t)readLength > length) {
+            readLength = (size_t)length;
+        }
+        readLength = fread(csvWriter->buffer + csvWriter->length, 1, readLength, fp);
+        if (readLength == 0) {
+            fprintf(stderr, "Unable to read the temporary csv file.\n");
+            exit(1);
+        }
+        csvWriter->length += readLength;
+        length -= (int64_t)readLength;
+    }
+}
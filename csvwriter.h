@@ -0,0 +1,84 @@
+//
+//  csvwriter.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_csvwriter_h
+#define bcfgenemapper_csvwriter_h
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <htslib/bgzf.h>
+
+/* The csv writer appends the text of the csv file to a large buffer that is written to the file, or compressed with
+   BGZF, when it is full. The text is written a cell at a time without formatting it with printf. */
+
+#define CSV_WRITER_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    FILE *fp; // NULL if the output is compressed
+    BGZF *bgzf;
+    int ownsOutput; // the output is closed by csv_writer_destroy if it was opened by csv_writer_open
+    const char *filename; // for the error messages
+
+    char *buffer;
+    size_t length;
+    int64_t flushedLength; // bytes written before the buffer
+} csv_writer_t;
+
+// writes to fp, which is not closed by csv_writer_destroy
+csv_writer_t *csv_writer_init(FILE *fp);
+/* creates the file, which is compressed with BGZF (and readable by gzip) if its name ends in ".gz" or ".bgz", the
+   compression uses threadCount threads. Returns NULL if the file can't be created. */
+csv_writer_t *csv_writer_open(const char *filename, int threadCount);
+int csv_writer_filename_is_compressed(const char *filename); // returns 1 if csv_writer_open compresses the file
+void csv_writer_destroy(csv_writer_t *csvWriter); // flushes and closes the output, exits if the csv file can't be written
+
+void csv_writer_flush(csv_writer_t *csvWriter); // writes the buffer to the output, exits if the csv file can't be written
+static inline int64_t csv_writer_tell(csv_writer_t *csvWriter) {return csvWriter->flushedLength + (int64_t)csvWriter->length;} // uncompressed
+
+void csv_writer_write_long(csv_writer_t *csvWriter, const char *data, size_t length); // for writes larger than the buffer
+void csv_writer_write_file(csv_writer_t *csvWriter, FILE *fp, int64_t offset, int64_t length); // copies a part of a temporary file
+
+static inline void csv_writer_write(csv_writer_t *csvWriter, const char *data, size_t length)
+{
+    if (csvWriter->length + length > CSV_WRITER_BUFFER_SIZE) {
+        csv_writer_write_long(csvWriter, data, length);
+        return;
+    }
+    memcpy(csvWriter->buffer + csvWriter->length, data, length);
+    csvWriter->length += length;
+}
+
+static inline void csv_writer_putc(csv_writer_t *csvWriter, char c)
+{
+    if (csvWriter->length == CSV_WRITER_BUFFER_SIZE) {
+        csv_writer_flush(csvWriter);
+    }
+    csvWriter->buffer[csvWriter->length] = c;
+    csvWriter->length++;
+}
+
+static inline void csv_writer_puts(csv_writer_t *csvWriter, const char *string) {csv_writer_write(csvWriter, string, strlen(string));}
+
+static inline void csv_writer_put_int(csv_writer_t *csvWriter, int64_t value)
+{
+    char digits[24];
+    int digitCount = 0;
+    uint64_t absoluteValue = value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+    do {
+        digits[sizeof(digits) - 1 - digitCount] = (char)('0' + absoluteValue % 10);
+        digitCount++;
+        absoluteValue /= 10;
+    } while (absoluteValue);
+    if (value < 0) {
+        digits[sizeof(digits) - 1 - digitCount] = '-';
+        digitCount++;
+    }
+    csv_writer_write(csvWriter, digits + sizeof(digits) - digitCount, digitCount);
+}
+
+#endif
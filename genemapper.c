@@ -10,8 +10,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <sys/mman.h>
 #include "genemapper.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GENE_MAPPER_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define GENE_MAPPER_SCAN_LENGTH 64 // intervals scanned before switching to a binary search
+
 int32_t exon_range_length(exon_range_t exon) {
     if (exon_range_strand(exon) == plusstrand) {
         return (exon.end - exon.start) + 1;
@@ -20,196 +28,930 @@ int32_t exon_range_length(exon_range_t exon) {
     }
 }
 
+static int compare_genomic_regions(const void *region1Ptr, const void *region2Ptr)
+{
+    const genomic_region_t *region1 = (const genomic_region_t *)region1Ptr;
+    const genomic_region_t *region2 = (const genomic_region_t *)region2Ptr;
+    if (region1->start < region2->start) {
+        return -1;
+    } else if (region1->start == region2->start) {
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+int32_t genomic_regions_merge(genomic_region_t *regions, int32_t regionCount)
+{
+    qsort(regions, regionCount, sizeof(genomic_region_t), compare_genomic_regions);
+
+    // merge overlapping and adjacent regions so that every position belongs to at most one region
+    int32_t mergedRegionCount = 0;
+    int32_t i;
+    for (i = 0; i < regionCount; i++) {
+        if (mergedRegionCount > 0 && regions[i].start <= regions[mergedRegionCount - 1].end + 1) {
+            if (regions[i].end > regions[mergedRegionCount - 1].end) {
+                regions[mergedRegionCount - 1].end = regions[i].end;
+            }
+        } else {
+            regions[mergedRegionCount] = regions[i];
+            mergedRegionCount++;
+        }
+    }
+
+    return mergedRegionCount;
+}
+
+int contig_names_match(const char *contigName1, const char *contigName2)
+{
+    if (strcmp(contigName1, contigName2) == 0) {
+        return 1;
+    }
+    if (strncmp(contigName1, "chr", 3) == 0 && strcmp(contigName1 + 3, contigName2) == 0) {
+        return 1;
+    }
+    if (strncmp(contigName2, "chr", 3) == 0 && strcmp(contigName1, contigName2 + 3) == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+
+static gene_t *gene_init(const char *name, const char *contig)
+{
+    gene_t *newGene = (gene_t *)malloc(sizeof(gene_t));
+    memset(newGene, 0, sizeof(gene_t));
+
+    newGene->name = (char *)malloc(strlen(name) + 1);
+    strcpy(newGene->name, name);
+    if (contig) {
+        newGene->contig = (char *)malloc(strlen(contig) + 1);
+        strcpy(newGene->contig, contig);
+    }
+    newGene->strand = plusstrand;
+
+    newGene->exonsAllocated = 2;
+    newGene->exons = (exon_range_t *)malloc(sizeof(exon_range_t) * 2);
+    memset(newGene->exons, 0, sizeof(exon_range_t) * 2);
+    newGene->exonOffsets = (int32_t *)malloc(sizeof(int32_t) * 2);
+    memset(newGene->exonOffsets, 0, sizeof(int32_t) * 2);
+
+    return newGene;
+}
+
+static void gene_destroy(gene_t *gene)
+{
+    free(gene->name);
+    free(gene->contig);
+    if (gene->mapped == 0) {
+        free(gene->exons);
+        free(gene->exonOffsets);
+        free(gene->referenceGenome);
+        free(gene->essentialPositions);
+    }
+    free(gene);
+}
+
+// copies the arrays of a gene read from a memory mapped gene model so that they can be modified
+static void gene_copy_mapped(gene_t *gene)
+{
+    if (gene->mapped == 0) {
+        return;
+    }
+
+    exon_range_t *mappedExons = gene->exons;
+    int32_t *mappedExonOffsets = gene->exonOffsets;
+    const char *mappedReferenceGenome = gene->referenceGenome;
+    int32_t *mappedEssentialPositions = gene->essentialPositions;
+
+    gene->exonsAllocated = gene->exonCount > 2 ? gene->exonCount : 2;
+    gene->exons = (exon_range_t *)malloc(sizeof(exon_range_t) * gene->exonsAllocated);
+    memset(gene->exons, 0, sizeof(exon_range_t) * gene->exonsAllocated);
+    memcpy(gene->exons, mappedExons, sizeof(exon_range_t) * gene->exonCount);
+    gene->exonOffsets = (int32_t *)malloc(sizeof(int32_t) * gene->exonsAllocated);
+    memset(gene->exonOffsets, 0, sizeof(int32_t) * gene->exonsAllocated);
+    memcpy(gene->exonOffsets, mappedExonOffsets, sizeof(int32_t) * gene->exonCount);
+
+    gene->referenceGenome = (char *)malloc(strlen(mappedReferenceGenome) + 1);
+    strcpy(gene->referenceGenome, mappedReferenceGenome);
+
+    gene->essentialPositions = NULL;
+    gene->essentialPositionsAllocated = gene->essentialPositionCount;
+    if (gene->essentialPositionCount) {
+        gene->essentialPositions = (int32_t *)malloc(sizeof(int32_t) * gene->essentialPositionCount);
+        memcpy(gene->essentialPositions, mappedEssentialPositions, sizeof(int32_t) * gene->essentialPositionCount);
+    }
+
+    gene->mapped = 0;
+}
+
+static void gene_add_exon(gene_t *gene, exon_range_t exon)
+{
+    gene_copy_mapped(gene);
+    if (gene->exonCount == gene->exonsAllocated) {
+        gene->exons = (exon_range_t *)realloc(gene->exons, sizeof(exon_range_t) * (gene->exonsAllocated * 2));
+        gene->exonOffsets = (int32_t *)realloc(gene->exonOffsets, sizeof(int32_t) * (gene->exonsAllocated * 2));
+        gene->exonsAllocated *= 2;
+        memset(gene->exons + gene->exonCount, 0, sizeof(exon_range_t) * (gene->exonsAllocated - gene->exonCount));
+        memset(gene->exonOffsets + gene->exonCount, 0, sizeof(int32_t) * (gene->exonsAllocated - gene->exonCount));
+    }
+    if (exon_range_strand(exon) == minusstrand) {
+        gene->strand = minusstrand;
+    }
+    gene->exons[gene->exonCount] = exon;
+    gene->exonOffsets[gene->exonCount] = gene->length;
+    gene->exonCount++;
+    gene->length += exon_range_length(exon);
+}
+
+static void gene_add_essential_position(gene_t *gene, int32_t position)
+{
+    gene_copy_mapped(gene);
+    if (gene->essentialPositionCount == gene->essentialPositionsAllocated) {
+        gene->essentialPositionsAllocated = gene->essentialPositionsAllocated ? gene->essentialPositionsAllocated * 2 : 8;
+        gene->essentialPositions = (int32_t *)realloc(gene->essentialPositions, sizeof(int32_t) * gene->essentialPositionsAllocated);
+    }
+    gene->essentialPositions[gene->essentialPositionCount] = position;
+    gene->essentialPositionCount++;
+}
+
 
 gene_mapper_t *gene_mapper_init()
 {
     gene_mapper_t *newGeneMapper = (gene_mapper_t *)malloc(sizeof(gene_mapper_t));
     memset(newGeneMapper, 0, sizeof(gene_mapper_t));
-    newGeneMapper->exonsAllocated = 2;
-    newGeneMapper->exons = (exon_range_t *)malloc(sizeof(exon_range_t) * 2);
-    memset(newGeneMapper->exons, 0, sizeof(exon_range_t) * 2);
-    
+    newGeneMapper->genesAllocated = 2;
+    newGeneMapper->genes = (gene_t **)malloc(sizeof(gene_t *) * 2);
+    memset(newGeneMapper->genes, 0, sizeof(gene_t *) * 2);
+    newGeneMapper->contigsAllocated = 2;
+    newGeneMapper->contigs = (gene_mapper_contig_t *)malloc(sizeof(gene_mapper_contig_t) * 2);
+    memset(newGeneMapper->contigs, 0, sizeof(gene_mapper_contig_t) * 2);
+    newGeneMapper->anyContigIndex = -1;
+    newGeneMapper->lastGeneRid = -1;
+
     return newGeneMapper;
 }
 
 gene_mapper_t *gene_mapper_initWithExons(exon_range_t* exons, int32_t exonCount)
 {
-    gene_mapper_t *newGeneMapper = (gene_mapper_t *)malloc(sizeof(gene_mapper_t));
-    memset(newGeneMapper, 0, sizeof(gene_mapper_t));
-    
-    newGeneMapper->exonCount = exonCount;
-    newGeneMapper->exonsAllocated = exonCount;
-    newGeneMapper->exons = (exon_range_t *)malloc(sizeof(exon_range_t) * exonCount);
-    memcpy(newGeneMapper->exons, exons, sizeof(exon_range_t) * exonCount);
-    
+    gene_mapper_t *newGeneMapper = gene_mapper_init();
+    gene_mapper_add_gene(newGeneMapper, "reference", NULL);
+
+    int32_t i;
+    for (i = 0; i < exonCount; i++) {
+        gene_mapper_add_exon(newGeneMapper, exons[i]);
+    }
+
     return newGeneMapper;
 }
 
+/* The exon file lists the genes one after the other:
+   Gene: (name) [(contig)]
+   (start_position) (end_position)
+   ...
+   Sequence:
+   (reference sequence)
+   (essential position)
+   ...
+   The "Gene:" line can be omitted if the file holds a single gene, and the "Sequence:" line is optional. */
 gene_mapper_t *gene_mapper_file_init(FILE *fp)
 {
     gene_mapper_t *newGeneMapper = gene_mapper_init();
-    int start;
-    int end;
-    
-    while (fscanf(fp, "%d %d\n", &start, &end) == 2) {
-        gene_mapper_add_exon(newGeneMapper, exon_range(start, end));
-    }
-    
-    fscanf(fp, "Sequence:\n");
-    
-    long sequenceFilePoss = ftell(fp);
-    int32_t sequenceLength = 0;
-    while (isspace(fgetc(fp)) == 0) {
-        sequenceLength++;
-    }
-    fseek(fp, sequenceFilePoss, SEEK_SET);
-    
-    newGeneMapper->referenceGenome = (char *)malloc(sequenceLength + 1);
-
-    
-    fscanf(fp, "%s\n", newGeneMapper->referenceGenome);
-    
-    long essentialPositionsFilePoss = ftell(fp);
-    int32_t essentialPositionCount = 0;
-    int position = 0;
-    while (fscanf(fp, "%d\n", &position) == 1) {
-        essentialPositionCount++;
-    }
-    fseek(fp, essentialPositionsFilePoss, SEEK_SET);
-
-    newGeneMapper->essentialPositions = (int32_t *)malloc(sizeof(int32_t) * essentialPositionCount);
-    memset(newGeneMapper->essentialPositions, 0, sizeof(int32_t) * essentialPositionCount);
-
-    for (newGeneMapper->essentialPositionCount = 0; fscanf(fp, "%d\n", &position) == 1;) {
-        newGeneMapper->essentialPositions[newGeneMapper->essentialPositionCount] = position;
-        newGeneMapper->essentialPositionCount++;
-    }
-    
-    int32_t totalExonLength = 0;
-    int i = 0;
-    for (i = 0; i < newGeneMapper->exonCount; i++) {
-        totalExonLength += exon_range_length(newGeneMapper->exons[i]);
-    }
-    
-    if (strlen(newGeneMapper->referenceGenome) != totalExonLength) {
-        fprintf(stderr, "***WARNING*** The Genomic Reference sequence has a length of %d when the total length of the exons is %d.\n", (int)strlen(newGeneMapper->referenceGenome), (int)totalExonLength);
-    }
-    
+    gene_t *gene = NULL;
+    char readingExons = 1;
+
+    char *line = NULL;
+    size_t lineAllocated = 0;
+    int32_t lineNumber = 0;
+    while (getline(&line, &lineAllocated, fp) >= 0) {
+        lineNumber++;
+        char *text = line;
+        while (isspace(*text)) {
+            text++;
+        }
+        size_t textLength = strlen(text);
+        while (textLength > 0 && isspace(text[textLength - 1])) {
+            textLength--;
+        }
+        text[textLength] = 0;
+        if (textLength == 0) {
+            continue;
+        }
+
+        if (strncmp(text, "Gene:", 5) == 0) {
+            char *name = strtok(text + 5, " \t");
+            char *contig = strtok(NULL, " \t");
+            if (name == NULL) {
+                fprintf(stderr, "***WARNING*** Missing gene name on line %d of the exon file.\n", (int)lineNumber);
+                name = "reference";
+            }
+            gene = gene_mapper_add_gene(newGeneMapper, name, contig);
+            readingExons = 1;
+            continue;
+        }
+
+        if (gene == NULL) {
+            gene = gene_mapper_add_gene(newGeneMapper, "reference", NULL);
+        }
+
+        int start;
+        int end;
+        if (strncmp(text, "Sequence:", 9) == 0) {
+            readingExons = 0;
+        } else if (readingExons && sscanf(text, "%d %d", &start, &end) == 2) {
+            gene_mapper_add_exon(newGeneMapper, exon_range(start, end));
+        } else if (isalpha(text[0])) {
+            free(gene->referenceGenome);
+            gene->referenceGenome = (char *)malloc(textLength + 1);
+            strcpy(gene->referenceGenome, text);
+            readingExons = 0;
+        } else if (readingExons == 0 && sscanf(text, "%d", &start) == 1) {
+            gene_add_essential_position(gene, start);
+        } else {
+            fprintf(stderr, "***WARNING*** Unable to read line %d of the exon file.\n", (int)lineNumber);
+        }
+    }
+    free(line);
+
+    int32_t i;
+    for (i = 0; i < newGeneMapper->geneCount; i++) {
+        gene = newGeneMapper->genes[i];
+        if (gene->referenceGenome == NULL) {
+            gene->referenceGenome = (char *)malloc(1);
+            gene->referenceGenome[0] = 0;
+        } else if (strlen(gene->referenceGenome) != gene->length) {
+            fprintf(stderr, "***WARNING*** The Genomic Reference sequence of %s has a length of %d when the total length of the exons is %d.\n",
+                    gene->name, (int)strlen(gene->referenceGenome), (int)gene->length);
+        }
+    }
+
+    gene_mapper_build_index(newGeneMapper);
+
     return newGeneMapper;
 }
 
+static int32_t gene_mapper_contig_index(gene_mapper_t* geneMapper, const char *contig)
+{
+    int32_t i;
+
+    if (contig == NULL && geneMapper->anyContigIndex >= 0) {
+        return geneMapper->anyContigIndex;
+    }
+    for (i = 0; contig && i < geneMapper->contigCount; i++) {
+        if (geneMapper->contigs[i].name && strcmp(geneMapper->contigs[i].name, contig) == 0) {
+            return i;
+        }
+    }
+
+    if (geneMapper->contigCount == geneMapper->contigsAllocated) {
+        geneMapper->contigs = (gene_mapper_contig_t *)realloc(geneMapper->contigs, sizeof(gene_mapper_contig_t) * (geneMapper->contigsAllocated * 2));
+        geneMapper->contigsAllocated *= 2;
+        memset(geneMapper->contigs + geneMapper->contigCount, 0, sizeof(gene_mapper_contig_t) * (geneMapper->contigsAllocated - geneMapper->contigCount));
+    }
+    gene_mapper_contig_t *newContig = geneMapper->contigs + geneMapper->contigCount;
+    if (contig) {
+        newContig->name = (char *)malloc(strlen(contig) + 1);
+        strcpy(newContig->name, contig);
+    } else {
+        geneMapper->anyContigIndex = geneMapper->contigCount;
+    }
+    geneMapper->contigCount++;
+
+    return geneMapper->contigCount - 1;
+}
+
+gene_t *gene_mapper_add_gene(gene_mapper_t* geneMapper, const char *name, const char *contig)
+{
+    if (geneMapper->geneCount == geneMapper->genesAllocated) {
+        geneMapper->genes = (gene_t **)realloc(geneMapper->genes, sizeof(gene_t *) * (geneMapper->genesAllocated * 2));
+        geneMapper->genesAllocated *= 2;
+        memset(geneMapper->genes + geneMapper->geneCount, 0, sizeof(gene_t *) * (geneMapper->genesAllocated - geneMapper->geneCount));
+    }
+    gene_t *newGene = gene_init(name, contig);
+    newGene->contigIndex = gene_mapper_contig_index(geneMapper, contig);
+    geneMapper->genes[geneMapper->geneCount] = newGene;
+    geneMapper->geneCount++;
+    geneMapper->indexDirty = 1;
+
+    return newGene;
+}
+
+void gene_mapper_add_gene_exon(gene_mapper_t* geneMapper, int32_t geneIndex, exon_range_t exon)
+{
+    gene_add_exon(geneMapper->genes[geneIndex], exon);
+    geneMapper->indexDirty = 1;
+}
+
 void gene_mapper_add_exon(gene_mapper_t* geneMapper, exon_range_t exon)
 {
-    if (geneMapper->exonCount == geneMapper->exonsAllocated) {
-        geneMapper->exons = (exon_range_t *)realloc(geneMapper->exons, sizeof(exon_range_t) * (geneMapper->exonsAllocated * 2));
-        geneMapper->exonsAllocated *= 2;
-        memset(geneMapper->exons + geneMapper->exonCount, 0, sizeof(exon_range_t) * (geneMapper->exonsAllocated - geneMapper->exonCount));
+    if (geneMapper->geneCount == 0) {
+        gene_mapper_add_gene(geneMapper, "reference", NULL);
     }
-    geneMapper->exons[geneMapper->exonCount] = exon;
-    geneMapper->exonCount++;
+    gene_mapper_add_gene_exon(geneMapper, geneMapper->geneCount - 1, exon);
+}
+
+static int compare_exons(const void *exon1Ptr, const void *exon2Ptr)
+{
+    const exon_range_t *exon1 = (const exon_range_t *)exon1Ptr;
+    const exon_range_t *exon2 = (const exon_range_t *)exon2Ptr;
+    if (exon1->start != exon2->start) {
+        return exon1->start < exon2->start ? -1 : 1;
+    } else {
+        return 0;
+    }
+}
+
+void gene_mapper_sort_exons(gene_mapper_t* geneMapper)
+{
+    int32_t i;
+    int32_t j;
+
+    for (i = 0; i < geneMapper->geneCount; i++) {
+        gene_t *gene = geneMapper->genes[i];
+        gene_copy_mapped(gene);
+        qsort(gene->exons, gene->exonCount, sizeof(exon_range_t), compare_exons);
+        if (gene_strand(gene) == minusstrand) { // the first exon of a (-)strand gene is the one with the largest start
+            for (j = 0; j < gene->exonCount / 2; j++) {
+                exon_range_t exon = gene->exons[j];
+                gene->exons[j] = gene->exons[gene->exonCount - 1 - j];
+                gene->exons[gene->exonCount - 1 - j] = exon;
+            }
+        }
+        gene->length = 0;
+        for (j = 0; j < gene->exonCount; j++) {
+            gene->exonOffsets[j] = gene->length;
+            gene->length += exon_range_length(gene->exons[j]);
+        }
+    }
+    geneMapper->indexDirty = 1;
 }
 
 void gene_mapper_destroy(gene_mapper_t* geneMapper)
 {
-    free(geneMapper->exons);
-    free(geneMapper->referenceGenome);
-    free(geneMapper->essentialPositions);
+    int32_t i;
+    for (i = 0; i < geneMapper->geneCount; i++) {
+        gene_destroy(geneMapper->genes[i]);
+    }
+    free(geneMapper->genes);
+    for (i = 0; i < geneMapper->contigCount; i++) {
+        free(geneMapper->contigs[i].name);
+        if (geneMapper->contigs[i].mapped == 0) {
+            free(geneMapper->contigs[i].intervals);
+            free(geneMapper->contigs[i].intervalStarts);
+        }
+    }
+    free(geneMapper->contigs);
+    free(geneMapper->ridContigIndexes);
+    if (geneMapper->mappedModel) {
+        munmap(geneMapper->mappedModel, geneMapper->mappedModelLength);
+    }
     free(geneMapper);
 }
 
-int32_t gene_mapper_map_position(gene_mapper_t* geneMapper, int32_t genomePosition, exon_range_t* exonRangeOut)
+void gene_mapper_set_header(gene_mapper_t* geneMapper, const bcf_hdr_t *header)
 {
-    int32_t runLength = 0;
+    int32_t rid;
     int32_t i;
-    
-    for (i = 0; i < geneMapper->exonCount; i++) {
-        exon_range_t exon = geneMapper->exons[i];
-        char plusExon = exon.end >= exon.start;
-        int32_t exonLength;
-        if (plusExon) {
-            exonLength = (exon.end - exon.start) + 1;
-            if (genomePosition <= exon.end && genomePosition >= exon.start) {
-                if (exonRangeOut) {
-                    *exonRangeOut = exon;
-                }
-                return runLength + (genomePosition - exon.start);
-            } else {
-                runLength += exonLength;
+
+    gene_mapper_build_index(geneMapper);
+
+    free(geneMapper->ridContigIndexes);
+    geneMapper->ridCount = header->n[BCF_DT_CTG];
+    geneMapper->ridContigIndexes = (int32_t *)malloc(sizeof(int32_t) * (geneMapper->ridCount + 1));
+    for (rid = 0; rid < geneMapper->ridCount; rid++) {
+        const char *sequenceName = bcf_hdr_id2name(header, rid);
+        geneMapper->ridContigIndexes[rid] = -1;
+        for (i = 0; i < geneMapper->contigCount; i++) { // prefer the exact name over a "chr" match
+            if (geneMapper->contigs[i].name && strcmp(geneMapper->contigs[i].name, sequenceName) == 0) {
+                geneMapper->ridContigIndexes[rid] = i;
+                break;
             }
-        } else {
-            exonLength = (exon.start - exon.end) + 1;
-            if (genomePosition <= exon.start && genomePosition >= exon.end) {
-                if (exonRangeOut) {
-                    *exonRangeOut = exon;
-                }
-                return runLength + (exon.start - genomePosition);
-            } else {
-                runLength += exonLength;
+        }
+        for (i = 0; geneMapper->ridContigIndexes[rid] == -1 && i < geneMapper->contigCount; i++) {
+            if (geneMapper->contigs[i].name && contig_names_match(geneMapper->contigs[i].name, sequenceName)) {
+                geneMapper->ridContigIndexes[rid] = i;
             }
         }
     }
-    
-    return -1;
+
+    geneMapper->lastGeneRid = -1;
+    for (rid = 0; rid < geneMapper->ridCount; rid++) {
+        if (geneMapper->ridContigIndexes[rid] >= 0 && geneMapper->contigs[geneMapper->ridContigIndexes[rid]].intervalCount > 0) {
+            geneMapper->lastGeneRid = rid;
+        }
+    }
+}
+
+gene_mapper_t *gene_mapper_header_view_init(gene_mapper_t* geneMapper, const bcf_hdr_t *header)
+{
+    gene_mapper_build_index(geneMapper);
+
+    gene_mapper_t *newHeaderView = (gene_mapper_t *)malloc(sizeof(gene_mapper_t));
+    memcpy(newHeaderView, geneMapper, sizeof(gene_mapper_t));
+    newHeaderView->ridCount = 0;
+    newHeaderView->ridContigIndexes = NULL;
+    newHeaderView->mappedModel = NULL;
+    newHeaderView->mappedModelLength = 0;
+    gene_mapper_set_header(newHeaderView, header);
+
+    return newHeaderView;
+}
+
+void gene_mapper_header_view_destroy(gene_mapper_t* headerView)
+{
+    free(headerView->ridContigIndexes);
+    free(headerView);
 }
 
-int32_t gene_mapper_reversemap_position(gene_mapper_t* geneMapper, int32_t genePosition)
+static int compare_intervals(const void *interval1Ptr, const void *interval2Ptr)
+{
+    const gene_mapper_interval_t *interval1 = (const gene_mapper_interval_t *)interval1Ptr;
+    const gene_mapper_interval_t *interval2 = (const gene_mapper_interval_t *)interval2Ptr;
+    if (interval1->start != interval2->start) {
+        return interval1->start < interval2->start ? -1 : 1;
+    } else if (interval1->geneIndex != interval2->geneIndex) {
+        return interval1->geneIndex < interval2->geneIndex ? -1 : 1;
+    } else if (interval1->exonIndex != interval2->exonIndex) {
+        return interval1->exonIndex < interval2->exonIndex ? -1 : 1;
+    } else {
+        return 0;
+    }
+}
+
+/* The intervals sorted by start are also an implicit interval tree, as in cgranges: the interval at index i is at level k
+   if the k lowest bits of i are set and the next one is not, so the leaves are at the even indexes, and the children of
+   an interval at level k are at i - 2^(k-1) and i + 2^(k-1). The maxEnd of an interval is the largest end in its
+   subtree, so a lookup only goes down the subtrees that reach the position, whatever the lengths of the intervals. */
+static void gene_mapper_contig_build_tree(gene_mapper_contig_t *contig)
+{
+    gene_mapper_interval_t *intervals = contig->intervals;
+    int64_t count = contig->intervalCount;
+    int64_t lastIndex = 0; // the last interval and its ancestors in the tree, which can be past the end of the intervals
+    int32_t lastMaxEnd = 0;
+    int64_t i;
+    int32_t level;
+
+    contig->rootLevel = 0;
+    if (count == 0) {
+        return;
+    }
+    for (i = 0; i < count; i += 2) {
+        lastIndex = i;
+        lastMaxEnd = intervals[i].maxEnd = intervals[i].end;
+    }
+    for (level = 1; ((int64_t)1 << level) <= count; level++) {
+        int64_t childDistance = (int64_t)1 << (level - 1);
+        for (i = (childDistance << 1) - 1; i < count; i += childDistance << 2) {
+            int32_t maxEnd = intervals[i].end;
+            if (intervals[i - childDistance].maxEnd > maxEnd) {
+                maxEnd = intervals[i - childDistance].maxEnd;
+            }
+            // a right child past the end of the intervals holds the subtree of the last interval
+            int32_t rightMaxEnd = i + childDistance < count ? intervals[i + childDistance].maxEnd : lastMaxEnd;
+            if (rightMaxEnd > maxEnd) {
+                maxEnd = rightMaxEnd;
+            }
+            intervals[i].maxEnd = maxEnd;
+        }
+        lastIndex = (lastIndex >> level) & 1 ? lastIndex - childDistance : lastIndex + childDistance;
+        if (lastIndex < count && intervals[lastIndex].maxEnd > lastMaxEnd) {
+            lastMaxEnd = intervals[lastIndex].maxEnd;
+        }
+    }
+    contig->rootLevel = level - 1;
+}
+
+void gene_mapper_build_index(gene_mapper_t* geneMapper)
 {
-    int32_t runPosition = genePosition;
     int32_t i;
+    int32_t j;
 
-    for (i = 0; i < geneMapper->exonCount; i++) {
-        exon_range_t exon = geneMapper->exons[i];
-        char plusExon = exon.end >= exon.start;
-        int32_t exonLength;
-        if (plusExon) {
-            exonLength = (exon.end - exon.start) + 1;
-            if (exonLength >= runPosition) {
-                return exon.start + runPosition;
-            } else {
-                runPosition -= exonLength;
+    if (geneMapper->indexDirty == 0) {
+        return;
+    }
+
+    for (i = 0; i < geneMapper->contigCount; i++) {
+        if (geneMapper->contigs[i].mapped) { // the index of a memory mapped gene model is rebuilt in memory
+            geneMapper->contigs[i].intervals = NULL;
+            geneMapper->contigs[i].intervalStarts = NULL;
+            geneMapper->contigs[i].intervalsAllocated = 0;
+            geneMapper->contigs[i].mapped = 0;
+        }
+        geneMapper->contigs[i].intervalCount = 0;
+    }
+
+    for (i = 0; i < geneMapper->geneCount; i++) {
+        gene_t *gene = geneMapper->genes[i];
+        gene_mapper_contig_t *contig = geneMapper->contigs + gene->contigIndex;
+        for (j = 0; j < gene->exonCount; j++) {
+            if (contig->intervalCount == contig->intervalsAllocated) {
+                contig->intervalsAllocated = contig->intervalsAllocated ? contig->intervalsAllocated * 2 : 16;
+                contig->intervals = (gene_mapper_interval_t *)realloc(contig->intervals, sizeof(gene_mapper_interval_t) * contig->intervalsAllocated);
             }
-        } else {
-            exonLength = (exon.start - exon.end) + 1;
-            if (exonLength >= runPosition) {
-                return exon.start - runPosition;
+            gene_mapper_interval_t *interval = contig->intervals + contig->intervalCount;
+            exon_range_t exon = gene->exons[j];
+            if (exon_range_strand(exon) == plusstrand) {
+                interval->start = exon.start;
+                interval->end = exon.end;
             } else {
-                runPosition -= exonLength;
+                interval->start = exon.end;
+                interval->end = exon.start;
+            }
+            interval->geneIndex = i;
+            interval->exonIndex = j;
+            contig->intervalCount++;
+        }
+    }
+
+    for (i = 0; i < geneMapper->contigCount; i++) {
+        gene_mapper_contig_t *contig = geneMapper->contigs + i;
+        qsort(contig->intervals, contig->intervalCount, sizeof(gene_mapper_interval_t), compare_intervals);
+        contig->intervalStarts = (int32_t *)realloc(contig->intervalStarts, sizeof(int32_t) * (contig->intervalCount + 1));
+        contig->maxEnd = -1;
+        for (j = 0; j < contig->intervalCount; j++) {
+            contig->intervalStarts[j] = contig->intervals[j].start;
+            if (contig->intervals[j].end > contig->maxEnd) {
+                contig->maxEnd = contig->intervals[j].end;
             }
         }
+        gene_mapper_contig_build_tree(contig);
     }
-    
-    return -1;
+
+    geneMapper->indexDirty = 0;
 }
 
-void gene_mapper_print_exons(gene_mapper_t* geneMapper, FILE *fp)
+int32_t gene_mapper_exon_count(gene_mapper_t* geneMapper)
 {
+    int32_t exonCount = 0;
     int32_t i;
+    for (i = 0; i < geneMapper->geneCount; i++) {
+        exonCount += geneMapper->genes[i]->exonCount;
+    }
+    return exonCount;
+}
+
+// returns the index of the first start after the position, between low and high
+static int32_t gene_mapper_starts_upper_bound(const int32_t *starts, int32_t low, int32_t high, int32_t genomePosition)
+{
+    while (low < high) {
+        int32_t middle = low + (high - low) / 2;
+        if (starts[middle] <= genomePosition) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// returns the number of intervals that start at or before the position
+static int32_t gene_mapper_contig_upper_bound(const gene_mapper_contig_t *contig, int32_t genomePosition)
+{
+    return gene_mapper_starts_upper_bound(contig->intervalStarts, 0, contig->intervalCount, genomePosition);
+}
+
+static int32_t gene_mapper_scan_starts_scalar(const int32_t *starts, int32_t index, int32_t count, int32_t genomePosition)
+{
+    while (index < count && starts[index] <= genomePosition) {
+        index++;
+    }
+    return index;
+}
+
+#ifdef GENE_MAPPER_X86_SIMD
+
+__attribute__((target("sse2")))
+static int32_t gene_mapper_scan_starts_sse2(const int32_t *starts, int32_t index, int32_t count, int32_t genomePosition)
+{
+    __m128i position = _mm_set1_epi32(genomePosition);
+    while (index + 4 <= count) {
+        __m128i after = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)(starts + index)), position);
+        int afterMask = _mm_movemask_ps(_mm_castsi128_ps(after));
+        if (afterMask) { // the starts are sorted, the first one after the position ends the scan
+            return index + __builtin_ctz(afterMask);
+        }
+        index += 4;
+    }
+    return gene_mapper_scan_starts_scalar(starts, index, count, genomePosition);
+}
+
+__attribute__((target("avx2")))
+static int32_t gene_mapper_scan_starts_avx2(const int32_t *starts, int32_t index, int32_t count, int32_t genomePosition)
+{
+    __m256i position = _mm256_set1_epi32(genomePosition);
+    while (index + 8 <= count) {
+        __m256i after = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(starts + index)), position);
+        int afterMask = _mm256_movemask_ps(_mm256_castsi256_ps(after));
+        if (afterMask) {
+            return index + __builtin_ctz(afterMask);
+        }
+        index += 8;
+    }
+    return gene_mapper_scan_starts_scalar(starts, index, count, genomePosition);
+}
+
+#endif
+
+// returns the number of intervals that start at or before the position, knowing that at least upperBound of them do
+static int32_t gene_mapper_contig_advance_upper_bound(const gene_mapper_contig_t *contig, int32_t upperBound, int32_t genomePosition)
+{
+    const int32_t *starts = contig->intervalStarts;
+    int32_t count = contig->intervalCount;
+
+    if (count - upperBound > GENE_MAPPER_SCAN_LENGTH && starts[upperBound + GENE_MAPPER_SCAN_LENGTH] <= genomePosition) {
+        return gene_mapper_starts_upper_bound(starts, upperBound + GENE_MAPPER_SCAN_LENGTH + 1, count, genomePosition);
+    }
+#ifdef GENE_MAPPER_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return gene_mapper_scan_starts_avx2(starts, upperBound, count, genomePosition);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return gene_mapper_scan_starts_sse2(starts, upperBound, count, genomePosition);
+    }
+#endif
+    return gene_mapper_scan_starts_scalar(starts, upperBound, count, genomePosition);
+}
+
+typedef struct {
+    int64_t index;
+    int32_t level;
+    int32_t leftVisited;
+} gene_mapper_tree_node_t;
+
+static inline void gene_mapper_lookup_interval(const gene_mapper_interval_t *interval, int32_t genomePosition, const gene_mapper_interval_t **bestIntervalPtr)
+{
+    // the intervals are visited in order, the first one of the gene with the lowest index is kept
+    if (interval->end >= genomePosition && (*bestIntervalPtr == NULL || interval->geneIndex < (*bestIntervalPtr)->geneIndex)) {
+        *bestIntervalPtr = interval;
+    }
+}
+
+// returns the interval containing the position with the lowest gene index, or NULL
+// upperBound is the number of intervals that start at or before the position
+static const gene_mapper_interval_t *gene_mapper_contig_lookup(const gene_mapper_contig_t *contig, int32_t upperBound, int32_t genomePosition)
+{
+    const gene_mapper_interval_t *intervals = contig->intervals;
+    const gene_mapper_interval_t *bestInterval = NULL;
+    int64_t count = contig->intervalCount;
+    gene_mapper_tree_node_t stack[64]; // the tree has at most 31 levels
+    int32_t stackLength = 0;
+
+    if (upperBound == 0) {
+        return NULL;
+    }
+
+    stack[0].index = ((int64_t)1 << contig->rootLevel) - 1;
+    stack[0].level = contig->rootLevel;
+    stack[0].leftVisited = 0;
+    stackLength = 1;
+    while (stackLength > 0) {
+        gene_mapper_tree_node_t node = stack[--stackLength];
+        if (node.level <= 3) { // small subtrees are scanned
+            int64_t i = node.index >> node.level << node.level;
+            int64_t subtreeEnd = i + ((int64_t)1 << (node.level + 1)) - 1;
+            if (subtreeEnd > upperBound) {
+                subtreeEnd = upperBound;
+            }
+            for (; i < subtreeEnd; i++) {
+                gene_mapper_lookup_interval(intervals + i, genomePosition, &bestInterval);
+            }
+        } else if (node.leftVisited == 0) {
+            int64_t leftIndex = node.index - ((int64_t)1 << (node.level - 1));
+            node.leftVisited = 1;
+            stack[stackLength++] = node;
+            // a child past the end of the intervals has no maxEnd, but can have intervals in its subtree
+            if (leftIndex >= count || intervals[leftIndex].maxEnd >= genomePosition) {
+                stack[stackLength].index = leftIndex;
+                stack[stackLength].level = node.level - 1;
+                stack[stackLength].leftVisited = 0;
+                stackLength++;
+            }
+        } else if (node.index < upperBound) { // the intervals after upperBound start after the position
+            gene_mapper_lookup_interval(intervals + node.index, genomePosition, &bestInterval);
+            stack[stackLength].index = node.index + ((int64_t)1 << (node.level - 1));
+            stack[stackLength].level = node.level - 1;
+            stack[stackLength].leftVisited = 0;
+            stackLength++;
+        }
+    }
+
+    return bestInterval;
+}
 
-    fprintf(fp, "There %s %d exons in the exon file.\n", geneMapper->exonCount == 1?"is":"are", (int)geneMapper->exonCount);
-    
-    int32_t totalLength = 0;
-    for (i = 0; i < geneMapper->exonCount; i++) {
-        exon_range_t exon = geneMapper->exons[i];
-        fprintf(fp, "    %8d  %8d ", (int)exon.start, (int)exon.end);
-        fprintf(fp, "  Length: %5d  (%c)strand\n", exon_range_length(exon), exon_range_strand(exon));
-        totalLength += exon_range_length(exon);
+static inline gene_mapper_contig_t *gene_mapper_rid_contig(gene_mapper_t* geneMapper, int32_t rid)
+{
+    if (rid >= 0 && rid < geneMapper->ridCount && geneMapper->ridContigIndexes[rid] >= 0) {
+        return geneMapper->contigs + geneMapper->ridContigIndexes[rid];
     }
-    fprintf(fp, "Total Length: %d\n", totalLength);
+    return NULL;
 }
 
+static inline gene_mapper_contig_t *gene_mapper_any_contig(gene_mapper_t* geneMapper)
+{
+    return geneMapper->anyContigIndex >= 0 ? geneMapper->contigs + geneMapper->anyContigIndex : NULL;
+}
 
+static int32_t gene_mapper_interval_gene_position(gene_mapper_t* geneMapper, const gene_mapper_interval_t *interval, int32_t genomePosition, gene_mapping_t* mappingOut)
+{
+    gene_t *gene = geneMapper->genes[interval->geneIndex];
+    exon_range_t exon = gene->exons[interval->exonIndex];
+    if (mappingOut) {
+        mappingOut->gene = gene;
+        mappingOut->geneIndex = interval->geneIndex;
+        mappingOut->exonIndex = interval->exonIndex;
+        mappingOut->exon = exon;
+    }
 
+    if (exon_range_strand(exon) == plusstrand) {
+        return gene->exonOffsets[interval->exonIndex] + (genomePosition - exon.start);
+    } else {
+        return gene->exonOffsets[interval->exonIndex] + (exon.start - genomePosition);
+    }
+}
 
+int32_t gene_mapper_map_position(gene_mapper_t* geneMapper, int32_t rid, int32_t genomePosition, gene_mapping_t* mappingOut)
+{
+    const gene_mapper_interval_t *interval = NULL;
 
+    gene_mapper_build_index(geneMapper);
 
+    gene_mapper_contig_t *contig = gene_mapper_rid_contig(geneMapper, rid);
+    if (contig) {
+        interval = gene_mapper_contig_lookup(contig, gene_mapper_contig_upper_bound(contig, genomePosition), genomePosition);
+    }
+    gene_mapper_contig_t *anyContig = gene_mapper_any_contig(geneMapper);
+    if (anyContig) {
+        const gene_mapper_interval_t *anyContigInterval = gene_mapper_contig_lookup(anyContig, gene_mapper_contig_upper_bound(anyContig, genomePosition), genomePosition);
+        if (anyContigInterval && (interval == NULL || anyContigInterval->geneIndex < interval->geneIndex)) {
+            interval = anyContigInterval;
+        }
+    }
+    if (interval == NULL) {
+        return -1;
+    }
 
+    return gene_mapper_interval_gene_position(geneMapper, interval, genomePosition, mappingOut);
+}
 
+int32_t gene_mapper_map_positions(gene_mapper_t* geneMapper, int32_t rid, const int32_t *genomePositions, int32_t positionCount, int32_t *genePositionsOut, gene_mapping_t *mappingsOut)
+{
+    gene_mapper_build_index(geneMapper);
+
+    gene_mapper_contig_t *contig = gene_mapper_rid_contig(geneMapper, rid);
+    gene_mapper_contig_t *anyContig = gene_mapper_any_contig(geneMapper);
+    int32_t contigIntervalIndex = 0;
+    int32_t anyContigIntervalIndex = 0;
+    int32_t lastPosition = INT32_MIN;
+    int32_t mappedCount = 0;
+    int32_t i;
 
+    for (i = 0; i < positionCount; i++) {
+        int32_t genomePosition = genomePositions[i];
+        if (genomePosition < lastPosition) { // start over for positions that are out of order
+            contigIntervalIndex = 0;
+            anyContigIntervalIndex = 0;
+        }
+        lastPosition = genomePosition;
 
+        const gene_mapper_interval_t *interval = NULL;
+        if (contig) {
+            contigIntervalIndex = gene_mapper_contig_advance_upper_bound(contig, contigIntervalIndex, genomePosition);
+            interval = gene_mapper_contig_lookup(contig, contigIntervalIndex, genomePosition);
+        }
+        if (anyContig) {
+            anyContigIntervalIndex = gene_mapper_contig_advance_upper_bound(anyContig, anyContigIntervalIndex, genomePosition);
+            const gene_mapper_interval_t *anyContigInterval = gene_mapper_contig_lookup(anyContig, anyContigIntervalIndex, genomePosition);
+            if (anyContigInterval && (interval == NULL || anyContigInterval->geneIndex < interval->geneIndex)) {
+                interval = anyContigInterval;
+            }
+        }
 
+        if (interval) {
+            genePositionsOut[i] = gene_mapper_interval_gene_position(geneMapper, interval, genomePosition, mappingsOut ? mappingsOut + i : NULL);
+            mappedCount++;
+        } else {
+            genePositionsOut[i] = -1;
+        }
+    }
 
+    return mappedCount;
+}
 
+int gene_mapper_position_finished(gene_mapper_t* geneMapper, int32_t rid, int32_t genomePosition)
+{
+    gene_mapper_contig_t *anyContig = gene_mapper_any_contig(geneMapper);
+    if (anyContig && anyContig->intervalCount > 0) {
+        return 0;
+    }
+    if (rid != geneMapper->lastGeneRid) {
+        return rid > geneMapper->lastGeneRid;
+    }
 
+    gene_mapper_contig_t *contig = gene_mapper_rid_contig(geneMapper, rid);
+    return contig == NULL || genomePosition > contig->maxEnd;
+}
 
+// returns the index of the exon holding the gene position, the position must be in the gene
+static inline int32_t gene_exon_index(const gene_t *gene, int32_t genePosition)
+{
+    // number of exons that start at or before the position, the offsets are increasing
+    int32_t low = 0;
+    int32_t high = gene->exonCount;
+    while (low < high) {
+        int32_t middle = low + (high - low) / 2;
+        if (gene->exonOffsets[middle] <= genePosition) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low - 1;
+}
 
+static inline int32_t gene_exon_genome_position(const gene_t *gene, int32_t exonIndex, int32_t genePosition)
+{
+    exon_range_t exon = gene->exons[exonIndex];
+    if (exon.end >= exon.start) {
+        return exon.start + (genePosition - gene->exonOffsets[exonIndex]);
+    } else {
+        return exon.start - (genePosition - gene->exonOffsets[exonIndex]);
+    }
+}
+
+int32_t gene_mapper_reversemap_position(gene_mapper_t* geneMapper, int32_t geneIndex, int32_t genePosition)
+{
+    gene_t *gene = geneMapper->genes[geneIndex];
+    if (genePosition < 0 || genePosition >= gene->length) {
+        return -1;
+    }
+    return gene_exon_genome_position(gene, gene_exon_index(gene, genePosition), genePosition);
+}
+
+void gene_mapper_reversemap_positions(gene_mapper_t* geneMapper, int32_t geneIndex, const int32_t *genePositions, int32_t *genomePositionsOut, int32_t positionCount)
+{
+    gene_t *gene = geneMapper->genes[geneIndex];
+    int32_t exonIndex = 0;
+    int32_t i;
+
+    for (i = 0; i < positionCount; i++) {
+        int32_t genePosition = genePositions[i];
+        if (genePosition < 0 || genePosition >= gene->length) {
+            genomePositionsOut[i] = -1;
+            continue;
+        }
+        // sorted positions are usually in the exon of the previous position or in the next one
+        if (genePosition < gene->exonOffsets[exonIndex]) {
+            exonIndex = gene_exon_index(gene, genePosition);
+        } else if (exonIndex + 1 < gene->exonCount && genePosition >= gene->exonOffsets[exonIndex + 1]) {
+            exonIndex++;
+            if (exonIndex + 1 < gene->exonCount && genePosition >= gene->exonOffsets[exonIndex + 1]) {
+                exonIndex = gene_exon_index(gene, genePosition);
+            }
+        }
+        genomePositionsOut[i] = gene_exon_genome_position(gene, exonIndex, genePosition);
+    }
+}
 
+genomic_region_t *gene_mapper_genomic_regions(gene_mapper_t* geneMapper, int32_t *regionCountOut)
+{
+    gene_mapper_build_index(geneMapper);
+
+    genomic_region_t *regions = (genomic_region_t *)malloc(sizeof(genomic_region_t) * (gene_mapper_exon_count(geneMapper) + 1));
+    int32_t regionCount = 0;
+    int32_t i;
+    int32_t j;
+
+    for (i = 0; i < geneMapper->contigCount; i++) {
+        gene_mapper_contig_t *contig = geneMapper->contigs + i;
+        for (j = 0; j < contig->intervalCount; j++) {
+            regions[regionCount + j].contig = contig->name;
+            regions[regionCount + j].start = contig->intervals[j].start;
+            regions[regionCount + j].end = contig->intervals[j].end;
+        }
+        regionCount += genomic_regions_merge(regions + regionCount, contig->intervalCount);
+    }
+
+    *regionCountOut = regionCount;
+    return regions;
+}
+
+void gene_mapper_print_exons(gene_mapper_t* geneMapper, FILE *fp)
+{
+    int32_t i;
+    int32_t j;
+
+    for (j = 0; j < geneMapper->geneCount; j++) {
+        gene_t *gene = geneMapper->genes[j];
+        if (geneMapper->geneCount > 1 || gene->contig) {
+            fprintf(fp, "Gene %s on %s:\n", gene->name, gene->contig ? gene->contig : "any contig");
+        }
+        fprintf(fp, "There %s %d exons in the exon file.\n", gene->exonCount == 1?"is":"are", (int)gene->exonCount);
+
+        for (i = 0; i < gene->exonCount; i++) {
+            exon_range_t exon = gene->exons[i];
+            fprintf(fp, "    %8d  %8d ", (int)exon.start, (int)exon.end);
+            fprintf(fp, "  Length: %5d  (%c)strand\n", exon_range_length(exon), gene_strand(gene));
+        }
+        fprintf(fp, "Total Length: %d\n", gene->length);
+    }
+}
@@ -23,30 +23,124 @@ static inline exon_range_t exon_range(int32_t start, int32_t end) {exon_range_t
 static inline strand_t exon_range_strand(exon_range_t exon) {return (exon.start <= exon.end)?plusstrand:minusstrand;}
 int32_t exon_range_length(exon_range_t exon);
 
+typedef struct { // genomic region, start and end are inclusive and start <= end
+    const char *contig; // NULL if the region is on every contig
+    int32_t start;
+    int32_t end;
+} genomic_region_t;
+
+// sorts the regions by start and merges the overlapping and adjacent ones, the contig is ignored, returns the new region count
+int32_t genomic_regions_merge(genomic_region_t *regions, int32_t regionCount);
+
+// returns 1 if the names are the same contig, "chr1" and "1" are considered to be the same contig
+int contig_names_match(const char *contigName1, const char *contigName2);
+
 typedef struct {
+    char *name;
+    char *contig; // NULL if the gene can be on any contig
+    int32_t contigIndex; // index of the contig in the gene mapper
+
+    strand_t strand; // (-)strand if an exon goes from a larger to a smaller position, or if set by the reader
     int32_t exonCount;
     exon_range_t* exons;
+    int32_t* exonOffsets; // position in the gene of the first nucleotide of each exon
     int32_t exonsAllocated;
-    
+    int32_t length; // total length of the exons
+
     char* referenceGenome;
     int32_t* essentialPositions;
     int32_t essentialPositionCount;
+    int32_t essentialPositionsAllocated;
+
+    char mapped; // set if the exons, offsets, reference genome and essential positions are in a memory mapped gene model, they are copied before being modified
+} gene_t;
+
+// exons of a single nucleotide have no direction of their own, so the strand is kept with the gene
+static inline strand_t gene_strand(gene_t* gene) {return gene->strand;}
+
+typedef struct { // exon of a gene, indexed by its genomic bounds
+    int32_t start; // start <= end
+    int32_t end;
+    int32_t maxEnd; // largest end of the intervals in the subtree of this interval, in the interval tree of its contig
+    int32_t geneIndex;
+    int32_t exonIndex;
+} gene_mapper_interval_t;
+
+typedef struct {
+    char *name; // NULL for the genes that can be on any contig
+    int32_t intervalCount;
+    int32_t intervalsAllocated;
+    gene_mapper_interval_t *intervals; // sorted by start, which also makes them an implicit interval tree
+    int32_t *intervalStarts; // starts of the intervals, in their own array so that they can be compared several at a time
+    int32_t rootLevel; // level of the root of the interval tree
+    int32_t maxEnd; // largest end of all the intervals, -1 if there are none
+    char mapped; // set if the intervals and their starts are in a memory mapped gene model
+} gene_mapper_contig_t;
+
+typedef struct {
+    int32_t geneCount;
+    int32_t genesAllocated;
+    gene_t **genes;
+
+    int32_t contigCount;
+    int32_t contigsAllocated;
+    gene_mapper_contig_t *contigs;
+    int32_t anyContigIndex; // index of the contig holding the genes that can be on any contig, -1 if there is none
+    char indexDirty;
+
+    int32_t ridCount;
+    int32_t *ridContigIndexes; // index of the contig for each rid of the header, -1 if no gene is on that contig
+    int32_t lastGeneRid; // largest rid with exons, -1 if there is none
+
+    void *mappedModel; // memory mapped gene model the genes and contigs point into, unmapped by gene_mapper_destroy
+    size_t mappedModelLength;
 } gene_mapper_t;
 
+typedef struct {
+    gene_t *gene;
+    int32_t geneIndex;
+    int32_t exonIndex;
+    exon_range_t exon;
+} gene_mapping_t;
+
 
 gene_mapper_t *gene_mapper_init();
 
-gene_mapper_t *gene_mapper_initWithExons(exon_range_t* exons, int32_t exonCount);
+gene_mapper_t *gene_mapper_initWithExons(exon_range_t* exons, int32_t exonCount); // a single gene that can be on any contig
 gene_mapper_t *gene_mapper_file_init(FILE *fp);
 
-void gene_mapper_add_exon(gene_mapper_t* geneMapper, exon_range_t exon);
+gene_t *gene_mapper_add_gene(gene_mapper_t* geneMapper, const char *name, const char *contig); // contig can be NULL
+void gene_mapper_add_gene_exon(gene_mapper_t* geneMapper, int32_t geneIndex, exon_range_t exon);
+void gene_mapper_add_exon(gene_mapper_t* geneMapper, exon_range_t exon); // adds the exon to the last gene
+// sorts the exons of every gene in the order of the gene, by increasing start on the (+)strand and decreasing start on the (-)strand
+void gene_mapper_sort_exons(gene_mapper_t* geneMapper);
 void gene_mapper_destroy(gene_mapper_t* geneMapper);
 
-static inline int32_t gene_mapper_exon_count(gene_mapper_t* geneMapper) {return geneMapper->exonCount;}
+// matches the contigs of the genes with the contigs of the header, must be called before mapping positions of records read with this header
+void gene_mapper_set_header(gene_mapper_t* geneMapper, const bcf_hdr_t *header);
+void gene_mapper_build_index(gene_mapper_t* geneMapper); // called automatically, but must be called before sharing the gene mapper between threads
+// shares the genes and the index of geneMapper with the contigs of another header, to map the records of files with different
+// headers at the same time, the view must not be changed and is destroyed before geneMapper
+gene_mapper_t *gene_mapper_header_view_init(gene_mapper_t* geneMapper, const bcf_hdr_t *header);
+void gene_mapper_header_view_destroy(gene_mapper_t* headerView);
+
+static inline int32_t gene_mapper_gene_count(gene_mapper_t* geneMapper) {return geneMapper->geneCount;}
+int32_t gene_mapper_exon_count(gene_mapper_t* geneMapper); // total number of exons in all the genes
 void gene_mapper_print_exons(gene_mapper_t* geneMapper, FILE *fp);
 
-int32_t gene_mapper_map_position(gene_mapper_t* geneMapper, int32_t genomePosition, exon_range_t* exonRangeOut); // returns -1 if the position does not map
-int32_t gene_mapper_reversemap_position(gene_mapper_t* geneMapper, int32_t genePosition); // returns -1 if the position is out of the range
+int32_t gene_mapper_map_position(gene_mapper_t* geneMapper, int32_t rid, int32_t genomePosition, gene_mapping_t* mappingOut); // returns -1 if the position does not map
+// maps positions of the same rid, the gene positions of the positions that don't map are -1, mappingsOut can be NULL
+// faster if the positions are sorted, returns the number of positions that map
+int32_t gene_mapper_map_positions(gene_mapper_t* geneMapper, int32_t rid, const int32_t *genomePositions, int32_t positionCount, int32_t *genePositionsOut, gene_mapping_t *mappingsOut);
+// returns 1 if no sorted position after this one can map
+int gene_mapper_position_finished(gene_mapper_t* geneMapper, int32_t rid, int32_t genomePosition);
+int32_t gene_mapper_reversemap_position(gene_mapper_t* geneMapper, int32_t geneIndex, int32_t genePosition); // returns -1 if the position is out of the range
+// reverse maps positions of the same gene, the genome positions of the positions out of the range are -1, faster if the positions are sorted
+void gene_mapper_reversemap_positions(gene_mapper_t* geneMapper, int32_t geneIndex, const int32_t *genePositions, int32_t *genomePositionsOut, int32_t positionCount);
+
+// returns the sorted and merged genomic regions covered by the exons, the caller is responsible for freeing the returned array
+// the contigs of the regions are owned by the gene mapper
+genomic_region_t *gene_mapper_genomic_regions(gene_mapper_t* geneMapper, int32_t *regionCountOut);
 
 
 #endif
@@ -0,0 +1,354 @@
+//
+//  genemodel.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "genemodel.h"
+
+static const char geneModelMagic[8] = {'B', 'C', 'F', 'G', 'M', 'M', 'D', 'L'};
+#define GENE_MODEL_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int32_t geneCount;
+    int32_t contigCount;
+    int32_t anyContigIndex;
+    int32_t reserved;
+    uint64_t fileLength;
+} gene_model_header_t;
+
+typedef struct {
+    uint64_t nameOffset; // 0 for the contig of the genes that can be on any contig
+    uint64_t intervalsOffset;
+    uint64_t intervalStartsOffset;
+    int32_t intervalCount;
+    int32_t rootLevel;
+    int32_t maxEnd;
+    int32_t reserved;
+} gene_model_contig_t;
+
+typedef struct {
+    uint64_t nameOffset;
+    uint64_t exonsOffset;
+    uint64_t exonOffsetsOffset;
+    uint64_t referenceGenomeOffset;
+    uint64_t essentialPositionsOffset;
+    int32_t contigIndex;
+    int32_t exonCount;
+    int32_t length;
+    int32_t essentialPositionCount;
+    int32_t referenceGenomeLength;
+    int32_t strand;
+} gene_model_gene_t;
+
+static inline uint64_t gene_model_align(uint64_t offset) {return (offset + 7) & ~(uint64_t)7;}
+
+int gene_model_file_is_model(const char *filename)
+{
+    struct stat fileStat;
+    if (stat(filename, &fileStat) != 0 || S_ISREG(fileStat.st_mode) == 0) {
+        return 0;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+    char magic[sizeof(geneModelMagic)];
+    int isModel = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, geneModelMagic, sizeof(magic)) == 0;
+    fclose(fp);
+
+    return isModel;
+}
+
+// returns 1 if count elements of the given size starting at offset are in the file
+static int gene_model_array_valid(const gene_model_header_t *header, uint64_t offset, int64_t count, uint64_t size)
+{
+    return count >= 0 && offset % 8 == 0 && offset <= header->fileLength && (uint64_t)count <= (header->fileLength - offset) / size;
+}
+
+static const char *gene_model_string(const char *model, const gene_model_header_t *header, uint64_t offset)
+{
+    if (offset == 0 || offset >= header->fileLength || memchr(model + offset, 0, header->fileLength - offset) == NULL) {
+        return NULL;
+    }
+    return model + offset;
+}
+
+static gene_mapper_t *gene_model_invalid(const char *filename, void *model, size_t modelLength)
+{
+    fprintf(stderr, "***WARNING*** The gene model '%s' is damaged.\n", filename);
+    munmap(model, modelLength);
+    return NULL;
+}
+
+gene_mapper_t *gene_model_map_file(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "***WARNING*** Unable to open the gene model '%s'.\n", filename);
+        return NULL;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < sizeof(gene_model_header_t)) {
+        fprintf(stderr, "***WARNING*** The gene model '%s' is too short.\n", filename);
+        close(fd);
+        return NULL;
+    }
+    size_t modelLength = (size_t)fileStat.st_size;
+    void *mappedModel = mmap(NULL, modelLength, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mappedModel == MAP_FAILED) {
+        fprintf(stderr, "***WARNING*** Unable to map the gene model '%s'.\n", filename);
+        return NULL;
+    }
+
+    const char *model = (const char *)mappedModel;
+    const gene_model_header_t *header = (const gene_model_header_t *)model;
+    if (memcmp(header->magic, geneModelMagic, sizeof(geneModelMagic)) != 0 || header->byteOrder != GENE_MODEL_BYTE_ORDER) {
+        fprintf(stderr, "***WARNING*** '%s' is not a gene model compiled on this kind of machine.\n", filename);
+        munmap(mappedModel, modelLength);
+        return NULL;
+    }
+    if (header->version != GENE_MODEL_VERSION) {
+        fprintf(stderr, "***WARNING*** The gene model '%s' has version %d, but version %d is expected, compile it again.\n",
+                filename, (int)header->version, GENE_MODEL_VERSION);
+        munmap(mappedModel, modelLength);
+        return NULL;
+    }
+    if (header->fileLength != modelLength || header->geneCount < 0 || header->contigCount < 0 ||
+        header->anyContigIndex < -1 || header->anyContigIndex >= header->contigCount ||
+        gene_model_array_valid(header, sizeof(gene_model_header_t), header->contigCount, sizeof(gene_model_contig_t)) == 0 ||
+        gene_model_array_valid(header, sizeof(gene_model_header_t) + sizeof(gene_model_contig_t) * header->contigCount, header->geneCount, sizeof(gene_model_gene_t)) == 0) {
+        return gene_model_invalid(filename, mappedModel, modelLength);
+    }
+    const gene_model_contig_t *modelContigs = (const gene_model_contig_t *)(model + sizeof(gene_model_header_t));
+    const gene_model_gene_t *modelGenes = (const gene_model_gene_t *)(modelContigs + header->contigCount);
+
+    // only the bounds are checked, the arrays themselves are used in place
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < header->geneCount; i++) {
+        const gene_model_gene_t *modelGene = modelGenes + i;
+        if (gene_model_string(model, header, modelGene->nameOffset) == NULL ||
+            modelGene->contigIndex < 0 || modelGene->contigIndex >= header->contigCount ||
+            (modelGene->strand != plusstrand && modelGene->strand != minusstrand) ||
+            gene_model_array_valid(header, modelGene->exonsOffset, modelGene->exonCount, sizeof(exon_range_t)) == 0 ||
+            gene_model_array_valid(header, modelGene->exonOffsetsOffset, modelGene->exonCount, sizeof(int32_t)) == 0 ||
+            gene_model_array_valid(header, modelGene->referenceGenomeOffset, (int64_t)modelGene->referenceGenomeLength + 1, 1) == 0 ||
+            model[modelGene->referenceGenomeOffset + modelGene->referenceGenomeLength] != 0 ||
+            gene_model_array_valid(header, modelGene->essentialPositionsOffset, modelGene->essentialPositionCount, sizeof(int32_t)) == 0) {
+            return gene_model_invalid(filename, mappedModel, modelLength);
+        }
+    }
+    for (i = 0; i < header->contigCount; i++) {
+        const gene_model_contig_t *modelContig = modelContigs + i;
+        if ((i != header->anyContigIndex && gene_model_string(model, header, modelContig->nameOffset) == NULL) ||
+            gene_model_array_valid(header, modelContig->intervalsOffset, modelContig->intervalCount, sizeof(gene_mapper_interval_t)) == 0 ||
+            gene_model_array_valid(header, modelContig->intervalStartsOffset, modelContig->intervalCount, sizeof(int32_t)) == 0 ||
+            modelContig->rootLevel < 0 || modelContig->rootLevel > 30 ||
+            (modelContig->intervalCount == 0 && modelContig->rootLevel != 0) ||
+            (modelContig->intervalCount > 0 && (((int64_t)1 << modelContig->rootLevel) > modelContig->intervalCount ||
+                                                ((int64_t)2 << modelContig->rootLevel) <= modelContig->intervalCount))) {
+            return gene_model_invalid(filename, mappedModel, modelLength);
+        }
+        const gene_mapper_interval_t *intervals = (const gene_mapper_interval_t *)(model + modelContig->intervalsOffset);
+        for (j = 0; j < modelContig->intervalCount; j++) {
+            if (intervals[j].geneIndex < 0 || intervals[j].geneIndex >= header->geneCount ||
+                intervals[j].exonIndex < 0 || intervals[j].exonIndex >= modelGenes[intervals[j].geneIndex].exonCount) {
+                return gene_model_invalid(filename, mappedModel, modelLength);
+            }
+        }
+    }
+
+    gene_mapper_t *newGeneMapper = gene_mapper_init();
+    newGeneMapper->mappedModel = mappedModel;
+    newGeneMapper->mappedModelLength = modelLength;
+
+    if (header->contigCount > newGeneMapper->contigsAllocated) {
+        newGeneMapper->contigsAllocated = header->contigCount;
+        newGeneMapper->contigs = (gene_mapper_contig_t *)realloc(newGeneMapper->contigs, sizeof(gene_mapper_contig_t) * newGeneMapper->contigsAllocated);
+        memset(newGeneMapper->contigs, 0, sizeof(gene_mapper_contig_t) * newGeneMapper->contigsAllocated);
+    }
+    for (i = 0; i < header->contigCount; i++) {
+        gene_mapper_contig_t *contig = newGeneMapper->contigs + i;
+        if (i != header->anyContigIndex) {
+            const char *name = model + modelContigs[i].nameOffset;
+            contig->name = (char *)malloc(strlen(name) + 1);
+            strcpy(contig->name, name);
+        }
+        contig->intervalCount = modelContigs[i].intervalCount;
+        contig->intervalsAllocated = modelContigs[i].intervalCount;
+        contig->intervals = (gene_mapper_interval_t *)(model + modelContigs[i].intervalsOffset);
+        contig->intervalStarts = (int32_t *)(model + modelContigs[i].intervalStartsOffset);
+        contig->rootLevel = modelContigs[i].rootLevel;
+        contig->maxEnd = modelContigs[i].maxEnd;
+        contig->mapped = 1;
+    }
+    newGeneMapper->contigCount = header->contigCount;
+    newGeneMapper->anyContigIndex = header->anyContigIndex;
+
+    if (header->geneCount > newGeneMapper->genesAllocated) {
+        newGeneMapper->genesAllocated = header->geneCount;
+        newGeneMapper->genes = (gene_t **)realloc(newGeneMapper->genes, sizeof(gene_t *) * newGeneMapper->genesAllocated);
+        memset(newGeneMapper->genes, 0, sizeof(gene_t *) * newGeneMapper->genesAllocated);
+    }
+    for (i = 0; i < header->geneCount; i++) {
+        const gene_model_gene_t *modelGene = modelGenes + i;
+        gene_t *gene = (gene_t *)malloc(sizeof(gene_t));
+        memset(gene, 0, sizeof(gene_t));
+
+        const char *name = model + modelGene->nameOffset;
+        gene->name = (char *)malloc(strlen(name) + 1);
+        strcpy(gene->name, name);
+        gene->contigIndex = modelGene->contigIndex;
+        if (newGeneMapper->contigs[gene->contigIndex].name) {
+            gene->contig = (char *)malloc(strlen(newGeneMapper->contigs[gene->contigIndex].name) + 1);
+            strcpy(gene->contig, newGeneMapper->contigs[gene->contigIndex].name);
+        }
+
+        gene->strand = (strand_t)modelGene->strand;
+        gene->exonCount = modelGene->exonCount;
+        gene->exonsAllocated = modelGene->exonCount;
+        gene->exons = (exon_range_t *)(model + modelGene->exonsOffset);
+        gene->exonOffsets = (int32_t *)(model + modelGene->exonOffsetsOffset);
+        gene->length = modelGene->length;
+        gene->referenceGenome = (char *)(model + modelGene->referenceGenomeOffset);
+        gene->essentialPositionCount = modelGene->essentialPositionCount;
+        gene->essentialPositionsAllocated = modelGene->essentialPositionCount;
+        gene->essentialPositions = (int32_t *)(model + modelGene->essentialPositionsOffset);
+        gene->mapped = 1;
+
+        newGeneMapper->genes[i] = gene;
+    }
+    newGeneMapper->geneCount = header->geneCount;
+    newGeneMapper->indexDirty = 0;
+
+    return newGeneMapper;
+}
+
+// writes zeros up to the offset, and then the data
+static int gene_model_write_data(FILE *fp, uint64_t *fileOffset, uint64_t offset, const void *data, size_t length)
+{
+    static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    while (*fileOffset < offset) {
+        size_t paddingLength = offset - *fileOffset < sizeof(zeros) ? (size_t)(offset - *fileOffset) : sizeof(zeros);
+        if (fwrite(zeros, 1, paddingLength, fp) != paddingLength) {
+            return -1;
+        }
+        *fileOffset += paddingLength;
+    }
+    if (length && fwrite(data, 1, length, fp) != length) {
+        return -1;
+    }
+    *fileOffset += length;
+    return 0;
+}
+
+int gene_model_write(gene_mapper_t *geneMapper, FILE *fp)
+{
+    int32_t i;
+
+    gene_mapper_build_index(geneMapper);
+
+    gene_model_header_t header;
+    memset(&header, 0, sizeof(gene_model_header_t));
+    memcpy(header.magic, geneModelMagic, sizeof(geneModelMagic));
+    header.version = GENE_MODEL_VERSION;
+    header.byteOrder = GENE_MODEL_BYTE_ORDER;
+    header.geneCount = geneMapper->geneCount;
+    header.contigCount = geneMapper->contigCount;
+    header.anyContigIndex = geneMapper->anyContigIndex;
+
+    gene_model_contig_t *modelContigs = (gene_model_contig_t *)malloc(sizeof(gene_model_contig_t) * (geneMapper->contigCount + 1));
+    memset(modelContigs, 0, sizeof(gene_model_contig_t) * (geneMapper->contigCount + 1));
+    gene_model_gene_t *modelGenes = (gene_model_gene_t *)malloc(sizeof(gene_model_gene_t) * (geneMapper->geneCount + 1));
+    memset(modelGenes, 0, sizeof(gene_model_gene_t) * (geneMapper->geneCount + 1));
+
+    // lay out the data after the tables, in the order it is written
+    uint64_t offset = sizeof(gene_model_header_t) + sizeof(gene_model_contig_t) * geneMapper->contigCount + sizeof(gene_model_gene_t) * geneMapper->geneCount;
+    for (i = 0; i < geneMapper->contigCount; i++) {
+        gene_mapper_contig_t *contig = geneMapper->contigs + i;
+        if (contig->name) {
+            modelContigs[i].nameOffset = offset = gene_model_align(offset);
+            offset += strlen(contig->name) + 1;
+        }
+        modelContigs[i].intervalsOffset = offset = gene_model_align(offset);
+        modelContigs[i].intervalCount = contig->intervalCount;
+        modelContigs[i].rootLevel = contig->rootLevel;
+        modelContigs[i].maxEnd = contig->maxEnd;
+        offset += sizeof(gene_mapper_interval_t) * contig->intervalCount;
+        modelContigs[i].intervalStartsOffset = offset = gene_model_align(offset);
+        offset += sizeof(int32_t) * contig->intervalCount;
+    }
+    for (i = 0; i < geneMapper->geneCount; i++) {
+        gene_t *gene = geneMapper->genes[i];
+        gene_model_gene_t *modelGene = modelGenes + i;
+        modelGene->contigIndex = gene->contigIndex;
+        modelGene->strand = gene_strand(gene);
+        modelGene->exonCount = gene->exonCount;
+        modelGene->length = gene->length;
+        modelGene->essentialPositionCount = gene->essentialPositionCount;
+        modelGene->referenceGenomeLength = gene->referenceGenome ? (int32_t)strlen(gene->referenceGenome) : 0;
+
+        modelGene->nameOffset = offset = gene_model_align(offset);
+        offset += strlen(gene->name) + 1;
+        modelGene->exonsOffset = offset = gene_model_align(offset);
+        offset += sizeof(exon_range_t) * gene->exonCount;
+        modelGene->exonOffsetsOffset = offset = gene_model_align(offset);
+        offset += sizeof(int32_t) * gene->exonCount;
+        modelGene->referenceGenomeOffset = offset = gene_model_align(offset);
+        offset += modelGene->referenceGenomeLength + 1;
+        modelGene->essentialPositionsOffset = offset = gene_model_align(offset);
+        offset += sizeof(int32_t) * gene->essentialPositionCount;
+    }
+    header.fileLength = offset;
+
+    uint64_t fileOffset = 0;
+    int result = gene_model_write_data(fp, &fileOffset, 0, &header, sizeof(gene_model_header_t));
+    if (result == 0) {
+        result = gene_model_write_data(fp, &fileOffset, fileOffset, modelContigs, sizeof(gene_model_contig_t) * geneMapper->contigCount);
+    }
+    if (result == 0) {
+        result = gene_model_write_data(fp, &fileOffset, fileOffset, modelGenes, sizeof(gene_model_gene_t) * geneMapper->geneCount);
+    }
+    for (i = 0; result == 0 && i < geneMapper->contigCount; i++) {
+        gene_mapper_contig_t *contig = geneMapper->contigs + i;
+        if (contig->name) {
+            result = gene_model_write_data(fp, &fileOffset, modelContigs[i].nameOffset, contig->name, strlen(contig->name) + 1);
+        }
+        if (result == 0) {
+            result = gene_model_write_data(fp, &fileOffset, modelContigs[i].intervalsOffset, contig->intervals, sizeof(gene_mapper_interval_t) * contig->intervalCount);
+        }
+        if (result == 0) {
+            result = gene_model_write_data(fp, &fileOffset, modelContigs[i].intervalStartsOffset, contig->intervalStarts, sizeof(int32_t) * contig->intervalCount);
+        }
+    }
+    for (i = 0; result == 0 && i < geneMapper->geneCount; i++) {
+        gene_t *gene = geneMapper->genes[i];
+        gene_model_gene_t *modelGene = modelGenes + i;
+        if (gene_model_write_data(fp, &fileOffset, modelGene->nameOffset, gene->name, strlen(gene->name) + 1) != 0 ||
+            gene_model_write_data(fp, &fileOffset, modelGene->exonsOffset, gene->exons, sizeof(exon_range_t) * gene->exonCount) != 0 ||
+            gene_model_write_data(fp, &fileOffset, modelGene->exonOffsetsOffset, gene->exonOffsets, sizeof(int32_t) * gene->exonCount) != 0 ||
+            gene_model_write_data(fp, &fileOffset, modelGene->referenceGenomeOffset, gene->referenceGenome ? gene->referenceGenome : "", modelGene->referenceGenomeLength + 1) != 0 ||
+            gene_model_write_data(fp, &fileOffset, modelGene->essentialPositionsOffset, gene->essentialPositions, sizeof(int32_t) * gene->essentialPositionCount) != 0) {
+            result = -1;
+        }
+    }
+
+    free(modelContigs);
+    free(modelGenes);
+
+    return result;
+}
@@ -0,0 +1,45 @@
+//
+//  genemodel.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_genemodel_h
+#define bcfgenemapper_genemodel_h
+
+#include <stdio.h>
+#include "genemapper.h"
+
+/* A gene model is the compiled form of an exon file. It holds the genes with their exons, the offsets of the exons
+   in the genes, the reference sequences and the essential positions, and the sorted exon intervals of every contig,
+   which are also their interval tree (see genemapper.c).
+   The file is memory mapped and used as it is, so nothing is parsed or indexed when it is read.
+
+   All the values are in the byte order of the machine that compiled the model, and all the offsets are from the start
+   of the file. Every array starts on an 8 byte boundary.
+   header:    "BCFGMMDL", uint32 version, uint32 0x01020304 (byte order), int32 gene count, int32 contig count,
+              int32 index of the contig of the genes that can be on any contig (-1 if there is none), int32 0,
+              uint64 file length
+   contigs:   for each contig, uint64 name offset (0 for the contig of the genes that can be on any contig),
+              uint64 intervals offset, uint64 interval starts offset, int32 interval count, int32 level of the root of
+              the interval tree, int32 largest end of the intervals (-1 if there are none), int32 0
+   genes:     for each gene, uint64 name, exons, exon offsets, reference genome and essential positions offsets,
+              int32 contig index, exon count, length, essential position count, reference genome length,
+              strand ('+' or '-')
+   data:      the names and reference genomes are 0 terminated, the exons are pairs of int32 (start, end),
+              the intervals are gene_mapper_interval_t and the interval starts, exon offsets and essential
+              positions are int32 */
+
+#define GENE_MODEL_VERSION 3 // 2 added the strands of the genes, 3 the interval starts
+
+// returns 1 if the file is a gene model, files that can't be memory mapped (pipes) are never gene models
+int gene_model_file_is_model(const char *filename);
+
+// returns NULL and prints the reason if the gene model can't be read
+gene_mapper_t *gene_model_map_file(const char *filename);
+
+// returns 0 on success, the file does not need to be seekable
+int gene_model_write(gene_mapper_t *geneMapper, FILE *fp);
+
+#endif
@@ -0,0 +1,284 @@
+//
+//  genotypematrix.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <htslib/khash_str2int.h>
+#include "genotypematrix.h"
+
+static const char genotypeMatrixMagic[8] = {'B', 'C', 'F', 'G', 'M', 'G', 'T', 'M'};
+#define GENOTYPE_MATRIX_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int32_t positionCount;
+    int32_t haplotypeCount;
+    int32_t geneCount;
+    int32_t alleleCount;
+    uint64_t genesOffset;
+    uint64_t positionsOffset;
+    uint64_t allelesOffset;
+    uint64_t haplotypesOffset;
+    uint64_t codesOffset;
+    uint64_t phasesOffset;
+    uint64_t fileLength;
+} genotype_matrix_header_t;
+
+typedef struct {
+    int32_t geneIndex;
+    int32_t position;
+    int32_t firstAllele;
+    int32_t alleleCount;
+} genotype_matrix_position_t;
+
+typedef struct {
+    uint64_t sampleNameOffset;
+    int32_t haplotype;
+    int32_t reserved;
+} genotype_matrix_haplotype_t;
+
+/* The positions and alleles of the blocks of variation lists are kept in memory, and their codes and phases are
+   written to blockFp, the codes of each haplotype and then the phases of each haplotype of every block. */
+typedef struct {
+    int32_t haplotypeCount;
+
+    int32_t positionCount;
+    int32_t positionsAllocated;
+    genotype_matrix_position_t *positions;
+
+    int32_t alleleCount;
+    int32_t alleleOffsetsAllocated;
+    uint64_t *alleleOffsets; // in alleleText
+    char *alleleText;
+    size_t alleleTextLength;
+    size_t alleleTextAllocated;
+
+    FILE *blockFp;
+    csv_writer_t *blockWriter;
+    int32_t blockCount;
+    int32_t blocksAllocated;
+    int64_t *blockOffsets;
+    int32_t *blockPositionCounts;
+
+    uint16_t *codes; // reused to transpose the genotypes of a block
+    uint8_t *phases;
+    size_t codesAllocated;
+} genotype_matrix_blocks_t;
+
+static inline uint64_t genotype_matrix_align(uint64_t offset) {return (offset + 7) & ~(uint64_t)7;}
+
+static void genotype_matrix_add_allele(genotype_matrix_blocks_t *blocks, const char *allele)
+{
+    size_t alleleLength = strlen(allele) + 1;
+    if (blocks->alleleCount == blocks->alleleOffsetsAllocated) {
+        blocks->alleleOffsetsAllocated = blocks->alleleOffsetsAllocated ? blocks->alleleOffsetsAllocated * 2 : 1024;
+        blocks->alleleOffsets = (uint64_t *)realloc(blocks->alleleOffsets, sizeof(uint64_t) * blocks->alleleOffsetsAllocated);
+    }
+    while (blocks->alleleTextLength + alleleLength > blocks->alleleTextAllocated) {
+        blocks->alleleTextAllocated = blocks->alleleTextAllocated ? blocks->alleleTextAllocated * 2 : 4096;
+        blocks->alleleText = (char *)realloc(blocks->alleleText, blocks->alleleTextAllocated);
+    }
+    blocks->alleleOffsets[blocks->alleleCount] = blocks->alleleTextLength;
+    blocks->alleleCount++;
+    memcpy(blocks->alleleText + blocks->alleleTextLength, allele, alleleLength);
+    blocks->alleleTextLength += alleleLength;
+}
+
+static void genotype_matrix_add_block(csv_formatter_t *csvFormatter, void *context)
+{
+    genotype_matrix_blocks_t *blocks = (genotype_matrix_blocks_t *)context;
+    int32_t haplotypeCount = blocks->haplotypeCount;
+    int32_t positionCount = csvFormatter->variationListsCount;
+    int32_t i;
+    int32_t j;
+
+    if (blocks->positionCount + positionCount > blocks->positionsAllocated) {
+        while (blocks->positionCount + positionCount > blocks->positionsAllocated) {
+            blocks->positionsAllocated = blocks->positionsAllocated ? blocks->positionsAllocated * 2 : 1024;
+        }
+        blocks->positions = (genotype_matrix_position_t *)realloc(blocks->positions, sizeof(genotype_matrix_position_t) * blocks->positionsAllocated);
+    }
+    if ((size_t)positionCount * haplotypeCount > blocks->codesAllocated) {
+        blocks->codesAllocated = (size_t)positionCount * haplotypeCount;
+        blocks->codes = (uint16_t *)realloc(blocks->codes, sizeof(uint16_t) * blocks->codesAllocated);
+        blocks->phases = (uint8_t *)realloc(blocks->phases, blocks->codesAllocated);
+    }
+
+    for (i = 0; i < positionCount; i++) {
+        csv_formatter_variation_list_t *variationList = csvFormatter->variationLists[i];
+        genotype_matrix_position_t *position = blocks->positions + blocks->positionCount + i;
+        int geneIndex = -1;
+        khash_str2int_get(csvFormatter->sequenceNameHash, variationList->sequenceName, &geneIndex);
+        position->geneIndex = geneIndex;
+        position->position = variationList->position;
+        position->firstAllele = blocks->alleleCount;
+        position->alleleCount = variationList->alleleCount;
+        for (j = 0; j < variationList->alleleCount; j++) {
+            genotype_matrix_add_allele(blocks, variationList->alleles[j]);
+        }
+
+        const csv_formatter_genotype_t *genotypes = csv_formatter_genotypes(csvFormatter, variationList);
+        uint16_t *codes = blocks->codes + i;
+        uint8_t *phases = blocks->phases + i;
+        for (j = 0; j < haplotypeCount; j++) {
+            codes[(size_t)j * positionCount] = genotypes[j] & ~CSV_FORMATTER_GENOTYPE_UNPHASED;
+            phases[(size_t)j * positionCount] = (genotypes[j] & CSV_FORMATTER_GENOTYPE_UNPHASED) == 0;
+        }
+    }
+
+    if (blocks->blockCount == blocks->blocksAllocated) {
+        blocks->blocksAllocated = blocks->blocksAllocated ? blocks->blocksAllocated * 2 : 16;
+        blocks->blockOffsets = (int64_t *)realloc(blocks->blockOffsets, sizeof(int64_t) * blocks->blocksAllocated);
+        blocks->blockPositionCounts = (int32_t *)realloc(blocks->blockPositionCounts, sizeof(int32_t) * blocks->blocksAllocated);
+    }
+    blocks->blockOffsets[blocks->blockCount] = csv_writer_tell(blocks->blockWriter);
+    blocks->blockPositionCounts[blocks->blockCount] = positionCount;
+    blocks->blockCount++;
+    csv_writer_write(blocks->blockWriter, (const char *)blocks->codes, sizeof(uint16_t) * positionCount * haplotypeCount);
+    csv_writer_write(blocks->blockWriter, (const char *)blocks->phases, (size_t)positionCount * haplotypeCount);
+    blocks->positionCount += positionCount;
+}
+
+// writes zeros up to the offset, and then the data
+static void genotype_matrix_write_data(csv_writer_t *csvWriter, uint64_t *fileOffset, uint64_t offset, const void *data, size_t length)
+{
+    static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    if (*fileOffset < offset) {
+        csv_writer_write(csvWriter, zeros, (size_t)(offset - *fileOffset));
+        *fileOffset = offset;
+    }
+    if (length) {
+        csv_writer_write(csvWriter, (const char *)data, length);
+    }
+    *fileOffset += length;
+}
+
+void genotype_matrix_write(csv_formatter_t *csvFormatter, csv_writer_t *csvWriter)
+{
+    int64_t startTime = stats_start(csvFormatter->stats);
+    int32_t i;
+    int32_t j;
+
+    if (csv_formatter_is_streaming(csvFormatter)) {
+        fprintf(stderr, "[%s:%d %s] only the wide format can be written as a genotype matrix\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+
+    genotype_matrix_blocks_t blocks;
+    memset(&blocks, 0, sizeof(genotype_matrix_blocks_t));
+    blocks.haplotypeCount = csvFormatter->sampleCount + 1; // reference
+    blocks.blockFp = tmpfile();
+    if (blocks.blockFp == NULL) {
+        fprintf(stderr, "Unable to create a temporary csv file.\n");
+        exit(1);
+    }
+    blocks.blockWriter = csv_writer_init(blocks.blockFp);
+    csv_formatter_for_each_block(csvFormatter, genotype_matrix_add_block, &blocks);
+    csv_writer_destroy(blocks.blockWriter);
+    blocks.blockWriter = NULL;
+
+    int32_t haplotypeCount = blocks.haplotypeCount;
+    int32_t positionCount = blocks.positionCount;
+    int32_t geneCount = csvFormatter->sequenceNameCount;
+
+    genotype_matrix_header_t header;
+    memset(&header, 0, sizeof(genotype_matrix_header_t));
+    memcpy(header.magic, genotypeMatrixMagic, sizeof(genotypeMatrixMagic));
+    header.version = GENOTYPE_MATRIX_VERSION;
+    header.byteOrder = GENOTYPE_MATRIX_BYTE_ORDER;
+    header.positionCount = positionCount;
+    header.haplotypeCount = haplotypeCount;
+    header.geneCount = geneCount;
+    header.alleleCount = blocks.alleleCount;
+
+    // lay out the tables and then the data, in the order they are written
+    uint64_t offset = sizeof(genotype_matrix_header_t);
+    header.genesOffset = offset = genotype_matrix_align(offset);
+    offset += sizeof(uint64_t) * geneCount;
+    header.positionsOffset = offset = genotype_matrix_align(offset);
+    offset += sizeof(genotype_matrix_position_t) * positionCount;
+    header.allelesOffset = offset = genotype_matrix_align(offset);
+    offset += sizeof(uint64_t) * blocks.alleleCount;
+    header.haplotypesOffset = offset = genotype_matrix_align(offset);
+    offset += sizeof(genotype_matrix_haplotype_t) * haplotypeCount;
+    header.codesOffset = offset = genotype_matrix_align(offset);
+    offset += sizeof(uint16_t) * positionCount * haplotypeCount;
+    header.phasesOffset = offset = genotype_matrix_align(offset);
+    offset += (uint64_t)positionCount * haplotypeCount;
+
+    uint64_t *geneNameOffsets = (uint64_t *)malloc(sizeof(uint64_t) * (geneCount + 1));
+    for (i = 0; i < geneCount; i++) {
+        geneNameOffsets[i] = offset;
+        offset += strlen(csvFormatter->sequenceNames[i]) + 1;
+    }
+    genotype_matrix_haplotype_t *haplotypes = (genotype_matrix_haplotype_t *)malloc(sizeof(genotype_matrix_haplotype_t) * haplotypeCount);
+    memset(haplotypes, 0, sizeof(genotype_matrix_haplotype_t) * haplotypeCount);
+    for (i = 0; i < haplotypeCount; i++) {
+        csv_formatter_sample_t *sample = i == 0 ? csvFormatter->referenceSample : csvFormatter->samples[i - 1];
+        haplotypes[i].sampleNameOffset = offset;
+        haplotypes[i].haplotype = i == 0 ? 0 : sample->allele;
+        offset += strlen(sample->sampleName) + 1;
+    }
+    uint64_t alleleTextOffset = offset;
+    for (i = 0; i < blocks.alleleCount; i++) {
+        blocks.alleleOffsets[i] += alleleTextOffset;
+    }
+    offset += blocks.alleleTextLength;
+    header.fileLength = offset;
+
+    uint64_t fileOffset = 0;
+    genotype_matrix_write_data(csvWriter, &fileOffset, 0, &header, sizeof(genotype_matrix_header_t));
+    genotype_matrix_write_data(csvWriter, &fileOffset, header.genesOffset, geneNameOffsets, sizeof(uint64_t) * geneCount);
+    genotype_matrix_write_data(csvWriter, &fileOffset, header.positionsOffset, blocks.positions, sizeof(genotype_matrix_position_t) * positionCount);
+    genotype_matrix_write_data(csvWriter, &fileOffset, header.allelesOffset, blocks.alleleOffsets, sizeof(uint64_t) * blocks.alleleCount);
+    genotype_matrix_write_data(csvWriter, &fileOffset, header.haplotypesOffset, haplotypes, sizeof(genotype_matrix_haplotype_t) * haplotypeCount);
+
+    // the column of each haplotype is the part of the column in every block
+    genotype_matrix_write_data(csvWriter, &fileOffset, header.codesOffset, NULL, 0);
+    for (i = 0; i < haplotypeCount; i++) {
+        for (j = 0; j < blocks.blockCount; j++) {
+            int64_t blockPositionCount = blocks.blockPositionCounts[j];
+            csv_writer_write_file(csvWriter, blocks.blockFp, blocks.blockOffsets[j] + (int64_t)sizeof(uint16_t) * blockPositionCount * i,
+                                  (int64_t)sizeof(uint16_t) * blockPositionCount);
+        }
+    }
+    fileOffset += sizeof(uint16_t) * positionCount * haplotypeCount;
+    genotype_matrix_write_data(csvWriter, &fileOffset, header.phasesOffset, NULL, 0);
+    for (i = 0; i < haplotypeCount; i++) {
+        for (j = 0; j < blocks.blockCount; j++) {
+            int64_t blockPositionCount = blocks.blockPositionCounts[j];
+            csv_writer_write_file(csvWriter, blocks.blockFp, blocks.blockOffsets[j] + (int64_t)sizeof(uint16_t) * blockPositionCount * haplotypeCount + blockPositionCount * i,
+                                  blockPositionCount);
+        }
+    }
+    fileOffset += (uint64_t)positionCount * haplotypeCount;
+
+    for (i = 0; i < geneCount; i++) {
+        genotype_matrix_write_data(csvWriter, &fileOffset, geneNameOffsets[i], csvFormatter->sequenceNames[i], strlen(csvFormatter->sequenceNames[i]) + 1);
+    }
+    for (i = 0; i < haplotypeCount; i++) {
+        csv_formatter_sample_t *sample = i == 0 ? csvFormatter->referenceSample : csvFormatter->samples[i - 1];
+        genotype_matrix_write_data(csvWriter, &fileOffset, haplotypes[i].sampleNameOffset, sample->sampleName, strlen(sample->sampleName) + 1);
+    }
+    genotype_matrix_write_data(csvWriter, &fileOffset, alleleTextOffset, blocks.alleleText, blocks.alleleTextLength);
+
+    free(geneNameOffsets);
+    free(haplotypes);
+    fclose(blocks.blockFp);
+    free(blocks.positions);
+    free(blocks.alleleOffsets);
+    free(blocks.alleleText);
+    free(blocks.blockOffsets);
+    free(blocks.blockPositionCounts);
+    free(blocks.codes);
+    free(blocks.phases);
+
+    stats_stop(csvFormatter->stats, statsstagecsvprint, startTime);
+}
@@ -0,0 +1,38 @@
+//
+//  genotypematrix.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_genotypematrix_h
+#define bcfgenemapper_genotypematrix_h
+
+#include "csvformatter.h"
+#include "csvwriter.h"
+
+/* A genotype matrix has the genotypes of the wide csv format in columns, a column per haplotype with a value per gene
+   position, so that it can be memory mapped and used as it is. The first column is the reference.
+
+   All the values are in the byte order of the machine that wrote the file, and all the offsets are from the start
+   of the file. Every array starts on an 8 byte boundary.
+   header:     "BCFGMGTM", uint32 version, uint32 0x01020304 (byte order), int32 position count, int32 haplotype count
+               (with the reference), int32 gene count, int32 allele count, uint64 genes, positions, alleles,
+               haplotypes, codes and phases offsets, uint64 file length
+   genes:      for each gene, uint64 name offset
+   positions:  for each position, in the order of the csv file, int32 gene index, int32 position in the gene
+               (1-indexed), int32 index of the first allele of the position, int32 allele count of the position
+   alleles:    for each allele, uint64 offset, the alleles of the genes on the (-)strand are complemented
+   haplotypes: for each haplotype, uint64 sample name offset, int32 haplotype of the sample (0 for the reference,
+               1 or 2), int32 0
+   codes:      for each haplotype, a uint16 code per position: 0 no genotype, 1 missing, 2 end of a haploid
+               genotype, 3 and more allele (code - 3) of the position
+   phases:     for each haplotype, a uint8 per position, 0 if the genotype is unphased
+   data:       the names and alleles are 0 terminated */
+
+#define GENOTYPE_MATRIX_VERSION 1
+
+// writes the variations of a wide csv formatter, which are forgotten if they were written to temporary files
+void genotype_matrix_write(csv_formatter_t *csvFormatter, csv_writer_t *csvWriter);
+
+#endif
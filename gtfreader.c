@@ -0,0 +1,155 @@
+//
+//  gtfreader.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+#include <htslib/khash_str2int.h>
+#include "gtfreader.h"
+
+#define GTF_FIELD_COUNT 9
+
+// returns the value of an attribute of the GTF (key "value";) or GFF3 (key=value;) attribute column, the value is
+// 0 terminated in place, returns NULL if the attribute is not there
+static char *gtf_attribute_value(char *attributes, const char *key)
+{
+    size_t keyLength = strlen(key);
+    char *found = attributes;
+
+    while ((found = strstr(found, key)) != NULL) {
+        if ((found == attributes || found[-1] == ' ' || found[-1] == ';') && (found[keyLength] == ' ' || found[keyLength] == '=')) {
+            char *value = found + keyLength + 1;
+            while (*value == ' ') {
+                value++;
+            }
+            char *valueEnd;
+            if (*value == '"') {
+                value++;
+                valueEnd = strchr(value, '"');
+            } else {
+                valueEnd = value + strcspn(value, ";, "); // a GFF3 Parent can list several parents, the first is used
+            }
+            if (valueEnd == NULL || valueEnd == value) {
+                return NULL;
+            }
+            *valueEnd = 0;
+            return value;
+        }
+        found += keyLength;
+    }
+
+    return NULL;
+}
+
+gene_mapper_t *gene_mapper_gtf_init(const char *filename)
+{
+    htsFile *fp = hts_open(filename, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    gene_mapper_t *newGeneMapper = gene_mapper_init();
+    void *transcriptHash = khash_str2int_init(); // index of the gene of each transcript, the keys are the names of the genes
+    kstring_t line = {0, 0, NULL};
+    int64_t lineNumber = 0;
+    int64_t unreadLineCount = 0;
+
+    while (hts_getline(fp, '\n', &line) >= 0) {
+        lineNumber++;
+        if (line.l == 0 || line.s[0] == '#') {
+            continue;
+        }
+
+        // seqname, source, feature, start, end, score, strand, frame, attributes
+        char *fields[GTF_FIELD_COUNT];
+        int fieldCount = 0;
+        char *field = line.s;
+        while (field && fieldCount < GTF_FIELD_COUNT) {
+            fields[fieldCount] = field;
+            fieldCount++;
+            field = strchr(field, '\t');
+            if (field) {
+                *field = 0;
+                field++;
+            }
+        }
+        if (fieldCount < GTF_FIELD_COUNT) {
+            unreadLineCount++;
+            continue;
+        }
+        if (strcmp(fields[2], "exon") != 0) {
+            continue;
+        }
+
+        char *startEnd;
+        char *endEnd;
+        long start = strtol(fields[3], &startEnd, 10);
+        long end = strtol(fields[4], &endEnd, 10);
+        char *transcriptId = gtf_attribute_value(fields[8], "transcript_id");
+        if (transcriptId == NULL) {
+            transcriptId = gtf_attribute_value(fields[8], "Parent");
+            if (transcriptId && strncmp(transcriptId, "transcript:", 11) == 0) {
+                transcriptId += 11;
+            }
+        }
+        if (*startEnd != 0 || *endEnd != 0 || start < 1 || end < start || end > INT32_MAX || transcriptId == NULL) {
+            if (unreadLineCount == 0) {
+                fprintf(stderr, "***WARNING*** Unable to read the exon on line %lld of '%s'.\n", (long long)lineNumber, filename);
+            }
+            unreadLineCount++;
+            continue;
+        }
+
+        // the strand is kept with the transcript, the exons of a single nucleotide don't tell it
+        strand_t strand = fields[6][0] == '-' ? minusstrand : plusstrand;
+        int geneIndex;
+        if (khash_str2int_get(transcriptHash, transcriptId, &geneIndex) != 0) {
+            gene_t *newGene = gene_mapper_add_gene(newGeneMapper, transcriptId, fields[0]);
+            newGene->strand = strand;
+            geneIndex = newGeneMapper->geneCount - 1;
+            khash_str2int_set(transcriptHash, newGene->name, geneIndex);
+        } else if (strcmp(newGeneMapper->genes[geneIndex]->contig, fields[0]) != 0) {
+            fprintf(stderr, "***WARNING*** The exon on line %lld of '%s' is not on the contig of the other exons of %s.\n",
+                    (long long)lineNumber, filename, transcriptId);
+            unreadLineCount++;
+            continue;
+        } else if (gene_strand(newGeneMapper->genes[geneIndex]) != strand) {
+            fprintf(stderr, "***WARNING*** The exon on line %lld of '%s' is not on the strand of the other exons of %s.\n",
+                    (long long)lineNumber, filename, transcriptId);
+            unreadLineCount++;
+            continue;
+        }
+
+        // GTF positions are 1-indexed, and the exons of (-)strand genes go from the largest to the smallest position
+        if (strand == minusstrand) {
+            gene_mapper_add_gene_exon(newGeneMapper, geneIndex, exon_range((int32_t)end - 1, (int32_t)start - 1));
+        } else {
+            gene_mapper_add_gene_exon(newGeneMapper, geneIndex, exon_range((int32_t)start - 1, (int32_t)end - 1));
+        }
+    }
+
+    if (unreadLineCount) {
+        fprintf(stderr, "***WARNING*** Unable to read %lld lines of '%s'.\n", (long long)unreadLineCount, filename);
+    }
+
+    khash_str2int_destroy(transcriptHash);
+    free(line.s);
+    hts_close(fp);
+
+    gene_mapper_sort_exons(newGeneMapper);
+    int32_t i;
+    for (i = 0; i < newGeneMapper->geneCount; i++) {
+        gene_t *gene = newGeneMapper->genes[i];
+        gene->referenceGenome = (char *)malloc(1);
+        gene->referenceGenome[0] = 0;
+    }
+    gene_mapper_build_index(newGeneMapper);
+
+    return newGeneMapper;
+}
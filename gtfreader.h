@@ -0,0 +1,19 @@
+//
+//  gtfreader.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_gtfreader_h
+#define bcfgenemapper_gtfreader_h
+
+#include "genemapper.h"
+
+/* Reads the exons of a GTF or GFF3 annotation file (optionally bgzipped or gzipped) in a single pass and adds a gene
+   for every transcript, named by its transcript_id (GTF) or Parent (GFF3) attribute. The exons of a transcript don't
+   need to be next to each other or in order. Positions are converted from the 1-indexed GTF positions, and the exons of
+   (-)strand transcripts have a start larger than their end. Returns NULL if the file can't be opened. */
+gene_mapper_t *gene_mapper_gtf_init(const char *filename);
+
+#endif
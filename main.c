@@ -9,18 +9,37 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <htslib/vcf.h>
+#include <htslib/thread_pool.h>
 #include <getopt.h>
+#include <htslib/khash_str2int.h>
 
 #include "csvformatter.h"
+#include "genotypematrix.h"
 #include "genemapper.h"
+#include "genemodel.h"
+#include "gtfreader.h"
+#include "recordreader.h"
+#include "mergereader.h"
+#include "resultcache.h"
+#include "pipeline.h"
+#include "shardrunner.h"
+#include "stats.h"
 #include "version.h"
 #include "main.h"
 
 static int verbose_flag;
 static int strip_flag;
+static int sorted_flag;
 
 static const char* program_name;
 
+#define STATS_OPTION 256 // long options without a short option
+#define GTF_OPTION 257
+#define SAMPLES_OPTION 258
+#define SAMPLES_FILE_OPTION 259
+#define INPUT_LIST_OPTION 260
+#define CACHE_OPTION 261
+
 char validate_output_type(const char *type)
 {
     if (strcmp(type, "b") == 0) {
@@ -37,7 +56,7 @@ char validate_output_type(const char *type)
 }
 
 // returns 0 on success
-int bcf_update_genemapper_info(const bcf_hdr_t *hdr, bcf1_t *line, int32_t index, strand_t strand)
+int bcf_update_genemapper_info(const bcf_hdr_t *hdr, bcf1_t *line, int32_t index, strand_t strand, const char *geneName)
 {
     int oneBasedIndex = index+1; // we use 1 base indexing, but vcf uses 0 base indexing
     int error = 0;
@@ -51,7 +70,7 @@ int bcf_update_genemapper_info(const bcf_hdr_t *hdr, bcf1_t *line, int32_t index
     if (error) {
         return error;
     }
-    error = bcf_update_info_string(hdr, line, GENEMAP_NAME, "reference");
+    error = bcf_update_info_string(hdr, line, GENEMAP_NAME, geneName);
     if (error) {
         return error;
     }
@@ -78,32 +97,452 @@ int bcf_remove_genemapper_info(const bcf_hdr_t *hdr, bcf1_t *line)
 }
 
 
+#define RECORD_NOT_ANNOTATED 0
+#define RECORD_ANNOTATED 1
+
+typedef struct { // records of a shard, waiting to be written in order
+    bcf1_t **records;
+    int32_t recordCount;
+    int32_t recordsAllocated;
+} shard_records_t;
+
+typedef struct {
+    const char *inputFilename;
+    const char *samples; // samples to read, NULL to read all of them
+    int samplesIsFile; // set if samples is the name of a file listing the samples
+    bcf_hdr_t *header;
+    bcf_hdr_t *outputHeader;
+    record_reader_t *recordReader;
+    merge_reader_t *mergeReader; // set instead of recordReader when several inputs are merged
+    gene_mapper_t *geneMapper;
+    htsFile *vcfOutFile;
+    csv_formatter_t *csvFormatter;
+    shard_records_t *shardRecords; // set when processing a shard, the records are written when the shard is merged
+    stats_t *stats; // NULL if the stats are not collected
+    int genemapInfoIds[3]; // header ids of GENEMAP, GENEMAP_STRAND and GENEMAP_NAME in the output header
+    char inputHasGenemapInfo; // if not set, the records of the input can't have gene mapper info to remove
+    
+    int32_t *batchPositions; // positions of the records of the batch being annotated, with their gene positions and mappings
+    int32_t *batchGenePositions;
+    gene_mapping_t *batchMappings;
+    int32_t batchAllocated;
+    int32_t lastRid; // rid and position of the last annotated record, to check the order of sorted input
+    int32_t lastPosition;
+    
+    int32_t keptRecords;
+    int32_t updatedRecords; // only changed by the annotator
+    int32_t removedRecords;
+} annotation_context_t;
+
+static int read_record(void *contextPtr, bcf1_t *record)
+{
+    annotation_context_t *context = (annotation_context_t *)contextPtr;
+    int64_t startTime = stats_start(context->stats);
+    int result = context->mergeReader ? merge_reader_next(context->mergeReader, record) : record_reader_next(context->recordReader, record);
+    if (result == 0) {
+        stats_stop(context->stats, statsstageread, startTime);
+    } else if (result < -1 && context->mergeReader) {
+        exit(1); // the merge reader printed why, the output would look complete without the rest of the inputs
+    }
+    return result;
+}
+
+// restricts the input header to the samples, so that the FORMAT fields of the other samples are not decoded
+static void set_header_samples(bcf_hdr_t *header, const char *samples, int samplesIsFile, int warn)
+{
+    int result = bcf_hdr_set_samples(header, samples, samplesIsFile);
+    if (result < 0) {
+        fprintf(stderr, "Unable to read the samples%s '%s'.\n", samplesIsFile ? " file" : "", samples);
+        exit(1);
+    } else if (result > 0 && warn) {
+        fprintf(stderr, "***WARNING*** Some of the requested samples are not in the input file and are ignored.\n");
+    }
+}
+
+static int header_has_info(const bcf_hdr_t *header, const char *tag)
+{
+    int id = bcf_hdr_id2int(header, BCF_DT_ID, tag);
+    return bcf_hdr_idinfo_exists(header, BCF_HL_INFO, id);
+}
+
+// returns 1 if the record has a gene mapper info, or only GENEMAP if genemapOnly is set
+static int record_has_genemapper_info(annotation_context_t *context, bcf1_t *record, int genemapOnly)
+{
+    bcf_unpack(record, BCF_UN_INFO);
+    int i;
+    for (i = 0; i < (genemapOnly ? 1 : 3); i++) {
+        if (context->genemapInfoIds[i] < 0) {
+            continue;
+        }
+        bcf_info_t *info = bcf_get_info_id(record, context->genemapInfoIds[i]);
+        if (info && info->vptr && info->len > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int annotate_mapped_record(annotation_context_t *context, bcf1_t *record, int32_t geneLocation, gene_mapping_t *mapping)
+{
+    // the mapping decides if the record is annotated, without reading the info back
+    int recordState = RECORD_NOT_ANNOTATED;
+    int error;
+    int64_t startTime = stats_start(context->stats);
+    if (geneLocation >= 0) {
+        error = bcf_update_genemapper_info(context->outputHeader, record, geneLocation, gene_strand(mapping->gene), mapping->gene->name);
+        if (error < 0) {
+            fprintf(stderr, "***WARNING*** Error updating Gene Mapper info.\n");
+        } else {
+            recordState = RECORD_ANNOTATED;
+        }
+        context->updatedRecords++;
+    } else if (context->inputHasGenemapInfo && record_has_genemapper_info(context, record, 0)) {
+        // records that are left as they were are not unpacked, and are written from their raw data
+        error = bcf_remove_genemapper_info(context->outputHeader, record);
+        if (error < 0) {
+            fprintf(stderr, "***WARNING*** Error removing Gene Mapper info.\n");
+        }
+    }
+    stats_stop(context->stats, statsstageannotate, startTime);
+    return recordState;
+}
+
+// maps the positions of a batch of records, the consecutive records on the same contig are mapped together
+static void map_records(annotation_context_t *context, bcf1_t **records, int32_t recordCount)
+{
+    if (recordCount > context->batchAllocated) {
+        context->batchAllocated = recordCount;
+        context->batchPositions = (int32_t *)realloc(context->batchPositions, sizeof(int32_t) * context->batchAllocated);
+        context->batchGenePositions = (int32_t *)realloc(context->batchGenePositions, sizeof(int32_t) * context->batchAllocated);
+        context->batchMappings = (gene_mapping_t *)realloc(context->batchMappings, sizeof(gene_mapping_t) * context->batchAllocated);
+    }
+    
+    int32_t i;
+    for (i = 0; i < recordCount; i++) {
+        context->batchPositions[i] = records[i]->pos;
+    }
+    int32_t runStart = 0;
+    for (i = 1; i <= recordCount; i++) {
+        if (i == recordCount || records[i]->rid != records[runStart]->rid) {
+            gene_mapper_map_positions(context->geneMapper, records[runStart]->rid, context->batchPositions + runStart, i - runStart,
+                                      context->batchGenePositions + runStart, context->batchMappings + runStart);
+            runStart = i;
+        }
+    }
+}
+
+static int32_t annotate_records(void *contextPtr, bcf1_t **records, int *recordStates, int32_t recordCount)
+{
+    annotation_context_t *context = (annotation_context_t *)contextPtr;
+    int32_t i;
+    
+    if (context->geneMapper == NULL) {
+        for (i = 0; i < recordCount; i++) {
+            recordStates[i] = record_has_genemapper_info(context, records[i], 1) ? RECORD_ANNOTATED : RECORD_NOT_ANNOTATED;
+        }
+        return recordCount;
+    }
+    
+    int64_t startTime = stats_start(context->stats);
+    map_records(context, records, recordCount);
+    stats_stop_count(context->stats, statsstagemap, startTime, recordCount);
+    
+    for (i = 0; i < recordCount; i++) {
+        bcf1_t *record = records[i];
+        if (sorted_flag) {
+            if (context->lastRid >= 0 && (record->rid < context->lastRid || (record->rid == context->lastRid && record->pos < context->lastPosition))) {
+                fprintf(stderr, "The input file '%s' is not sorted, %s:%d is out of order.\n", context->inputFilename, bcf_seqname(context->header, record), (int)record->pos+1);
+                exit(1);
+            }
+            context->lastRid = record->rid;
+            context->lastPosition = record->pos;
+            if ((strip_flag || context->vcfOutFile == NULL) && gene_mapper_position_finished(context->geneMapper, record->rid, record->pos)) {
+                if (verbose_flag) {
+                    printf("Past the last exon at %s:%d, done reading.\n", bcf_seqname(context->header, record), (int)record->pos+1);
+                }
+                return i;
+            }
+        }
+        recordStates[i] = annotate_mapped_record(context, record, context->batchGenePositions[i], context->batchMappings + i);
+    }
+    
+    return recordCount;
+}
+
+static void annotation_context_free_batch(annotation_context_t *context)
+{
+    free(context->batchPositions);
+    free(context->batchGenePositions);
+    free(context->batchMappings);
+    context->batchPositions = NULL;
+    context->batchGenePositions = NULL;
+    context->batchMappings = NULL;
+    context->batchAllocated = 0;
+}
+
+static void output_record(annotation_context_t *context, bcf1_t *record)
+{
+    if (context->shardRecords) {
+        shard_records_t *shardRecords = context->shardRecords;
+        if (shardRecords->recordCount == shardRecords->recordsAllocated) {
+            shardRecords->recordsAllocated = shardRecords->recordsAllocated ? shardRecords->recordsAllocated * 2 : 16;
+            shardRecords->records = (bcf1_t **)realloc(shardRecords->records, sizeof(bcf1_t *) * shardRecords->recordsAllocated);
+        }
+        shardRecords->records[shardRecords->recordCount] = bcf_dup(record);
+        shardRecords->recordCount++;
+    } else {
+        int64_t startTime = stats_start(context->stats);
+        bcf_write(context->vcfOutFile, context->outputHeader, record);
+        stats_stop(context->stats, statsstagewrite, startTime);
+    }
+    context->keptRecords++;
+}
+
+static void write_record(void *contextPtr, bcf1_t *record, int recordState)
+{
+    annotation_context_t *context = (annotation_context_t *)contextPtr;
+    
+    if (recordState == RECORD_ANNOTATED) {
+        if (context->csvFormatter) {
+            int64_t startTime = stats_start(context->stats);
+            csv_formatter_add_record(context->csvFormatter, context->outputHeader, record);
+            stats_stop(context->stats, statsstagecsvaddrecord, startTime);
+        }
+        if (context->vcfOutFile) {
+            output_record(context, record);
+        }
+    } else if (strip_flag == 0 && context->vcfOutFile) {
+        output_record(context, record);
+    } else {
+        context->removedRecords++;
+    }
+}
+
+/* When the input is indexed, every region is a shard that is read and annotated by a worker with its
+   own handle on the input. The records of the shards are then written in region order. */
+
+typedef struct {
+    annotation_context_t annotationContext;
+    htsFile *file;
+} shard_worker_state_t;
+
+static void *shard_worker_init(void *contextPtr)
+{
+    annotation_context_t *context = (annotation_context_t *)contextPtr;
+    shard_worker_state_t *workerState = (shard_worker_state_t *)malloc(sizeof(shard_worker_state_t));
+    memset(workerState, 0, sizeof(shard_worker_state_t));
+    
+    workerState->file = hts_open(context->inputFilename, "r");
+    if (workerState->file == NULL) {
+        fprintf(stderr, "Unable to open input file '%s'.\n", context->inputFilename);
+        exit(1);
+    }
+    bcf_hdr_t *header = bcf_hdr_read(workerState->file);
+    if (header == NULL) {
+        fprintf(stderr, "Unable to read the header from input file '%s'.\n", context->inputFilename);
+        exit(1);
+    }
+    if (context->samples) {
+        set_header_samples(header, context->samples, context->samplesIsFile, 0);
+    }
+    
+    annotation_context_t *workerContext = &workerState->annotationContext;
+    workerContext->inputFilename = context->inputFilename;
+    workerContext->samples = context->samples;
+    workerContext->samplesIsFile = context->samplesIsFile;
+    workerContext->header = header;
+    workerContext->outputHeader = context->outputHeader;
+    workerContext->recordReader = record_reader_init_sharing_index(workerState->file, header, context->recordReader);
+    workerContext->geneMapper = context->geneMapper;
+    workerContext->vcfOutFile = context->vcfOutFile;
+    memcpy(workerContext->genemapInfoIds, context->genemapInfoIds, sizeof(context->genemapInfoIds));
+    workerContext->inputHasGenemapInfo = context->inputHasGenemapInfo;
+    if (context->stats) {
+        workerContext->stats = stats_init();
+    }
+    if (context->csvFormatter) {
+        workerContext->csvFormatter = csv_formatter_init(context->outputHeader);
+        csv_formatter_set_memory_limit(workerContext->csvFormatter, context->csvFormatter->memoryLimit);
+    }
+    
+    return workerState;
+}
+
+static void *run_shard(void *contextPtr, void *workerStatePtr, int32_t shardIndex)
+{
+    annotation_context_t *context = (annotation_context_t *)contextPtr;
+    shard_worker_state_t *workerState = (shard_worker_state_t *)workerStatePtr;
+    annotation_context_t *workerContext = &workerState->annotationContext;
+    
+    shard_records_t *shardRecords = (shard_records_t *)malloc(sizeof(shard_records_t));
+    memset(shardRecords, 0, sizeof(shard_records_t));
+    workerContext->shardRecords = shardRecords;
+    
+    record_reader_set_region(workerContext->recordReader, context->recordReader->regions[shardIndex]);
+    workerContext->lastRid = -1; // the order is checked within each region, the regions are not in the order of the header
+    pipeline_t *pipeline = pipeline_init(workerContext, read_record, annotate_records, write_record);
+    pipeline_run(pipeline, 1);
+    pipeline_destroy(pipeline);
+    
+    workerContext->shardRecords = NULL;
+    return shardRecords;
+}
+
+static void merge_shard(void *contextPtr, int32_t shardIndex, void *shardRecordsPtr)
+{
+    annotation_context_t *context = (annotation_context_t *)contextPtr;
+    shard_records_t *shardRecords = (shard_records_t *)shardRecordsPtr;
+    
+    int32_t i;
+    for (i = 0; i < shardRecords->recordCount; i++) {
+        int64_t startTime = stats_start(context->stats);
+        bcf_write(context->vcfOutFile, context->outputHeader, shardRecords->records[i]);
+        stats_stop(context->stats, statsstagewrite, startTime);
+        bcf_destroy(shardRecords->records[i]);
+    }
+    free(shardRecords->records);
+    free(shardRecords);
+}
+
+static void shard_worker_destroy(void *contextPtr, void *workerStatePtr)
+{
+    annotation_context_t *context = (annotation_context_t *)contextPtr;
+    shard_worker_state_t *workerState = (shard_worker_state_t *)workerStatePtr;
+    annotation_context_t *workerContext = &workerState->annotationContext;
+    
+    context->keptRecords += workerContext->keptRecords;
+    context->updatedRecords += workerContext->updatedRecords;
+    context->removedRecords += workerContext->removedRecords;
+    if (workerContext->stats) {
+        stats_add(context->stats, workerContext->stats);
+        stats_destroy(workerContext->stats);
+    }
+    
+    if (workerContext->csvFormatter) { // the formatter sorts the positions, so the order of the merges doesn't matter
+        csv_formatter_merge(context->csvFormatter, workerContext->csvFormatter);
+        csv_formatter_destroy(workerContext->csvFormatter);
+    }
+    annotation_context_free_batch(workerContext);
+    record_reader_destroy(workerContext->recordReader);
+    bcf_hdr_destroy(workerContext->header);
+    hts_close(workerState->file);
+    free(workerState);
+}
+
+
+// the streamed csv formats remember if a variant was written at the essential positions
+static void register_essential_positions(csv_formatter_t *csvFormatter, gene_mapper_t *geneMapper)
+{
+    int i;
+    int j;
+    for (j = 0; j < gene_mapper_gene_count(geneMapper); j++) {
+        gene_t *gene = geneMapper->genes[j];
+        for (i = 0; i < gene->essentialPositionCount; i++) {
+            csv_formatter_add_essential_position(csvFormatter, gene->name, gene->essentialPositions[i]);
+        }
+    }
+}
+
+
 void print_usage(FILE* stream, int exit_code)
 {
     fprintf(stream, "Gene Mapper (%s, htslib version:%s)\n", BCFGENEMAPPER_VERSION, hts_version());
     fprintf(stream, "Copyright (c) 2014, Spaltenstein Natural Image\n");
-    fprintf(stream, "Usage:  %s [options] [input_filename]\n", program_name);
+    fprintf(stream, "Usage:  %s [options] [input_filename ...]\n", program_name);
+    fprintf(stream, "        %s compile-model [--gtf] exon_filename model_filename\n", program_name);
+    fprintf(stream, "        %s reverse-map (-e exon_filename | --gtf filename) [positions_filename]\n", program_name);
     fprintf(stream,
             "  -h  --help                 Display this usage information.\n"
             "  -o  --output filename      Write output with Gene Mapper info to filename.\n"
             "  -O  --output-type b|u|z|v  Compressed BCF (b), Uncompressed BCF (u),\n"
             "                             Compressed VCF (z), Uncompressed VCF (v).\n"
             "  -e  --exons filename       Read exon ranges from this file.\n"
+            "      --gtf filename         Read the exons of every transcript of this GTF or\n"
+            "                             GFF3 file (can be gzipped), instead of --exons.\n"
             "  -c  --csv filename         Write variants to a csv file.\n"
             "                             Positions in the csv file are 1-indexed.\n"
+            "                             The file is bgzip compressed (readable by gzip)\n"
+            "                             if its name ends in .gz or .bgz.\n"
+            "  -f  --csv-format wide|long|ndjson|matrix\n"
+            "                             A column per position (wide, default), or a row\n"
+            "                             per position, sample and haplotype written as\n"
+            "                             the variants are read (long), or the same as\n"
+            "                             JSON objects, one per line (ndjson), or the\n"
+            "                             genotypes of the wide format in a binary file\n"
+            "                             that can be memory mapped (matrix, see\n"
+            "                             genotypematrix.h), which is never compressed.\n"
+            "  -m  --csv-memory megabytes Memory used for the genotypes of the wide csv\n"
+            "                             format (per thread) before they are written to\n"
+            "                             temporary files, default no limit.\n"
+            "  -t  --threads number       Number of threads used to read, annotate and\n"
+            "                             write the variants, default 1. If only the exon\n"
+            "                             regions of an indexed input are read, each\n"
+            "                             region is processed on its own thread.\n"
+            "      --samples list         Only read these samples (comma separated), or all\n"
+            "                             but these if the list starts with '^'. The\n"
+            "                             genotypes of the other samples are not decoded,\n"
+            "                             and they are not written to the outputs.\n"
+            "      --samples-file filename\n"
+            "                             Same as --samples with a sample per line.\n"
+            "      --input-list filename  Also read the input files listed in this file,\n"
+            "                             one per line.\n"
             "  -s  --strip                Don't output variants that are not in exons.\n"
-            "  -v  --verbose              Print verbose messages.\n\n"
+            "  -S  --sorted               The input file is sorted by contig (in header\n"
+            "                             order) and position. Stop reading once past the\n"
+            "                             last exon if the remaining variants are not\n"
+            "                             written, and fail on unsorted variants.\n"
+            "  -v  --verbose              Print verbose messages.\n"
+            "      --stats filename       Write the counts and times of the processing\n"
+            "                             stages to this file as JSON.\n"
+            "      --cache directory      Keep the outputs in this directory, and copy them\n"
+            "                             from it when the inputs, the exons and the\n"
+            "                             options are the same as a previous run.\n\n"
             
+            "If the input file is indexed (.csi or .tbi) and variants that are not in\n"
+            "exons are not written (--strip, or no output file), only the exon regions\n"
+            "are read from the input file.\n\n"
+            
+            "Several input files are read and annotated at the same time, a file per\n"
+            "thread, and are written to a single wide csv file with the samples of all\n"
+            "the files. The variants of the files at the same gene position are in the\n"
+            "same column.\n\n"
+
+            "With an output file, several input files sorted by contig and position are\n"
+            "merged in a single stream of variants with the samples of all the files,\n"
+            "which is annotated and written to the output file and the csv file. The\n"
+            "variants of the files at the same position with the same reference allele\n"
+            "are merged in a variant with only the genotypes, the samples of the files\n"
+            "without that variant are missing. An exon file or a GTF file is needed.\n\n"
+
             "If the input file does not have Gene Mapper information, an exon range file\n"
             "must be provided.\n\n"
             
+            "compile-model writes the genes of an exon range file (or of a GTF or GFF3\n"
+            "file with --gtf) to a binary gene model that can be given to --exons\n"
+            "instead of the exon range file, and is read without being parsed. Use '-'\n"
+            "as the exon range file to read stdin, and as the model file to write to\n"
+            "stdout. A model must be compiled again after an update that changes the\n"
+            "model version.\n\n"
+
+            "With --gtf, every transcript is a gene named by its transcript_id (GTF) or\n"
+            "Parent (GFF3) attribute, and made of its \"exon\" features.\n\n"
+            "reverse-map reads lines of \"(gene name) (position in the gene)\" and writes\n"
+            "the gene, the position, the contig, the genome position and the strand,\n"
+            "separated by tabs, to stdout. The positions in the gene are 1-indexed like\n"
+            "in the csv file, and the genome positions are 1-indexed like in VCF files.\n"
+            "The contig, genome position and strand are '.' if the position is not in\n"
+            "the gene.\n\n"
+
             "If the input file is not specified, stdin will be used.\n"
             "Use '-' as the output file to specify stdout.\n\n"
 
             "The format of the exon range file is: \"(start_position) (end_position)newLine\"\n"
             "Both start and end are inclusive and 0-indexed (like in NCBI XML files).\n"
             "If the exon is on the (-)strand, the start should be a larger index than\n"
-            "the end index.\n\n"
+            "the end index.\n"
+            "Several genes can be described in the same file by starting each one with\n"
+            "a \"Gene: (name) (contig)newLine\" line. Genes without a contig map on any\n"
+            "contig.\n\n"
             "Example for the RHCE reference peptide (NP_065231.3) onto GRCh38 Chr1\n"
             "(which happens to be on the (-)strand):\n"
             "25420785 25420638\n"
@@ -120,32 +559,647 @@ void print_usage(FILE* stream, int exit_code)
     exit(exit_code);
 }
 
+// exits if the header does not have Gene Mapper information of the version this Gene Mapper can read
+static void check_genemapper_header(bcf_hdr_t *header, const char *filename)
+{
+    char *hdrVersionString = NULL;
+    int headerTextLength;
+    char *headerText = bcf_hdr_fmt_text(header, 0, &headerTextLength);
+    if (strstr(headerText, GENEMAP_INFO_HEADER) == NULL ||
+        strstr(headerText, GENEMAP_NAME_INFO_HEADER) == NULL ||
+        strstr(headerText, GENEMAP_STRAND_INFO_HEADER) == NULL ||
+        (hdrVersionString = strstr(headerText, GENEMAP_VERSION_STRING)) == NULL) {
+        fprintf(stderr, "The input file '%s' does not have Gene Mapper information. \nPlease provide an exon file with the -e option.\n", filename);
+        print_usage(stderr, 1);
+    }
+    float headerVersion = 0;
+    sscanf(hdrVersionString + strlen(GENEMAP_VERSION_STRING) + 1, "%f", &headerVersion);
+    if (headerVersion != GENEMAP_FILE_VERSION) {
+        fprintf(stderr, "This version of Gene Mapper only knows how to handle %2.1f Gene Mapper information.\nThe input file has Gene Mapper %2.1f information.\n", GENEMAP_FILE_VERSION, headerVersion);
+        print_usage(stderr, 1);
+    }
+    
+    free(headerText);
+}
+
+// returns a copy of the input header with the Gene Mapper info
+static bcf_hdr_t *genemapper_output_header(bcf_hdr_t *header)
+{
+    bcf_hdr_t *outputHeader = bcf_hdr_dup(header);
+    
+    int error = bcf_hdr_append(outputHeader, GENEMAP_VERSION_HEADER);
+    if (error) {
+        fprintf(stderr, "bcf_hdr_append error %d\n", error);
+        abort();
+    }
+    error = bcf_hdr_append(outputHeader, GENEMAP_INFO_HEADER);
+    if (error) {
+        fprintf(stderr, "bcf_hdr_append error %d\n", error);
+        abort();
+    }
+    error = bcf_hdr_append(outputHeader, GENEMAP_STRAND_INFO_HEADER);
+    if (error) {
+        fprintf(stderr, "bcf_hdr_append error %d\n", error);
+        abort();
+    }
+    error = bcf_hdr_append(outputHeader, GENEMAP_NAME_INFO_HEADER);
+    if (error) {
+        fprintf(stderr, "bcf_hdr_append error %d\n", error);
+        abort();
+    }
+    
+    return outputHeader;
+}
+
+// the essential positions of the genes are in the csv file even if no variant is there
+static void add_essential_positions(csv_formatter_t *csvFormatter, gene_mapper_t *geneMapper)
+{
+    int i;
+    int j;
+    for (j = 0; j < gene_mapper_gene_count(geneMapper); j++) {
+        gene_t *gene = geneMapper->genes[j];
+        size_t sequenceLength = strlen(gene->referenceGenome);
+        for (i = 0; i < gene->essentialPositionCount; i++) {
+            if (gene->essentialPositions[i] >= sequenceLength) {
+                fprintf(stderr, "[%s:%d %s] position %d out of bounds of the reference sequence of %s\n", __FILE__, __LINE__, __FUNCTION__, gene->essentialPositions[i], gene->name);
+                continue;
+            }
+            
+            char nt[] = {0, 0};
+            nt[0] = gene->referenceGenome[gene->essentialPositions[i]-1];
+            csv_formatter_add_postition(csvFormatter, gene->name, gene->essentialPositions[i], nt);
+        }
+    }
+}
+
+// reads the exon file, gene model or GTF file, returns NULL if there is neither an exon file nor a GTF file
+static gene_mapper_t *read_gene_mapper(const char *exons_filename, const char *gtf_filename)
+{
+    gene_mapper_t *geneMapper = NULL;
+    if (gtf_filename) {
+        geneMapper = gene_mapper_gtf_init(gtf_filename);
+        if (geneMapper == NULL || gene_mapper_exon_count(geneMapper) == 0) {
+            fprintf(stderr, "Unable to read exons from GTF file '%s'.\n", gtf_filename);
+            print_usage(stderr, 1);
+        }
+    } else if (exons_filename && gene_model_file_is_model(exons_filename)) {
+        geneMapper = gene_model_map_file(exons_filename);
+        if (geneMapper == NULL || gene_mapper_exon_count(geneMapper) == 0) {
+            fprintf(stderr, "Unable to read exons from gene model '%s'.\n", exons_filename);
+            print_usage(stderr, 1);
+        }
+    } else if (exons_filename) {
+        FILE *exonFp = fopen(exons_filename, "r");
+        if (exonFp == NULL) {
+            fprintf(stderr, "Unable to open exon file. '%s'.\n", exons_filename);
+            print_usage(stderr, 1);
+        }
+        geneMapper = gene_mapper_file_init(exonFp);
+        if (gene_mapper_exon_count(geneMapper) == 0) {
+            fprintf(stderr, "Unable to read exons from file '%s'.\n", exons_filename);
+            print_usage(stderr, 1);
+        }
+        fclose(exonFp);
+    }
+    return geneMapper;
+}
+
+// writes the stats and closes statsFp
+static void write_stats_file(stats_t *stats, FILE *statsFp, const char *statsFilename, int threadCount, int64_t runStartTime,
+                             int32_t keptRecords, int32_t updatedRecords, int32_t removedRecords)
+{
+    stats_summary_t statsSummary;
+    statsSummary.threadCount = threadCount;
+    statsSummary.wallSeconds = (double)(stats_now() - runStartTime) * 1e-9;
+    statsSummary.keptRecords = keptRecords;
+    statsSummary.updatedRecords = updatedRecords;
+    statsSummary.removedRecords = removedRecords;
+    if (stats_write_json(stats, &statsSummary, statsFp) != 0 || fclose(statsFp) != 0) {
+        fprintf(stderr, "Unable to write stats file. '%s'.\n", statsFilename);
+        exit(1);
+    }
+}
+
+/* With several input files, every file is a shard that is read and annotated by a worker with its own csv formatter.
+   The formatters are merged in file order into a formatter with the samples of all the files, with a row per position. */
+
+typedef struct {
+    const char **inputFilenames;
+    int32_t *sampleIndexes; // index of the first haplotype of each file in the merged csv formatter
+    const char *samples;
+    int samplesIsFile;
+    gene_mapper_t *geneMapper;
+    csv_formatter_t *csvFormatter;
+    size_t csvMemoryLimit;
+    stats_t *stats;
+    
+    int32_t keptRecords;
+    int32_t updatedRecords;
+    int32_t removedRecords;
+} file_shards_context_t;
+
+typedef struct {
+    stats_t *stats;
+    int32_t keptRecords;
+    int32_t updatedRecords;
+    int32_t removedRecords;
+} file_worker_state_t;
+
+static void *file_worker_init(void *contextPtr)
+{
+    file_shards_context_t *context = (file_shards_context_t *)contextPtr;
+    file_worker_state_t *workerState = (file_worker_state_t *)malloc(sizeof(file_worker_state_t));
+    memset(workerState, 0, sizeof(file_worker_state_t));
+    
+    if (context->stats) {
+        workerState->stats = stats_init();
+    }
+    
+    return workerState;
+}
+
+// returns the csv formatter of the file
+static void *run_file_shard(void *contextPtr, void *workerStatePtr, int32_t fileIndex)
+{
+    file_shards_context_t *context = (file_shards_context_t *)contextPtr;
+    file_worker_state_t *workerState = (file_worker_state_t *)workerStatePtr;
+    const char *inputFilename = context->inputFilenames[fileIndex];
+    
+    htsFile *file = hts_open(inputFilename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open input file '%s'.\n", inputFilename);
+        exit(1);
+    }
+    int64_t headerStartTime = stats_start(workerState->stats);
+    bcf_hdr_t *header = bcf_hdr_read(file);
+    if (header == NULL) {
+        fprintf(stderr, "Unable to read the header from input file '%s'.\n", inputFilename);
+        exit(1);
+    }
+    if (context->samples) {
+        set_header_samples(header, context->samples, context->samplesIsFile, 0);
+    }
+    bcf_hdr_t *outputHeader = genemapper_output_header(header);
+    stats_stop(workerState->stats, statsstageheader, headerStartTime);
+    
+    annotation_context_t annotationContext;
+    memset(&annotationContext, 0, sizeof(annotation_context_t));
+    annotationContext.inputFilename = inputFilename;
+    annotationContext.samples = context->samples;
+    annotationContext.samplesIsFile = context->samplesIsFile;
+    annotationContext.header = header;
+    annotationContext.outputHeader = outputHeader;
+    annotationContext.recordReader = record_reader_init(file, header, inputFilename);
+    annotationContext.lastRid = -1;
+    annotationContext.csvFormatter = csv_formatter_init(outputHeader);
+    csv_formatter_set_memory_limit(annotationContext.csvFormatter, context->csvMemoryLimit);
+    annotationContext.stats = workerState->stats;
+    annotationContext.genemapInfoIds[0] = bcf_hdr_id2int(outputHeader, BCF_DT_ID, GENEMAP);
+    annotationContext.genemapInfoIds[1] = bcf_hdr_id2int(outputHeader, BCF_DT_ID, GENEMAP_STRAND);
+    annotationContext.genemapInfoIds[2] = bcf_hdr_id2int(outputHeader, BCF_DT_ID, GENEMAP_NAME);
+    annotationContext.inputHasGenemapInfo = header_has_info(header, GENEMAP) || header_has_info(header, GENEMAP_STRAND) || header_has_info(header, GENEMAP_NAME);
+    
+    if (context->geneMapper) {
+        // the files can have different contigs, so each one gets its own view of the gene mapper
+        annotationContext.geneMapper = gene_mapper_header_view_init(context->geneMapper, header);
+        
+        // only the records in the exons can end up in the csv file
+        int32_t regionCount = 0;
+        genomic_region_t *regions = gene_mapper_genomic_regions(annotationContext.geneMapper, &regionCount);
+        record_reader_set_regions(annotationContext.recordReader, regions, regionCount);
+        free(regions);
+    }
+    
+    pipeline_t *pipeline = pipeline_init(&annotationContext, read_record, annotate_records, write_record);
+    pipeline_run(pipeline, 1);
+    pipeline_destroy(pipeline);
+    
+    workerState->keptRecords += annotationContext.keptRecords;
+    workerState->updatedRecords += annotationContext.updatedRecords;
+    workerState->removedRecords += annotationContext.removedRecords;
+    
+    annotation_context_free_batch(&annotationContext);
+    if (annotationContext.geneMapper) {
+        gene_mapper_header_view_destroy(annotationContext.geneMapper);
+    }
+    record_reader_destroy(annotationContext.recordReader);
+    bcf_hdr_destroy(outputHeader);
+    bcf_hdr_destroy(header);
+    hts_close(file);
+    
+    return annotationContext.csvFormatter;
+}
+
+static void merge_file_shard(void *contextPtr, int32_t fileIndex, void *csvFormatterPtr)
+{
+    file_shards_context_t *context = (file_shards_context_t *)contextPtr;
+    csv_formatter_t *csvFormatter = (csv_formatter_t *)csvFormatterPtr;
+    
+    int64_t startTime = stats_start(context->stats);
+    csv_formatter_merge_samples(context->csvFormatter, csvFormatter, context->sampleIndexes[fileIndex]);
+    stats_stop(context->stats, statsstagecsvmerge, startTime);
+    csv_formatter_destroy(csvFormatter);
+}
+
+static void file_worker_destroy(void *contextPtr, void *workerStatePtr)
+{
+    file_shards_context_t *context = (file_shards_context_t *)contextPtr;
+    file_worker_state_t *workerState = (file_worker_state_t *)workerStatePtr;
+    
+    context->keptRecords += workerState->keptRecords;
+    context->updatedRecords += workerState->updatedRecords;
+    context->removedRecords += workerState->removedRecords;
+    if (workerState->stats) {
+        stats_add(context->stats, workerState->stats);
+        stats_destroy(workerState->stats);
+    }
+    free(workerState);
+}
+
+// returns the lines of the file that are not empty, the list and its strings are freed by the caller
+static char **read_input_list(const char *filename, int32_t *filenameCountOut)
+{
+    htsFile *fp = hts_open(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open input list file '%s'.\n", filename);
+        print_usage(stderr, 1);
+    }
+    
+    char **filenames = NULL;
+    int32_t filenameCount = 0;
+    int32_t filenamesAllocated = 0;
+    kstring_t line = {0, 0, NULL};
+    while (hts_getline(fp, '\n', &line) >= 0) {
+        if (line.l && line.s[line.l - 1] == '\r') {
+            line.l--;
+            line.s[line.l] = 0;
+        }
+        if (line.l == 0) {
+            continue;
+        }
+        if (filenameCount == filenamesAllocated) {
+            filenamesAllocated = filenamesAllocated ? filenamesAllocated * 2 : 16;
+            filenames = (char **)realloc(filenames, sizeof(char *) * filenamesAllocated);
+        }
+        filenames[filenameCount] = (char *)malloc(line.l + 1);
+        strcpy(filenames[filenameCount], line.s);
+        filenameCount++;
+    }
+    free(line.s);
+    hts_close(fp);
+    
+    *filenameCountOut = filenameCount;
+    return filenames;
+}
+
+// writes the variations of a wide csv formatter as text, or as a genotype matrix
+static void print_csv_file(csv_formatter_t *csvFormatter, csv_writer_t *csvWriter, csv_format_t csvFormat)
+{
+    if (csvFormat == csvformatmatrix) {
+        genotype_matrix_write(csvFormatter, csvWriter);
+    } else {
+        csv_formatter_print(csvFormatter, csvWriter);
+    }
+}
+
+// annotates several input files on threadCount threads and writes a wide csv file with the samples of all the files
+static void annotate_files(const char **inputFilenames, int32_t inputCount, gene_mapper_t *geneMapper, const char *samples, int samplesIsFile,
+                           csv_writer_t *csvWriter, csv_format_t csvFormat, size_t csvMemoryLimit, int threadCount, stats_t *stats,
+                           int32_t *keptRecordsOut, int32_t *updatedRecordsOut, int32_t *removedRecordsOut)
+{
+    file_shards_context_t context;
+    memset(&context, 0, sizeof(file_shards_context_t));
+    context.inputFilenames = inputFilenames;
+    context.sampleIndexes = (int32_t *)malloc(sizeof(int32_t) * inputCount);
+    context.samples = samples;
+    context.samplesIsFile = samplesIsFile;
+    context.geneMapper = geneMapper;
+    context.csvMemoryLimit = csvMemoryLimit;
+    context.stats = stats;
+    
+    // the headers are read first, to know the columns of the samples of each file
+    int64_t headerStartTime = stats_start(stats);
+    int32_t i;
+    for (i = 0; i < inputCount; i++) {
+        htsFile *file = hts_open(inputFilenames[i], "r");
+        if (file == NULL) {
+            fprintf(stderr, "Unable to open input file '%s'.\n", inputFilenames[i]);
+            print_usage(stderr, 1);
+        }
+        bcf_hdr_t *header = bcf_hdr_read(file);
+        if (header == NULL) {
+            fprintf(stderr, "Unable to read the header from input file '%s'.\n", inputFilenames[i]);
+            print_usage(stderr, 1);
+        }
+        if (samples) {
+            set_header_samples(header, samples, samplesIsFile, 0);
+        }
+        if (geneMapper == NULL) {
+            check_genemapper_header(header, inputFilenames[i]);
+        }
+        
+        if (context.csvFormatter == NULL) {
+            context.csvFormatter = csv_formatter_init(header);
+            context.sampleIndexes[i] = 0;
+        } else {
+            context.sampleIndexes[i] = csv_formatter_add_samples(context.csvFormatter, header);
+        }
+        bcf_hdr_destroy(header);
+        hts_close(file);
+    }
+    csv_formatter_set_memory_limit(context.csvFormatter, csvMemoryLimit);
+    context.csvFormatter->stats = stats;
+    stats_stop(stats, statsstageheader, headerStartTime);
+    
+    if (verbose_flag) {
+        printf("Processing %d input files with %d sample%s on %d thread%s.\n", (int)inputCount, (int)context.csvFormatter->sampleCount / 2,
+               context.csvFormatter->sampleCount != 2?"s":"", threadCount, threadCount != 1?"s":"");
+    }
+    if (geneMapper) {
+        gene_mapper_build_index(geneMapper); // the workers share the index
+    }
+    shard_runner_t *shardRunner = shard_runner_init(&context, inputCount, file_worker_init, run_file_shard, merge_file_shard, file_worker_destroy);
+    shard_runner_run(shardRunner, threadCount);
+    shard_runner_destroy(shardRunner);
+    shardRunner = NULL;
+    
+    if (geneMapper) {
+        add_essential_positions(context.csvFormatter, geneMapper);
+    }
+    print_csv_file(context.csvFormatter, csvWriter, csvFormat);
+    
+    *keptRecordsOut = context.keptRecords;
+    *updatedRecordsOut = context.updatedRecords;
+    *removedRecordsOut = context.removedRecords;
+    
+    csv_formatter_destroy(context.csvFormatter);
+    free(context.sampleIndexes);
+}
+
+// returns the result cache with the key of the outputs of the run, or NULL if they can't be cached
+static result_cache_t *init_result_cache(const char *cacheDirectory, const char **inputFilenames, int32_t inputCount, gene_mapper_t *geneMapper,
+                                         const char *outputFilename, const char *outputType, const char *csvFilename, csv_format_t csvFormat,
+                                         const char *samples, int samplesIsFile)
+{
+    if (outputFilename && strcmp(outputFilename, "-") == 0) {
+        fprintf(stderr, "***WARNING*** The outputs can't be cached when they are written to stdout.\n");
+        return NULL;
+    }
+    result_cache_t *resultCache = result_cache_init(cacheDirectory);
+    if (resultCache == NULL) {
+        print_usage(stderr, 1);
+    }
+    
+    result_cache_add_string(resultCache, BCFGENEMAPPER_VERSION);
+    result_cache_add_int(resultCache, inputCount);
+    int32_t i;
+    for (i = 0; i < inputCount; i++) {
+        if (result_cache_add_input(resultCache, inputFilenames[i]) != 0) {
+            result_cache_destroy(resultCache);
+            return NULL;
+        }
+    }
+    result_cache_add_gene_mapper(resultCache, geneMapper);
+    
+    // the options that change the outputs
+    result_cache_add_string(resultCache, samples);
+    if (samplesIsFile && result_cache_add_file(resultCache, samples) != 0) {
+        result_cache_add_int(resultCache, -1);
+    }
+    result_cache_add_int(resultCache, strip_flag);
+    result_cache_add_int(resultCache, sorted_flag);
+    result_cache_add_int(resultCache, outputFilename ? (outputType ? outputType[0] : 'v') : -1);
+    result_cache_add_int(resultCache, csvFilename ? csvFormat : -1);
+    result_cache_add_int(resultCache, csvFilename ? csv_writer_filename_is_compressed(csvFilename) : -1);
+    result_cache_finish_key(resultCache);
+    
+    return resultCache;
+}
+
+// bcfgenemapper compile-model [--gtf] exon_filename model_filename
+static int compile_model_main(int argc, char * const *argv)
+{
+    gene_mapper_t *geneMapper = NULL;
+
+    if (argc == 4 && strcmp(argv[1], "--gtf") == 0) {
+        argc--;
+        argv++;
+        geneMapper = gene_mapper_gtf_init(argv[1]);
+        if (geneMapper == NULL) {
+            fprintf(stderr, "Unable to open GTF file. '%s'.\n", argv[1]);
+            print_usage(stderr, 1);
+        }
+    } else if (argc == 3) {
+        FILE *exonFp = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+        if (exonFp == NULL) {
+            fprintf(stderr, "Unable to open exon file. '%s'.\n", argv[1]);
+            print_usage(stderr, 1);
+        }
+        geneMapper = gene_mapper_file_init(exonFp);
+        if (exonFp != stdin) {
+            fclose(exonFp);
+        }
+    } else {
+        print_usage(stderr, 1);
+    }
+    if (gene_mapper_exon_count(geneMapper) == 0) {
+        fprintf(stderr, "Unable to read exons from file '%s'.\n", argv[1]);
+        print_usage(stderr, 1);
+    }
+
+    FILE *modelFp = strcmp(argv[2], "-") == 0 ? stdout : fopen(argv[2], "wb");
+    if (modelFp == NULL) {
+        fprintf(stderr, "Unable to open model file. '%s'.\n", argv[2]);
+        print_usage(stderr, 1);
+    }
+    if (gene_model_write(geneMapper, modelFp) != 0 || (modelFp != stdout && fclose(modelFp) != 0) || (modelFp == stdout && fflush(stdout) != 0)) {
+        fprintf(stderr, "Unable to write model file '%s'.\n", argv[2]);
+        exit(1);
+    }
+
+    gene_mapper_destroy(geneMapper);
+
+    return 0;
+}
+
+#define REVERSE_MAP_BATCH_SIZE 4096
+
+// writes the genome positions of a batch of positions of the same gene, geneIndex is -1 if the gene is unknown
+static void reverse_map_write_batch(gene_mapper_t *geneMapper, int32_t geneIndex, const char *geneName, const int32_t *genePositions, int32_t *genomePositions, int32_t positionCount, FILE *fp)
+{
+    int32_t i;
+    if (geneIndex < 0) {
+        for (i = 0; i < positionCount; i++) {
+            fprintf(fp, "%s\t%d\t.\t.\t.\n", geneName, genePositions[i] + 1);
+        }
+        return;
+    }
+
+    gene_t *gene = geneMapper->genes[geneIndex];
+    gene_mapper_reversemap_positions(geneMapper, geneIndex, genePositions, genomePositions, positionCount);
+    for (i = 0; i < positionCount; i++) {
+        if (genomePositions[i] < 0) {
+            fprintf(fp, "%s\t%d\t.\t.\t.\n", geneName, genePositions[i] + 1);
+        } else {
+            fprintf(fp, "%s\t%d\t%s\t%d\t%c\n", geneName, genePositions[i] + 1, gene->contig ? gene->contig : ".", genomePositions[i] + 1, gene_strand(gene));
+        }
+    }
+}
+
+// bcfgenemapper reverse-map (-e exon_filename | --gtf gtf_filename) [positions_filename]
+static int reverse_map_main(int argc, char * const *argv)
+{
+    const char *exons_filename = NULL;
+    const char *gtf_filename = NULL;
+    const char *positions_filename = NULL;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--exons") == 0) && i + 1 < argc) {
+            exons_filename = argv[++i];
+        } else if (strcmp(argv[i], "--gtf") == 0 && i + 1 < argc) {
+            gtf_filename = argv[++i];
+        } else if (positions_filename == NULL) {
+            positions_filename = argv[i];
+        } else {
+            print_usage(stderr, 1);
+        }
+    }
+    if ((exons_filename == NULL) == (gtf_filename == NULL)) {
+        fprintf(stderr, "Specify either an exon file or a GTF file.\n");
+        print_usage(stderr, 1);
+    }
+
+    gene_mapper_t *geneMapper = read_gene_mapper(exons_filename, gtf_filename);
+    void *geneNameHash = khash_str2int_init(); // index of the genes by name, the first gene with a name is used
+    for (i = 0; i < geneMapper->geneCount; i++) {
+        if (khash_str2int_has_key(geneNameHash, geneMapper->genes[i]->name) == 0) {
+            khash_str2int_set(geneNameHash, geneMapper->genes[i]->name, i);
+        }
+    }
+
+    FILE *positionsFp = positions_filename == NULL || strcmp(positions_filename, "-") == 0 ? stdin : fopen(positions_filename, "r");
+    if (positionsFp == NULL) {
+        fprintf(stderr, "Unable to open positions file. '%s'.\n", positions_filename);
+        print_usage(stderr, 1);
+    }
+
+    // the consecutive positions of the same gene are mapped together
+    int32_t *genePositions = (int32_t *)malloc(sizeof(int32_t) * REVERSE_MAP_BATCH_SIZE);
+    int32_t *genomePositions = (int32_t *)malloc(sizeof(int32_t) * REVERSE_MAP_BATCH_SIZE);
+    int32_t positionCount = 0;
+    int geneIndex = -1;
+    char *geneName = NULL;
+    size_t geneNameAllocated = 0;
+
+    char *line = NULL;
+    size_t lineAllocated = 0;
+    int64_t lineNumber = 0;
+    while (getline(&line, &lineAllocated, positionsFp) >= 0) {
+        lineNumber++;
+        char *name = strtok(line, " \t\r\n");
+        if (name == NULL || name[0] == '#') {
+            continue;
+        }
+        char *positionString = strtok(NULL, " \t\r\n");
+        char *positionEnd = NULL;
+        long position = positionString ? strtol(positionString, &positionEnd, 10) : 0;
+        if (positionString == NULL || *positionEnd != 0 || position < 1 || position > INT32_MAX) {
+            fprintf(stderr, "***WARNING*** Unable to read line %lld of the positions file.\n", (long long)lineNumber);
+            continue;
+        }
+
+        if (geneName == NULL || strcmp(name, geneName) != 0 || positionCount == REVERSE_MAP_BATCH_SIZE) {
+            if (positionCount) {
+                reverse_map_write_batch(geneMapper, geneIndex, geneName, genePositions, genomePositions, positionCount, stdout);
+                positionCount = 0;
+            }
+            if (geneName == NULL || strcmp(name, geneName) != 0) {
+                if (strlen(name) + 1 > geneNameAllocated) {
+                    geneNameAllocated = strlen(name) + 1;
+                    geneName = (char *)realloc(geneName, geneNameAllocated);
+                }
+                strcpy(geneName, name);
+                if (khash_str2int_get(geneNameHash, geneName, &geneIndex) != 0) {
+                    fprintf(stderr, "***WARNING*** Unknown gene %s on line %lld of the positions file.\n", geneName, (long long)lineNumber);
+                    geneIndex = -1;
+                }
+            }
+        }
+        genePositions[positionCount] = (int32_t)position - 1; // positions are 1-indexed like in the csv file
+        positionCount++;
+    }
+    if (positionCount) {
+        reverse_map_write_batch(geneMapper, geneIndex, geneName, genePositions, genomePositions, positionCount, stdout);
+    }
+    fflush(stdout);
+
+    free(line);
+    free(geneName);
+    free(genePositions);
+    free(genomePositions);
+    if (positionsFp != stdin) {
+        fclose(positionsFp);
+    }
+    khash_str2int_destroy(geneNameHash);
+    gene_mapper_destroy(geneMapper);
+
+    return 0;
+}
+
 int main(int argc, char * const *argv)
 {
     int c;
     
     const char* input_filename = NULL;
+    const char *input_list_filename = NULL;
     const char* output_filename = NULL;
     const char *output_type = NULL;
     const char *exons_filename = NULL;
+    const char *gtf_filename = NULL;
+    const char *samples = NULL;
+    int samples_is_file = 0;
     const char *csv_filename = NULL;
+    const char *stats_filename = NULL;
+    const char *cache_directory = NULL;
+    csv_format_t csv_format = csvformatwide;
+    size_t csv_memory_limit = 0;
+    int thread_count = 1;
     
+    int64_t runStartTime = stats_now();
     program_name = argv[0];
     verbose_flag = 0;
     
+    if (argc > 1 && strcmp(argv[1], "compile-model") == 0) {
+        return compile_model_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "reverse-map") == 0) {
+        return reverse_map_main(argc - 1, argv + 1);
+    }
+
     while (1)
     {
-        static const char* const short_options = "vsho:O:e:c:";
+        static const char* const short_options = "vsSho:O:e:c:f:m:t:";
         static struct option long_options[] =
         {
             {"verbose",     no_argument,       NULL, 'v'},
             {"strip",       no_argument,       NULL, 's'},
+            {"sorted",      no_argument,       NULL, 'S'},
             {"help",        no_argument,       NULL, 'h'},
 
             {"output",      required_argument, NULL, 'o'},
             {"output-type", required_argument, NULL, 'O'},
             {"exons",       required_argument, NULL, 'e'},
             {"csv",         required_argument, NULL, 'c'},
+            {"csv-format",  required_argument, NULL, 'f'},
+            {"csv-memory",  required_argument, NULL, 'm'},
+            {"threads",     required_argument, NULL, 't'},
+            {"stats",       required_argument, NULL, STATS_OPTION},
+            {"gtf",         required_argument, NULL, GTF_OPTION},
+            {"samples",     required_argument, NULL, SAMPLES_OPTION},
+            {"samples-file", required_argument, NULL, SAMPLES_FILE_OPTION},
+            {"input-list",  required_argument, NULL, INPUT_LIST_OPTION},
+            {"cache",       required_argument, NULL, CACHE_OPTION},
             {0, 0, 0, 0}
         };
 
@@ -165,6 +1219,9 @@ int main(int argc, char * const *argv)
             case 's':
                 strip_flag = 1;
                 break;
+            case 'S':
+                sorted_flag = 1;
+                break;
             case 'o':
                 output_filename = optarg;
                 break;
@@ -181,6 +1238,47 @@ int main(int argc, char * const *argv)
             case 'c':
                 csv_filename = optarg;
                 break;
+            case 'f':
+                if (csv_format_parse(optarg, &csv_format) != 0) {
+                    fprintf(stderr, "Invalid csv format: '%s', legal values are wide|long|ndjson|matrix.\n", optarg);
+                    print_usage(stderr, 1);
+                }
+                break;
+            case 'm':
+                if (atoi(optarg) < 1) {
+                    fprintf(stderr, "Invalid csv memory: '%s'.\n", optarg);
+                    print_usage(stderr, 1);
+                }
+                csv_memory_limit = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                if (thread_count < 1) {
+                    fprintf(stderr, "Invalid number of threads: '%s'.\n", optarg);
+                    print_usage(stderr, 1);
+                }
+                break;
+            case GTF_OPTION:
+                gtf_filename = optarg;
+                break;
+            case SAMPLES_OPTION:
+            case SAMPLES_FILE_OPTION:
+                if (samples) {
+                    fprintf(stderr, "Specify either a list of samples or a samples file.\n");
+                    print_usage(stderr, 1);
+                }
+                samples = optarg;
+                samples_is_file = c == SAMPLES_FILE_OPTION;
+                break;
+            case STATS_OPTION:
+                stats_filename = optarg;
+                break;
+            case INPUT_LIST_OPTION:
+                input_list_filename = optarg;
+                break;
+            case CACHE_OPTION:
+                cache_directory = optarg;
+                break;
             case '?':
                 print_usage(stdout, 1);
                 break;
@@ -190,34 +1288,58 @@ int main(int argc, char * const *argv)
         }
     }
     
-    // read the input file if it is there
-    if (optind + 1 == argc) {
-        input_filename = argv[optind];
-    } else if (optind < argc) {
-        fprintf(stderr, "Specify only one input file.\n");
-        print_usage(stderr, 1);
+    // read the input files if they are there, the files of the input list come after the other input files
+    char **input_list = NULL;
+    int32_t input_list_count = 0;
+    if (input_list_filename) {
+        input_list = read_input_list(input_list_filename, &input_list_count);
+        if (input_list_count == 0) {
+            fprintf(stderr, "The input list file '%s' is empty.\n", input_list_filename);
+            print_usage(stderr, 1);
+        }
+    }
+    int32_t input_count = argc - optind + input_list_count;
+    const char **input_filenames = (const char **)malloc(sizeof(const char *) * (input_count + 1));
+    int i;
+    for (i = 0; i < argc - optind; i++) {
+        input_filenames[i] = argv[optind + i];
+    }
+    for (i = 0; i < input_list_count; i++) {
+        input_filenames[argc - optind + i] = input_list[i];
+    }
+    if (input_count == 1) {
+        input_filename = input_filenames[0];
     }
     
-    if (input_filename == NULL && output_filename == NULL && exons_filename == NULL) {
+    if (input_count == 0 && output_filename == NULL && exons_filename == NULL && gtf_filename == NULL) {
         print_usage(stdout, 1);
     }
-    
-    gene_mapper_t *geneMapper = NULL;
-    FILE *exonFp = NULL;
-    if (exons_filename) {
-        exonFp = fopen(exons_filename, "r");
-        if (exonFp == NULL) {
-            fprintf(stderr, "Unable to open exon file. '%s'.\n", exons_filename);
+    if (input_count > 1) {
+        if (output_filename == NULL && csv_format != csvformatwide && csv_format != csvformatmatrix) {
+            fprintf(stderr, "Several input files can only be written to the wide csv format or a matrix, unless they are merged in an output file.\n");
             print_usage(stderr, 1);
         }
-        geneMapper = gene_mapper_file_init(exonFp);
-        if (gene_mapper_exon_count(geneMapper) == 0) {
-            fprintf(stderr, "Unable to read exons from file '%s'.\n", exons_filename);
+        if (output_filename && exons_filename == NULL && gtf_filename == NULL) {
+            fprintf(stderr, "Several input files can only be merged in an output file with an exon file or a GTF file.\n");
             print_usage(stderr, 1);
         }
-        fclose(exonFp);
-        exonFp = NULL;
+        for (i = 0; i < input_count; i++) {
+            if (strcmp(input_filenames[i], "-") == 0) {
+                fprintf(stderr, "stdin can't be one of several input files.\n");
+                print_usage(stderr, 1);
+            }
+        }
+    }
+    if (exons_filename && gtf_filename) {
+        fprintf(stderr, "Specify either an exon file or a GTF file.\n");
+        print_usage(stderr, 1);
     }
+    if (csv_filename && csv_format == csvformatmatrix && csv_writer_filename_is_compressed(csv_filename)) {
+        fprintf(stderr, "The matrix is memory mapped, it can't be compressed, '%s' ends in .gz or .bgz.\n", csv_filename);
+        print_usage(stderr, 1);
+    }
+    
+    gene_mapper_t *geneMapper = read_gene_mapper(exons_filename, gtf_filename);
     
     if (input_filename == NULL) {
         input_filename = "-";
@@ -228,37 +1350,134 @@ int main(int argc, char * const *argv)
         print_usage(stderr, 1);
     }
     
-    htsFile *htsInFile = hts_open(input_filename, "r");
-    if (htsInFile == NULL) {
-        fprintf(stderr, "Unable to open input file '%s'.\n", input_filename);
-        print_usage(stderr, 1);
+    stats_t *stats = NULL;
+    FILE *statsFp = NULL;
+    if (stats_filename) {
+        statsFp = fopen(stats_filename, "w");
+        if (statsFp == NULL) {
+            fprintf(stderr, "Unable to create stats file. '%s'.\n", stats_filename);
+            print_usage(stderr, 1);
+        }
+        stats = stats_init();
     }
     
-    bcf_hdr_t *bcf_header = bcf_hdr_read(htsInFile);
-    if (bcf_header == NULL) {
-        fprintf(stderr, "Unable to read the header from input file '%s'.\n", input_filename);
-        print_usage(stderr, 1);
+    result_cache_t *resultCache = NULL;
+    if (cache_directory) {
+        resultCache = init_result_cache(cache_directory, input_filenames, input_count, geneMapper, output_filename, output_type,
+                                        csv_filename, csv_format, samples, samples_is_file);
+        int32_t cachedCounts[3];
+        if (resultCache && result_cache_fetch(resultCache, output_filename, csv_filename, cachedCounts) == 0) {
+            if (verbose_flag) {
+                printf("Copied the outputs from the cache entry %s.\n", resultCache->key);
+            }
+            if (stats) {
+                write_stats_file(stats, statsFp, stats_filename, thread_count, runStartTime, cachedCounts[0], cachedCounts[1], cachedCounts[2]);
+                stats_destroy(stats);
+                stats = NULL;
+            }
+            result_cache_destroy(resultCache);
+            resultCache = NULL;
+            if (geneMapper) {
+                gene_mapper_destroy(geneMapper);
+                geneMapper = NULL;
+            }
+            for (i = 0; i < input_list_count; i++) {
+                free(input_list[i]);
+            }
+            free(input_list);
+            free(input_filenames);
+            
+            exit(0);
+        }
     }
     
-    if (geneMapper == NULL) {
-        char *hdrVersionString = NULL;
-        int headerTextLength;
-        char *headerText = bcf_hdr_fmt_text(bcf_header, 0, &headerTextLength);
-        if (strstr(headerText, GENEMAP_INFO_HEADER) == NULL ||
-            strstr(headerText, GENEMAP_NAME_INFO_HEADER) == NULL ||
-            strstr(headerText, GENEMAP_STRAND_INFO_HEADER) == NULL ||
-            (hdrVersionString = strstr(headerText, GENEMAP_VERSION_STRING)) == NULL) {
-            fprintf(stderr, "The input file '%s' does not have Gene Mapper information. \nPlease provide an exon file with the -e option.\n", input_filename);
+    if (input_count > 1 && output_filename == NULL) {
+        csv_writer_t *csvWriter = csv_writer_open(csv_filename, thread_count);
+        if (csvWriter == NULL) {
+            fprintf(stderr, "Unable to create csv file. '%s'.\n", csv_filename);
+            print_usage(stderr, 1);
+        }
+        int32_t keptRecords = 0;
+        int32_t updatedRecords = 0;
+        int32_t removedRecords = 0;
+        annotate_files(input_filenames, input_count, geneMapper, samples, samples_is_file, csvWriter, csv_format, csv_memory_limit, thread_count, stats,
+                       &keptRecords, &updatedRecords, &removedRecords);
+        csv_writer_destroy(csvWriter);
+        csvWriter = NULL;
+        
+        if (resultCache) {
+            int32_t counts[3] = {keptRecords, updatedRecords, removedRecords};
+            result_cache_store(resultCache, NULL, csv_filename, counts);
+            result_cache_destroy(resultCache);
+            resultCache = NULL;
+        }
+        if (stats) {
+            write_stats_file(stats, statsFp, stats_filename, thread_count, runStartTime, keptRecords, updatedRecords, removedRecords);
+            stats_destroy(stats);
+            stats = NULL;
+        }
+        if (geneMapper) {
+            gene_mapper_destroy(geneMapper);
+            geneMapper = NULL;
+        }
+        for (i = 0; i < input_list_count; i++) {
+            free(input_list[i]);
+        }
+        free(input_list);
+        free(input_filenames);
+        
+        exit(0);
+    }
+    
+    // the hts thread pool (de)compresses the input and output, our own threads read, annotate and write the records
+    hts_tpool *threadPool = NULL;
+    htsThreadPool htsPool = {NULL, 0};
+    if (thread_count > 1) {
+        threadPool = hts_tpool_init(thread_count);
+        htsPool.pool = threadPool;
+    }
+    
+    // several inputs are merged by the merge reader, which owns their files and the merged header
+    htsFile *htsInFile = NULL;
+    merge_reader_t *mergeReader = NULL;
+    bcf_hdr_t *bcf_header = NULL;
+    int64_t headerStartTime = stats_start(stats);
+    if (input_count > 1) {
+        mergeReader = merge_reader_init(input_filenames, input_count, samples, samples_is_file);
+        if (mergeReader == NULL) {
             print_usage(stderr, 1);
         }
-        float headerVersion = 0;
-        sscanf(hdrVersionString + strlen(GENEMAP_VERSION_STRING) + 1, "%f", &headerVersion);
-        if (headerVersion != GENEMAP_FILE_VERSION) {
-            fprintf(stderr, "This version of Gene Mapper only knows how to handle %2.1f Gene Mapper information.\nThe input file has Gene Mapper %2.1f information.\n", GENEMAP_FILE_VERSION, headerVersion);
+        if (threadPool) {
+            for (i = 0; i < mergeReader->inputCount; i++) {
+                hts_set_thread_pool(mergeReader->inputs[i].file, &htsPool);
+            }
+        }
+        bcf_header = mergeReader->header;
+        if (verbose_flag) {
+            printf("Merging %d input files with %d sample%s.\n", (int)input_count, bcf_hdr_nsamples(bcf_header), bcf_hdr_nsamples(bcf_header) != 1?"s":"");
+        }
+    } else {
+        htsInFile = hts_open(input_filename, "r");
+        if (htsInFile == NULL) {
+            fprintf(stderr, "Unable to open input file '%s'.\n", input_filename);
             print_usage(stderr, 1);
         }
+        if (threadPool) {
+            hts_set_thread_pool(htsInFile, &htsPool);
+        }
         
-        free(headerText);
+        bcf_header = bcf_hdr_read(htsInFile);
+        if (bcf_header == NULL) {
+            fprintf(stderr, "Unable to read the header from input file '%s'.\n", input_filename);
+            print_usage(stderr, 1);
+        }
+        if (samples) {
+            set_header_samples(bcf_header, samples, samples_is_file, 1);
+        }
+    }
+    
+    if (geneMapper == NULL) {
+        check_genemapper_header(bcf_header, input_filename);
     }
     
     
@@ -269,16 +1488,19 @@ int main(int argc, char * const *argv)
     htsFile *vcfOutFile = NULL;
     if (output_filename) {
         vcfOutFile = hts_open(output_filename, outputFileMode);
-        if (htsInFile == NULL) {
+        if (vcfOutFile == NULL) {
             fprintf(stderr, "Unable to open output file '%s'.\n", output_filename);
             print_usage(stderr, 1);
         }
+        if (threadPool) {
+            hts_set_thread_pool(vcfOutFile, &htsPool);
+        }
     }
     
-    FILE *csvFp = NULL;
+    csv_writer_t *csvWriter = NULL;
     if (csv_filename) {
-        csvFp = fopen(csv_filename, "w");
-        if (csvFp == NULL) {
+        csvWriter = csv_writer_open(csv_filename, thread_count);
+        if (csvWriter == NULL) {
             fprintf(stderr, "Unable to create csv file. '%s'.\n", csv_filename);
             print_usage(stderr, 1);
         }
@@ -288,105 +1510,93 @@ int main(int argc, char * const *argv)
         gene_mapper_print_exons(geneMapper, stdout);
     }
 
-    bcf_hdr_t *hdr_out = bcf_hdr_dup(bcf_header);
-    
-    int error = bcf_hdr_append(hdr_out, GENEMAP_VERSION_HEADER);
-    if (error) {
-        fprintf(stderr, "bcf_hdr_append error %d\n", error);
-        abort();
-    }
-    error = bcf_hdr_append(hdr_out, GENEMAP_INFO_HEADER);
-    if (error) {
-        fprintf(stderr, "bcf_hdr_append error %d\n", error);
-        abort();
-    }
-    error = bcf_hdr_append(hdr_out, GENEMAP_STRAND_INFO_HEADER);
-    if (error) {
-        fprintf(stderr, "bcf_hdr_append error %d\n", error);
-        abort();
-    }
-    error = bcf_hdr_append(hdr_out, GENEMAP_NAME_INFO_HEADER);
-    if (error) {
-        fprintf(stderr, "bcf_hdr_append error %d\n", error);
-        abort();
+    if (geneMapper) {
+        gene_mapper_set_header(geneMapper, bcf_header);
     }
 
+    bcf_hdr_t *hdr_out = genemapper_output_header(bcf_header);
+
     if (vcfOutFile) {
         bcf_hdr_write(vcfOutFile, hdr_out);
     }
+    stats_stop(stats, statsstageheader, headerStartTime);
     
     csv_formatter_t *csvFormatter = NULL;
-    if (csvFp) {
-        csvFormatter = csv_formatter_init(hdr_out);
+    if (csvWriter) {
+        if (csv_format == csvformatwide || csv_format == csvformatmatrix) {
+            csvFormatter = csv_formatter_init(hdr_out);
+            csv_formatter_set_memory_limit(csvFormatter, csv_memory_limit);
+        } else {
+            csvFormatter = csv_formatter_stream_init(hdr_out, csv_format, csvWriter);
+            if (geneMapper) {
+                register_essential_positions(csvFormatter, geneMapper);
+            }
+        }
+        csvFormatter->stats = stats;
     }
     
-    int32_t keptRecords = 0;
-    int32_t updatedRecords = 0;
-    int32_t removedRecords = 0;
-    
-    bcf1_t *bcf_record = bcf_init();
-    while (bcf_read(htsInFile, bcf_header, bcf_record)>=0 )
-    {
-        exon_range_t exon;
-        if (geneMapper) {
-            int32_t geneLocation = gene_mapper_map_position(geneMapper, bcf_record->pos, &exon);
-        
-            int error;
-            if (geneLocation >= 0) {
-                error = bcf_update_genemapper_info(hdr_out, bcf_record, geneLocation, exon_range_strand(exon));
-                if (error < 0) {
-                    fprintf(stderr, "***WARNING*** Error updating Gene Mapper info.\n");
-                }
-                updatedRecords++;
-            } else {
-                error = bcf_remove_genemapper_info(hdr_out, bcf_record);
-                if (error < 0) {
-                    fprintf(stderr, "***WARNING*** Error removing Gene Mapper info.\n");
-                }
-            }
+    record_reader_t *recordReader = NULL;
+    if (htsInFile) {
+        recordReader = record_reader_init(htsInFile, bcf_header, input_filename);
+    }
+    if (recordReader && geneMapper && (strip_flag || vcfOutFile == NULL)) {
+        // only the records in the exons can end up in the outputs
+        int32_t regionCount = 0;
+        genomic_region_t *regions = gene_mapper_genomic_regions(geneMapper, &regionCount);
+        if (record_reader_set_regions(recordReader, regions, regionCount) == 0 && verbose_flag) {
+            printf("Using the index of '%s' to read %d exon region%s.\n", input_filename, (int)regionCount, regionCount != 1?"s":"");
         }
-        
-        int32_t *genemapPositionArray = NULL;
-        int genemapPositionArrayLength = 0;
-        int genemapPositionCount = 0;
-        genemapPositionCount = bcf_get_info_int32(hdr_out, bcf_record, GENEMAP, &genemapPositionArray, &genemapPositionArrayLength);
-        
-        if (genemapPositionCount > 0) {
-            if (csvFp) {
-                csv_formatter_add_record(csvFormatter, hdr_out, bcf_record);
-            }
-            if (vcfOutFile) {
-                bcf_write(vcfOutFile, hdr_out, bcf_record);
-                keptRecords++;
-            }
-        } else if (strip_flag == 0 && vcfOutFile) {
-            bcf_write(vcfOutFile, hdr_out, bcf_record);
-            keptRecords++;
-        } else {
-            removedRecords++;
+        free(regions);
+    }
+    
+    annotation_context_t annotationContext;
+    memset(&annotationContext, 0, sizeof(annotation_context_t));
+    annotationContext.inputFilename = input_filename;
+    annotationContext.samples = samples;
+    annotationContext.samplesIsFile = samples_is_file;
+    annotationContext.header = bcf_header;
+    annotationContext.outputHeader = hdr_out;
+    annotationContext.recordReader = recordReader;
+    annotationContext.mergeReader = mergeReader;
+    annotationContext.geneMapper = geneMapper;
+    annotationContext.lastRid = -1;
+    annotationContext.vcfOutFile = vcfOutFile;
+    annotationContext.csvFormatter = csvFormatter;
+    annotationContext.stats = stats;
+    annotationContext.genemapInfoIds[0] = bcf_hdr_id2int(hdr_out, BCF_DT_ID, GENEMAP);
+    annotationContext.genemapInfoIds[1] = bcf_hdr_id2int(hdr_out, BCF_DT_ID, GENEMAP_STRAND);
+    annotationContext.genemapInfoIds[2] = bcf_hdr_id2int(hdr_out, BCF_DT_ID, GENEMAP_NAME);
+    annotationContext.inputHasGenemapInfo = header_has_info(bcf_header, GENEMAP) || header_has_info(bcf_header, GENEMAP_STRAND) || header_has_info(bcf_header, GENEMAP_NAME);
+    
+    // the streamed csv formats are written by a single formatter in the order of the records
+    if (thread_count > 1 && recordReader && recordReader->regions && recordReader->regionCount > 1 && (csvFormatter == NULL || csv_formatter_is_streaming(csvFormatter) == 0)) {
+        if (verbose_flag) {
+            printf("Processing %d region%s on %d threads.\n", (int)recordReader->regionCount, recordReader->regionCount != 1?"s":"", thread_count);
         }
-        free(genemapPositionArray);
+        shard_runner_t *shardRunner = shard_runner_init(&annotationContext, recordReader->regionCount, shard_worker_init, run_shard, merge_shard, shard_worker_destroy);
+        shard_runner_run(shardRunner, thread_count);
+        shard_runner_destroy(shardRunner);
+        shardRunner = NULL;
+    } else {
+        pipeline_t *pipeline = pipeline_init(&annotationContext, read_record, annotate_records, write_record);
+        pipeline_run(pipeline, thread_count);
+        pipeline_destroy(pipeline);
+        pipeline = NULL;
     }
     
-    if (csvFp) {
+    int32_t keptRecords = annotationContext.keptRecords;
+    int32_t updatedRecords = annotationContext.updatedRecords;
+    int32_t removedRecords = annotationContext.removedRecords;
+    annotation_context_free_batch(&annotationContext);
+    
+    if (csvWriter) {
         if (geneMapper) {
-            int i;
-            size_t sequenceLength = strlen(geneMapper->referenceGenome);
-            for (i = 0; i < geneMapper->essentialPositionCount; i++) {
-                if (geneMapper->essentialPositions[i] >= sequenceLength) {
-                    fprintf(stderr, "[%s:%d %s] position %d out of bounds of the reference sequence\n", __FILE__, __LINE__, __FUNCTION__, geneMapper->essentialPositions[i]);
-                    continue;
-                }
-                
-                char nt[] = {0, 0};
-                nt[0] = geneMapper->referenceGenome[geneMapper->essentialPositions[i]-1];
-                csv_formatter_add_postition(csvFormatter, geneMapper->essentialPositions[i], nt);
-            }
+            add_essential_positions(csvFormatter, geneMapper);
         }
 
-        csv_formatter_print(csvFormatter, csvFp);
-        fclose(csvFp);
-        csvFp = NULL;
+        print_csv_file(csvFormatter, csvWriter, csv_format);
+        csv_writer_destroy(csvWriter);
+        csvWriter = NULL;
     }
     
     if (vcfOutFile && verbose_flag) {
@@ -395,12 +1605,39 @@ int main(int argc, char * const *argv)
         printf("%d record%s removed.\n", (int)removedRecords, removedRecords != 1?"s":"");
     }
     
-    hts_close(htsInFile);
-    htsInFile = NULL;
+    if (mergeReader) {
+        merge_reader_destroy(mergeReader);
+        mergeReader = NULL;
+    } else {
+        record_reader_destroy(recordReader);
+        recordReader = NULL;
+        hts_close(htsInFile);
+        htsInFile = NULL;
+        bcf_hdr_destroy(bcf_header);
+    }
+    bcf_header = NULL;
     if (vcfOutFile) {
         hts_close(vcfOutFile);
         vcfOutFile = NULL;
     }
+    if (threadPool) {
+        hts_tpool_destroy(threadPool);
+        threadPool = NULL;
+    }
+    
+    if (resultCache) {
+        int32_t counts[3] = {keptRecords, updatedRecords, removedRecords};
+        result_cache_store(resultCache, output_filename, csv_filename, counts);
+        result_cache_destroy(resultCache);
+        resultCache = NULL;
+    }
+    
+    if (stats) {
+        write_stats_file(stats, statsFp, stats_filename, thread_count, runStartTime, keptRecords, updatedRecords, removedRecords);
+        statsFp = NULL;
+        stats_destroy(stats);
+        stats = NULL;
+    }
 
     if (geneMapper) {
         gene_mapper_destroy(geneMapper);
@@ -412,113 +1649,13 @@ int main(int argc, char * const *argv)
         csvFormatter = NULL;
     }
     
-    bcf_hdr_destroy(bcf_header);
-    bcf_header = NULL;
     bcf_hdr_destroy(hdr_out);
     hdr_out = NULL;
-    bcf_destroy(bcf_record);
-    bcf_record = NULL;
+    for (i = 0; i < input_list_count; i++) {
+        free(input_list[i]);
+    }
+    free(input_list);
+    free(input_filenames);
 
     exit (0);
 }
-
-char complement_nucleotide(char n)
-{
-    switch(n){
-        case 'a':
-            return 't';
-        case 'A':
-            return 'T';
-        case 'c':
-            return 'g';
-        case 'C':
-            return 'G';
-        case 't':
-            return 'a';
-        case 'T':
-            return 'A';
-        case 'g':
-            return 'c';
-        case 'G':
-            return 'C';
-        case 'n':
-            return 'n';
-        case 'N':
-            return 'N';
-        case 'Y':
-            return 'R';
-        case 'y':
-            return 'r';
-        case 'R':
-            return 'Y';
-        case 'r':
-            return 'y';
-        case 'S':
-            return 'S';
-        case 's':
-            return 's';
-        case 'W':
-            return 'W';
-        case 'w':
-            return 'w';
-        case 'K':
-            return 'M';
-        case 'k':
-            return 'm';
-        case 'M':
-            return 'K';
-        case 'm':
-            return 'k';
-        case 'B':
-            return 'V';
-        case 'b':
-            return 'v';
-        case 'V':
-            return 'B';
-        case 'v':
-            return 'b';
-        case 'D':
-            return 'H';
-        case 'd':
-            return 'h';
-        case 'H':
-            return 'd';
-        case 'h':
-            return 'd';
-        case '-':
-            return '-';
-        default:
-            if (!isspace(n) && !ispunct(n)) {
-                if (isprint(n)) {
-                    fprintf(stderr, "***WARNING*** Trying to get the complement of unknown nucleotide '%c'.\n", n);
-                } else {
-                    fprintf(stderr, "***WARNING*** Trying to get the complement of unknown nucleotide ASCII value %d.\n", (int)n);
-                }
-            }
-            return n;
-        }
-}
-
-
-const char *complement_nucleotide_sequence(const char *sequence)
-{
-    static char *complementSequence = NULL;
-    int complementSequenceLength = 0;
-    
-    if (strlen(sequence) + 1 >= complementSequenceLength) {
-        complementSequence = (char *)realloc(complementSequence, strlen(sequence) + 1);
-    }
-    
-    int i;
-    for (i = 0; i < strlen(sequence); i++) {
-        complementSequence[i] = complement_nucleotide(sequence[i]);
-    }
-    complementSequence[i] = 0;
-    
-    return complementSequence;
-}
-
-
-
-
-
@@ -10,6 +10,7 @@
 #define bcfgenemapper_main_h
 
 #include <htslib/vcf.h>
+#include "nucleotide.h"
 
 #define GENEMAP "GENEMAP"
 #define GENEMAP_INFO_HEADER "##INFO=<ID=" GENEMAP ",Number=1,Type=Integer,Description=\"Mapped Gene Location\">"
@@ -25,9 +26,6 @@
 #define GENEMAP_VERSION_STRING "genemapperVersion"
 #define GENEMAP_VERSION_HEADER "##" GENEMAP_VERSION_STRING "=" GENEMAP_FILE_VERSION_STRING
 
-char complement_nucleotide(char n);
-const char *complement_nucleotide_sequence(const char *sequence);
-
 enum _strand_t {
     plusstrand = '+',
     minusstrand = '-'
@@ -38,6 +36,6 @@ static const char plusstrandString[] = {plusstrand, 0};
 static const char minusstrandString[] = {minusstrand, 0};
 
 // returns 0 on success
-int bcf_update_genemapper_info(const bcf_hdr_t *hdr, bcf1_t *line, int32_t index, strand_t strand);
+int bcf_update_genemapper_info(const bcf_hdr_t *hdr, bcf1_t *line, int32_t index, strand_t strand, const char *geneName);
 
 #endif
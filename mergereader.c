@@ -0,0 +1,355 @@
+//
+//  mergereader.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "mergereader.h"
+
+#define GT_FORMAT_HEADER "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">"
+
+// returns < 0 if the next record of input1 comes before the next record of input2
+static int merge_reader_compare_inputs(merge_reader_t *mergeReader, int32_t inputIndex1, int32_t inputIndex2)
+{
+    bcf1_t *record1 = mergeReader->inputs[inputIndex1].record;
+    bcf1_t *record2 = mergeReader->inputs[inputIndex2].record;
+    if (record1->rid != record2->rid) {
+        return record1->rid < record2->rid ? -1 : 1;
+    } else if (record1->pos != record2->pos) {
+        return record1->pos < record2->pos ? -1 : 1;
+    } else if (inputIndex1 != inputIndex2) {
+        return inputIndex1 < inputIndex2 ? -1 : 1;
+    } else {
+        return 0;
+    }
+}
+
+static void merge_reader_heap_push(merge_reader_t *mergeReader, int32_t inputIndex)
+{
+    int32_t *heap = mergeReader->heap;
+    int32_t child = mergeReader->heapCount;
+    mergeReader->heapCount++;
+
+    while (child > 0) {
+        int32_t parent = (child - 1) / 2;
+        if (merge_reader_compare_inputs(mergeReader, heap[parent], inputIndex) <= 0) {
+            break;
+        }
+        heap[child] = heap[parent];
+        child = parent;
+    }
+    heap[child] = inputIndex;
+}
+
+static int32_t merge_reader_heap_pop(merge_reader_t *mergeReader)
+{
+    int32_t *heap = mergeReader->heap;
+    int32_t top = heap[0];
+    mergeReader->heapCount--;
+    int32_t last = heap[mergeReader->heapCount];
+
+    int32_t parent = 0;
+    while (1) {
+        int32_t child = parent * 2 + 1;
+        if (child >= mergeReader->heapCount) {
+            break;
+        }
+        if (child + 1 < mergeReader->heapCount && merge_reader_compare_inputs(mergeReader, heap[child + 1], heap[child]) < 0) {
+            child++;
+        }
+        if (merge_reader_compare_inputs(mergeReader, last, heap[child]) <= 0) {
+            break;
+        }
+        heap[parent] = heap[child];
+        parent = child;
+    }
+    heap[parent] = last;
+
+    return top;
+}
+
+// reads the next record of the input and puts the input back in the heap, returns < -1 if the input can't be read
+static int merge_reader_read_input(merge_reader_t *mergeReader, int32_t inputIndex)
+{
+    merge_reader_input_t *input = &mergeReader->inputs[inputIndex];
+    int32_t lastRid = input->record->rid;
+    int64_t lastPosition = input->record->pos;
+
+    int result = bcf_read(input->file, input->header, input->record);
+    if (result == -1) {
+        return 0;
+    } else if (result < -1) {
+        fprintf(stderr, "Unable to read a record of '%s'.\n", input->filename);
+        return result;
+    }
+
+    if (input->record->rid < 0 || input->record->rid >= input->ridCount) {
+        fprintf(stderr, "The contig of the record at position %d of '%s' is not in its header.\n", (int)input->record->pos+1, input->filename);
+        return -2;
+    }
+    input->record->rid = input->ridMap[input->record->rid];
+    if (lastRid >= 0 && (input->record->rid < lastRid || (input->record->rid == lastRid && input->record->pos < lastPosition))) {
+        fprintf(stderr, "The input file '%s' is not sorted in the contig order of the merged header, %s:%d is out of order.\n",
+                input->filename, bcf_hdr_id2name(mergeReader->header, input->record->rid), (int)input->record->pos+1);
+        return -2;
+    }
+    bcf_unpack(input->record, BCF_UN_STR);
+
+    merge_reader_heap_push(mergeReader, inputIndex);
+    return 0;
+}
+
+merge_reader_t *merge_reader_init(const char **filenames, int32_t inputCount, const char *samples, int samplesIsFile)
+{
+    merge_reader_t *newMergeReader = (merge_reader_t *)malloc(sizeof(merge_reader_t));
+    memset(newMergeReader, 0, sizeof(merge_reader_t));
+    newMergeReader->inputs = (merge_reader_input_t *)malloc(sizeof(merge_reader_input_t) * inputCount);
+    memset(newMergeReader->inputs, 0, sizeof(merge_reader_input_t) * inputCount);
+    newMergeReader->heap = (int32_t *)malloc(sizeof(int32_t) * inputCount);
+    newMergeReader->mergedInputs = (int32_t *)malloc(sizeof(int32_t) * inputCount);
+    newMergeReader->deferredInputs = (int32_t *)malloc(sizeof(int32_t) * inputCount);
+    newMergeReader->header = bcf_hdr_init("w");
+
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < inputCount; i++) {
+        merge_reader_input_t *input = &newMergeReader->inputs[i];
+        input->filename = filenames[i];
+        input->file = hts_open(filenames[i], "r");
+        if (input->file == NULL) {
+            fprintf(stderr, "Unable to open input file '%s'.\n", filenames[i]);
+            merge_reader_destroy(newMergeReader);
+            return NULL;
+        }
+        newMergeReader->inputCount++;
+        input->header = bcf_hdr_read(input->file);
+        if (input->header == NULL) {
+            fprintf(stderr, "Unable to read the header from input file '%s'.\n", filenames[i]);
+            merge_reader_destroy(newMergeReader);
+            return NULL;
+        }
+        if (samples && bcf_hdr_set_samples(input->header, samples, samplesIsFile) < 0) {
+            fprintf(stderr, "Unable to read the samples%s '%s'.\n", samplesIsFile ? " file" : "", samples);
+            merge_reader_destroy(newMergeReader);
+            return NULL;
+        }
+        input->record = bcf_init();
+        input->record->rid = -1;
+        bcf_hdr_merge(newMergeReader->header, input->header);
+    }
+    int gtId = bcf_hdr_id2int(newMergeReader->header, BCF_DT_ID, "GT");
+    if (bcf_hdr_idinfo_exists(newMergeReader->header, BCF_HL_FMT, gtId) == 0) {
+        bcf_hdr_append(newMergeReader->header, GT_FORMAT_HEADER);
+    }
+
+    // a sample that is in several inputs is prefixed with the number of the input, like bcftools merge does
+    for (i = 0; i < inputCount; i++) {
+        bcf_hdr_t *header = newMergeReader->inputs[i].header;
+        for (j = 0; j < bcf_hdr_nsamples(header); j++) {
+            const char *sampleName = header->samples[j];
+            if (bcf_hdr_id2int(newMergeReader->header, BCF_DT_SAMPLE, sampleName) >= 0) {
+                char *newSampleName = (char *)malloc(strlen(sampleName) + 16);
+                sprintf(newSampleName, "%d:%s", (int)i + 1, sampleName);
+                fprintf(stderr, "***WARNING*** The sample '%s' of '%s' is in another input file, it is renamed '%s'.\n", sampleName, filenames[i], newSampleName);
+                int result = bcf_hdr_add_sample(newMergeReader->header, newSampleName);
+                free(newSampleName);
+                if (result < 0) {
+                    fprintf(stderr, "Unable to add the sample '%s' of '%s'.\n", sampleName, filenames[i]);
+                    merge_reader_destroy(newMergeReader);
+                    return NULL;
+                }
+            } else {
+                bcf_hdr_add_sample(newMergeReader->header, sampleName);
+            }
+        }
+    }
+    bcf_hdr_sync(newMergeReader->header);
+
+    for (i = 0; i < inputCount; i++) {
+        merge_reader_input_t *input = &newMergeReader->inputs[i];
+        input->ridCount = input->header->n[BCF_DT_CTG];
+        input->ridMap = (int32_t *)malloc(sizeof(int32_t) * (input->ridCount + 1));
+        for (j = 0; j < input->ridCount; j++) {
+            input->ridMap[j] = bcf_hdr_name2id(newMergeReader->header, bcf_hdr_id2name(input->header, j));
+        }
+        if (merge_reader_read_input(newMergeReader, i) < -1) {
+            merge_reader_destroy(newMergeReader);
+            return NULL;
+        }
+    }
+
+    return newMergeReader;
+}
+
+void merge_reader_destroy(merge_reader_t *mergeReader)
+{
+    int32_t i;
+    for (i = 0; i < mergeReader->inputCount; i++) {
+        merge_reader_input_t *input = &mergeReader->inputs[i];
+        if (input->record) {
+            bcf_destroy(input->record);
+        }
+        if (input->header) {
+            bcf_hdr_destroy(input->header);
+        }
+        free(input->ridMap);
+        free(input->genotypes);
+        hts_close(input->file);
+    }
+    free(mergeReader->inputs);
+    bcf_hdr_destroy(mergeReader->header);
+    free(mergeReader->heap);
+    free(mergeReader->mergedInputs);
+    free(mergeReader->deferredInputs);
+    free(mergeReader->alleles);
+    free(mergeReader->alleleMap);
+    free(mergeReader->genotypes);
+    free(mergeReader);
+}
+
+// returns the index of the allele in the merged alleles, the allele is added if it is not there yet
+static int32_t merge_reader_add_allele(merge_reader_t *mergeReader, int32_t *alleleCount, const char *allele)
+{
+    int32_t i;
+    for (i = 0; i < *alleleCount; i++) {
+        if (strcmp(mergeReader->alleles[i], allele) == 0) {
+            return i;
+        }
+    }
+    if (*alleleCount == mergeReader->allelesAllocated) {
+        mergeReader->allelesAllocated = mergeReader->allelesAllocated ? mergeReader->allelesAllocated * 2 : 8;
+        mergeReader->alleles = (const char **)realloc(mergeReader->alleles, sizeof(const char *) * mergeReader->allelesAllocated);
+    }
+    mergeReader->alleles[*alleleCount] = allele;
+    (*alleleCount)++;
+    return *alleleCount - 1;
+}
+
+int merge_reader_next(merge_reader_t *mergeReader, bcf1_t *record)
+{
+    if (mergeReader->heapCount == 0) {
+        return -1;
+    }
+
+    // the inputs with a record at the smallest position are taken, those with another reference allele are put back
+    int32_t mergedCount = 0;
+    int32_t deferredCount = 0;
+    int32_t firstInputIndex = merge_reader_heap_pop(mergeReader);
+    bcf1_t *firstRecord = mergeReader->inputs[firstInputIndex].record;
+    mergeReader->mergedInputs[mergedCount] = firstInputIndex;
+    mergedCount++;
+    while (mergeReader->heapCount) {
+        bcf1_t *nextRecord = mergeReader->inputs[mergeReader->heap[0]].record;
+        if (nextRecord->rid != firstRecord->rid || nextRecord->pos != firstRecord->pos) {
+            break;
+        }
+        int32_t inputIndex = merge_reader_heap_pop(mergeReader);
+        if (strcmp(nextRecord->d.allele[0], firstRecord->d.allele[0]) == 0) {
+            mergeReader->mergedInputs[mergedCount] = inputIndex;
+            mergedCount++;
+        } else {
+            mergeReader->deferredInputs[deferredCount] = inputIndex;
+            deferredCount++;
+        }
+    }
+    int32_t i;
+    int32_t j;
+    for (i = 0; i < deferredCount; i++) {
+        merge_reader_heap_push(mergeReader, mergeReader->deferredInputs[i]);
+    }
+
+    // the genotypes are read with the header of their input, and their alleles are translated to the merged alleles
+    int32_t alleleCount = 0;
+    int32_t ploidy = 0;
+    merge_reader_add_allele(mergeReader, &alleleCount, firstRecord->d.allele[0]);
+    for (i = 0; i < mergedCount; i++) {
+        merge_reader_input_t *input = &mergeReader->inputs[mergeReader->mergedInputs[i]];
+        int sampleCount = bcf_hdr_nsamples(input->header);
+        input->genotypeCount = sampleCount ? bcf_get_genotypes(input->header, input->record, &input->genotypes, &input->genotypesLength) : 0;
+        if (input->genotypeCount > 0 && input->genotypeCount / sampleCount > ploidy) {
+            ploidy = input->genotypeCount / sampleCount;
+        }
+        for (j = 1; j < input->record->n_allele; j++) {
+            merge_reader_add_allele(mergeReader, &alleleCount, input->record->d.allele[j]);
+        }
+    }
+
+    int32_t mergedSampleCount = bcf_hdr_nsamples(mergeReader->header);
+    if (ploidy) {
+        if (mergedSampleCount * ploidy > mergeReader->genotypesAllocated) {
+            mergeReader->genotypesAllocated = mergedSampleCount * ploidy;
+            mergeReader->genotypes = (int32_t *)realloc(mergeReader->genotypes, sizeof(int32_t) * mergeReader->genotypesAllocated);
+        }
+        for (i = 0; i < mergedSampleCount * ploidy; i++) {
+            mergeReader->genotypes[i] = bcf_gt_missing;
+        }
+    }
+
+    int32_t sampleIndex = 0;
+    int32_t mergedIndex = 0;
+    for (i = 0; i < mergeReader->inputCount && ploidy; i++) {
+        merge_reader_input_t *input = &mergeReader->inputs[i];
+        int sampleCount = bcf_hdr_nsamples(input->header);
+        if (mergedIndex == mergedCount || mergeReader->mergedInputs[mergedIndex] != i) {
+            sampleIndex += sampleCount;
+            continue;
+        }
+        mergedIndex++;
+        if (input->genotypeCount <= 0) {
+            sampleIndex += sampleCount;
+            continue;
+        }
+
+        if (input->record->n_allele > mergeReader->alleleMapAllocated) {
+            mergeReader->alleleMapAllocated = input->record->n_allele;
+            mergeReader->alleleMap = (int32_t *)realloc(mergeReader->alleleMap, sizeof(int32_t) * mergeReader->alleleMapAllocated);
+        }
+        for (j = 0; j < input->record->n_allele; j++) {
+            mergeReader->alleleMap[j] = merge_reader_add_allele(mergeReader, &alleleCount, input->record->d.allele[j]);
+        }
+
+        int32_t inputPloidy = input->genotypeCount / sampleCount;
+        int32_t k;
+        for (j = 0; j < sampleCount; j++) {
+            int32_t *genotypes = mergeReader->genotypes + (size_t)(sampleIndex + j) * ploidy;
+            const int32_t *inputGenotypes = input->genotypes + (size_t)j * inputPloidy;
+            for (k = 0; k < ploidy; k++) {
+                if (k >= inputPloidy || inputGenotypes[k] == bcf_int32_vector_end) {
+                    genotypes[k] = bcf_int32_vector_end;
+                } else if (bcf_gt_is_missing(inputGenotypes[k])) {
+                    genotypes[k] = inputGenotypes[k];
+                } else if (bcf_gt_allele(inputGenotypes[k]) >= input->record->n_allele) { // the allele index would mean another allele in the merged record
+                    genotypes[k] = bcf_gt_missing;
+                } else {
+                    genotypes[k] = ((mergeReader->alleleMap[bcf_gt_allele(inputGenotypes[k])] + 1) << 1) | bcf_gt_is_phased(inputGenotypes[k]);
+                }
+            }
+        }
+        sampleIndex += sampleCount;
+    }
+
+    bcf_clear(record);
+    record->rid = firstRecord->rid;
+    record->pos = firstRecord->pos;
+    record->n_sample = mergedSampleCount;
+    bcf_float_set_missing(record->qual);
+    bcf_update_id(mergeReader->header, record, firstRecord->d.id);
+    bcf_update_alleles(mergeReader->header, record, mergeReader->alleles, alleleCount);
+    if (ploidy) {
+        bcf_update_genotypes(mergeReader->header, record, mergeReader->genotypes, mergedSampleCount * ploidy);
+    }
+
+    // the alleles point in the records of the inputs, so the next records are only read once the record is merged
+    for (i = 0; i < mergedCount; i++) {
+        int result = merge_reader_read_input(mergeReader, mergeReader->mergedInputs[i]);
+        if (result < -1) {
+            return result;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+//
+//  mergereader.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_mergereader_h
+#define bcfgenemapper_mergereader_h
+
+#include <htslib/vcf.h>
+
+/* Reads several inputs that are sorted by contig and position as a single sorted stream of records with the samples
+   of all the inputs. The headers are merged, and the next record of each input is kept in a heap ordered by the contig
+   (in the order of the merged header) and the position. The records of the inputs at the same position with the same
+   reference allele are merged in a record that only has the genotypes. Its alternate alleles are the alternate alleles
+   of all the records, and the samples of the inputs without a record at that position are missing. */
+
+typedef struct {
+    const char *filename;
+    htsFile *file;
+    bcf_hdr_t *header;
+    int32_t ridCount;
+    int32_t *ridMap; // rid in the merged header of each contig of the header
+    bcf1_t *record; // next record, its rid is in the merged header
+    int32_t *genotypes; // genotypes of the record when it is merged
+    int genotypesLength;
+    int genotypeCount;
+} merge_reader_input_t;
+
+typedef struct {
+    int32_t inputCount;
+    merge_reader_input_t *inputs;
+    bcf_hdr_t *header; // merged header, with the samples of the inputs in input order
+    
+    int32_t heapCount;
+    int32_t *heap; // inputs that have a next record, the input of the smallest record first
+    
+    int32_t *mergedInputs; // reused for the inputs of the record being merged, and the inputs put back in the heap
+    int32_t *deferredInputs;
+    const char **alleles; // reused for the alleles of the merged record
+    int32_t allelesAllocated;
+    int32_t *alleleMap; // reused for the index in the merged alleles of the alleles of a record
+    int32_t alleleMapAllocated;
+    int32_t *genotypes; // reused for the genotypes of the merged record
+    int32_t genotypesAllocated;
+} merge_reader_t;
+
+// the samples are read like bcf_hdr_set_samples, returns NULL and prints the reason if an input can't be read
+merge_reader_t *merge_reader_init(const char **filenames, int32_t inputCount, const char *samples, int samplesIsFile);
+void merge_reader_destroy(merge_reader_t *mergeReader);
+
+// same return values as bcf_read, 0 on success, -1 at the end of the inputs and < -1 on error
+int merge_reader_next(merge_reader_t *mergeReader, bcf1_t *record);
+
+#endif
@@ -0,0 +1,240 @@
+//
+//  nucleotide.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "nucleotide.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NUCLEOTIDE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// complement of each character, 0 for the unknown characters
+static const char complementTable[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '-', 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 'T', 'V', 'G', 'H', 0, 0, 'C', 'd', 0, 0, 'M', 0, 'K', 'N', 0,
+    0, 0, 'Y', 'S', 'A', 0, 'B', 'W', 0, 'R', 0, 0, 0, 0, 0, 0,
+    0, 't', 'v', 'g', 'h', 0, 0, 'c', 'd', 0, 0, 'm', 0, 'k', 'n', 0,
+    0, 0, 'y', 's', 'a', 0, 'b', 'w', 0, 'r', 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+char complement_nucleotide(char n)
+{
+    char complement = complementTable[(unsigned char)n];
+    if (complement) {
+        return complement;
+    }
+    
+    if (!isspace(n) && !ispunct(n)) {
+        if (isprint(n)) {
+            fprintf(stderr, "***WARNING*** Trying to get the complement of unknown nucleotide '%c'.\n", n);
+        } else {
+            fprintf(stderr, "***WARNING*** Trying to get the complement of unknown nucleotide ASCII value %d.\n", (int)n);
+        }
+    }
+    return n;
+}
+
+static void complement_nucleotides_scalar(const char *sequence, char *complementOut, size_t length)
+{
+    size_t i;
+    for (i = 0; i < length; i++) {
+        complementOut[i] = complement_nucleotide(sequence[i]);
+    }
+}
+
+static void reverse_complement_nucleotides_scalar(const char *sequence, char *reverseComplementOut, size_t length)
+{
+    size_t i;
+    for (i = 0; i < length; i++) {
+        reverseComplementOut[i] = complement_nucleotide(sequence[length - 1 - i]);
+    }
+}
+
+#ifdef NUCLEOTIDE_X86_SIMD
+
+/* The vector paths look the uppercase complement of letters up by their 5 low bits, and add the lowercase bit of
+   the input back. Blocks with anything else ('H', '-', unknown characters...) go through complement_nucleotide. */
+
+static const char simdComplementTable[32] = {
+    0, 'T', 'V', 'G', 'H', 0, 0, 'C', 0, 0, 0, 'M', 0, 'K', 'N', 0,
+    0, 0, 'Y', 'S', 'A', 0, 'B', 'W', 0, 'R', 0, 0, 0, 0, 0, 0
+};
+
+// complements 16 characters, returns 0 if the block has characters the vector path can't complement
+__attribute__((target("ssse3")))
+static int complement_nucleotides_ssse3_block(__m128i block, __m128i *complementOut)
+{
+    const __m128i lowTable = _mm_loadu_si128((const __m128i *)simdComplementTable);
+    const __m128i highTable = _mm_loadu_si128((const __m128i *)(simdComplementTable + 16));
+    
+    __m128i caseBit = _mm_and_si128(block, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_or_si128(block, _mm_set1_epi8(0x20));
+    __m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(letter, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), letter));
+    __m128i index = _mm_and_si128(block, _mm_set1_epi8(0x1F));
+    __m128i isHigh = _mm_cmpgt_epi8(index, _mm_set1_epi8(15));
+    __m128i complement = _mm_or_si128(_mm_and_si128(isHigh, _mm_shuffle_epi8(highTable, index)),
+                                      _mm_andnot_si128(isHigh, _mm_shuffle_epi8(lowTable, index)));
+    __m128i valid = _mm_andnot_si128(_mm_cmpeq_epi8(complement, _mm_setzero_si128()), isLetter);
+    if (_mm_movemask_epi8(valid) != 0xFFFF) {
+        return 0;
+    }
+    *complementOut = _mm_or_si128(complement, caseBit);
+    return 1;
+}
+
+__attribute__((target("ssse3")))
+static void complement_nucleotides_ssse3(const char *sequence, char *complementOut, size_t length)
+{
+    size_t i;
+    for (i = 0; i + 16 <= length; i += 16) {
+        __m128i complement;
+        if (complement_nucleotides_ssse3_block(_mm_loadu_si128((const __m128i *)(sequence + i)), &complement)) {
+            _mm_storeu_si128((__m128i *)(complementOut + i), complement);
+        } else {
+            complement_nucleotides_scalar(sequence + i, complementOut + i, 16);
+        }
+    }
+    complement_nucleotides_scalar(sequence + i, complementOut + i, length - i);
+}
+
+__attribute__((target("ssse3")))
+static void reverse_complement_nucleotides_ssse3(const char *sequence, char *reverseComplementOut, size_t length)
+{
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    size_t i;
+    for (i = 0; i + 16 <= length; i += 16) { // the block ending i characters before the end of sequence
+        const char *block = sequence + length - i - 16;
+        __m128i complement;
+        if (complement_nucleotides_ssse3_block(_mm_loadu_si128((const __m128i *)block), &complement)) {
+            _mm_storeu_si128((__m128i *)(reverseComplementOut + i), _mm_shuffle_epi8(complement, reverse));
+        } else {
+            reverse_complement_nucleotides_scalar(block, reverseComplementOut + i, 16);
+        }
+    }
+    reverse_complement_nucleotides_scalar(sequence, reverseComplementOut + i, length - i);
+}
+
+// complements 32 characters, returns 0 if the block has characters the vector path can't complement
+__attribute__((target("avx2")))
+static int complement_nucleotides_avx2_block(__m256i block, __m256i *complementOut)
+{
+    const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)simdComplementTable));
+    const __m256i highTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(simdComplementTable + 16)));
+    
+    __m256i caseBit = _mm256_and_si256(block, _mm256_set1_epi8(0x20));
+    __m256i letter = _mm256_or_si256(block, _mm256_set1_epi8(0x20));
+    __m256i isLetter = _mm256_and_si256(_mm256_cmpgt_epi8(letter, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), letter));
+    __m256i index = _mm256_and_si256(block, _mm256_set1_epi8(0x1F));
+    __m256i complement = _mm256_blendv_epi8(_mm256_shuffle_epi8(lowTable, index), _mm256_shuffle_epi8(highTable, index),
+                                            _mm256_cmpgt_epi8(index, _mm256_set1_epi8(15)));
+    __m256i valid = _mm256_andnot_si256(_mm256_cmpeq_epi8(complement, _mm256_setzero_si256()), isLetter);
+    if (_mm256_movemask_epi8(valid) != -1) {
+        return 0;
+    }
+    *complementOut = _mm256_or_si256(complement, caseBit);
+    return 1;
+}
+
+__attribute__((target("avx2")))
+static void complement_nucleotides_avx2(const char *sequence, char *complementOut, size_t length)
+{
+    size_t i;
+    for (i = 0; i + 32 <= length; i += 32) {
+        __m256i complement;
+        if (complement_nucleotides_avx2_block(_mm256_loadu_si256((const __m256i *)(sequence + i)), &complement)) {
+            _mm256_storeu_si256((__m256i *)(complementOut + i), complement);
+        } else {
+            complement_nucleotides_scalar(sequence + i, complementOut + i, 32);
+        }
+    }
+    complement_nucleotides_scalar(sequence + i, complementOut + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void reverse_complement_nucleotides_avx2(const char *sequence, char *reverseComplementOut, size_t length)
+{
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                                             15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    size_t i;
+    for (i = 0; i + 32 <= length; i += 32) { // the block ending i characters before the end of sequence
+        const char *block = sequence + length - i - 32;
+        __m256i complement;
+        if (complement_nucleotides_avx2_block(_mm256_loadu_si256((const __m256i *)block), &complement)) {
+            // reverse each lane, then swap the lanes
+            complement = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(complement, reverse), 0x4E);
+            _mm256_storeu_si256((__m256i *)(reverseComplementOut + i), complement);
+        } else {
+            reverse_complement_nucleotides_scalar(block, reverseComplementOut + i, 32);
+        }
+    }
+    reverse_complement_nucleotides_scalar(sequence, reverseComplementOut + i, length - i);
+}
+
+#endif
+
+void complement_nucleotides(const char *sequence, char *complementOut, size_t length)
+{
+#ifdef NUCLEOTIDE_X86_SIMD
+    if (length >= 32 && __builtin_cpu_supports("avx2")) {
+        complement_nucleotides_avx2(sequence, complementOut, length);
+        return;
+    }
+    if (length >= 16 && __builtin_cpu_supports("ssse3")) {
+        complement_nucleotides_ssse3(sequence, complementOut, length);
+        return;
+    }
+#endif
+    complement_nucleotides_scalar(sequence, complementOut, length);
+}
+
+void reverse_complement_nucleotides(const char *sequence, char *reverseComplementOut, size_t length)
+{
+#ifdef NUCLEOTIDE_X86_SIMD
+    if (length >= 32 && __builtin_cpu_supports("avx2")) {
+        reverse_complement_nucleotides_avx2(sequence, reverseComplementOut, length);
+        return;
+    }
+    if (length >= 16 && __builtin_cpu_supports("ssse3")) {
+        reverse_complement_nucleotides_ssse3(sequence, reverseComplementOut, length);
+        return;
+    }
+#endif
+    reverse_complement_nucleotides_scalar(sequence, reverseComplementOut, length);
+}
+
+const char *complement_nucleotide_sequence(const char *sequence)
+{
+    static char *complementSequence = NULL;
+    static size_t complementSequenceAllocated = 0;
+    
+    size_t sequenceLength = strlen(sequence);
+    if (sequenceLength + 1 > complementSequenceAllocated) {
+        complementSequenceAllocated = sequenceLength + 1;
+        complementSequence = (char *)realloc(complementSequence, complementSequenceAllocated);
+    }
+    
+    complement_nucleotides(sequence, complementSequence, sequenceLength);
+    complementSequence[sequenceLength] = 0;
+    
+    return complementSequence;
+}
@@ -0,0 +1,27 @@
+//
+//  nucleotide.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_nucleotide_h
+#define bcfgenemapper_nucleotide_h
+
+#include <stddef.h>
+
+/* Complements of the IUPAC nucleotide codes, the case is kept (except for 'H' which is complemented to 'd'),
+   '-' is its own complement. Unknown characters are left as they are, with a warning if they are not space
+   or punctuation. */
+
+char complement_nucleotide(char n);
+
+// writes the complement of the length nucleotides of sequence to complementOut, which can be sequence
+void complement_nucleotides(const char *sequence, char *complementOut, size_t length);
+// writes the reverse complement of the length nucleotides of sequence to reverseComplementOut, which must not overlap sequence
+void reverse_complement_nucleotides(const char *sequence, char *reverseComplementOut, size_t length);
+
+// returns the complement of the sequence in a static buffer, not reentrant, the buffer is valid until the next call
+const char *complement_nucleotide_sequence(const char *sequence);
+
+#endif
@@ -0,0 +1,272 @@
+//
+//  pipeline.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "pipeline.h"
+
+#define PIPELINE_BATCH_SIZE 1024
+#define PIPELINE_QUEUE_DEPTH 4
+
+static record_batch_t *record_batch_init(int32_t batchSize)
+{
+    record_batch_t *newBatch = (record_batch_t *)malloc(sizeof(record_batch_t));
+    memset(newBatch, 0, sizeof(record_batch_t));
+    
+    newBatch->recordsAllocated = batchSize;
+    newBatch->records = (bcf1_t **)malloc(sizeof(bcf1_t *) * batchSize);
+    newBatch->recordStates = (int *)malloc(sizeof(int) * batchSize);
+    int32_t i;
+    for (i = 0; i < batchSize; i++) {
+        newBatch->records[i] = bcf_init();
+        newBatch->recordStates[i] = 0;
+    }
+    
+    return newBatch;
+}
+
+static void record_batch_destroy(record_batch_t *batch)
+{
+    int32_t i;
+    for (i = 0; i < batch->recordsAllocated; i++) {
+        bcf_destroy(batch->records[i]);
+    }
+    free(batch->records);
+    free(batch->recordStates);
+    free(batch);
+}
+
+static batch_queue_t *batch_queue_init(int32_t capacity)
+{
+    batch_queue_t *newQueue = (batch_queue_t *)malloc(sizeof(batch_queue_t));
+    memset(newQueue, 0, sizeof(batch_queue_t));
+    
+    newQueue->capacity = capacity;
+    newQueue->batches = (record_batch_t **)malloc(sizeof(record_batch_t *) * capacity);
+    pthread_mutex_init(&newQueue->mutex, NULL);
+    pthread_cond_init(&newQueue->notEmpty, NULL);
+    pthread_cond_init(&newQueue->notFull, NULL);
+    
+    return newQueue;
+}
+
+static void batch_queue_destroy(batch_queue_t *queue)
+{
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_cond_destroy(&queue->notFull);
+    free(queue->batches);
+    free(queue);
+}
+
+static void batch_queue_push(batch_queue_t *queue, record_batch_t *batch)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == queue->capacity) {
+        pthread_cond_wait(&queue->notFull, &queue->mutex);
+    }
+    queue->batches[(queue->head + queue->count) % queue->capacity] = batch;
+    queue->count++;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// returns NULL once the queue is closed and empty
+static record_batch_t *batch_queue_pop(batch_queue_t *queue)
+{
+    record_batch_t *batch = NULL;
+    
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && queue->closed == 0) {
+        pthread_cond_wait(&queue->notEmpty, &queue->mutex);
+    }
+    if (queue->count > 0) {
+        batch = queue->batches[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    
+    return batch;
+}
+
+static void batch_queue_close(batch_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static int pipeline_stopped(pipeline_t *pipeline)
+{
+    pthread_mutex_lock(&pipeline->stopMutex);
+    int stopped = pipeline->stopped;
+    pthread_mutex_unlock(&pipeline->stopMutex);
+    return stopped;
+}
+
+static void pipeline_stop(pipeline_t *pipeline)
+{
+    pthread_mutex_lock(&pipeline->stopMutex);
+    pipeline->stopped = 1;
+    pthread_mutex_unlock(&pipeline->stopMutex);
+}
+
+pipeline_t *pipeline_init(void *context, pipeline_read_function_t readFunction, pipeline_annotate_function_t annotateFunction, pipeline_write_function_t writeFunction)
+{
+    pipeline_t *newPipeline = (pipeline_t *)malloc(sizeof(pipeline_t));
+    memset(newPipeline, 0, sizeof(pipeline_t));
+    
+    newPipeline->context = context;
+    newPipeline->readFunction = readFunction;
+    newPipeline->annotateFunction = annotateFunction;
+    newPipeline->writeFunction = writeFunction;
+    newPipeline->batchSize = PIPELINE_BATCH_SIZE;
+    // enough batches for every queue to be full, and for every stage to hold one
+    newPipeline->batchCount = PIPELINE_QUEUE_DEPTH * 2 + 3;
+    pthread_mutex_init(&newPipeline->stopMutex, NULL);
+    
+    return newPipeline;
+}
+
+void pipeline_destroy(pipeline_t *pipeline)
+{
+    pthread_mutex_destroy(&pipeline->stopMutex);
+    free(pipeline);
+}
+
+static int pipeline_run_single_thread(pipeline_t *pipeline)
+{
+    record_batch_t *batch = record_batch_init(pipeline->batchSize);
+    char done = 0;
+    
+    while (done == 0) {
+        for (batch->recordCount = 0; batch->recordCount < batch->recordsAllocated; batch->recordCount++) {
+            if (pipeline->readFunction(pipeline->context, batch->records[batch->recordCount]) < 0) {
+                done = 1;
+                break;
+            }
+        }
+        int32_t writeCount = pipeline->annotateFunction(pipeline->context, batch->records, batch->recordStates, batch->recordCount);
+        if (writeCount < batch->recordCount) {
+            done = 1;
+        }
+        int32_t i;
+        for (i = 0; i < writeCount; i++) {
+            pipeline->writeFunction(pipeline->context, batch->records[i], batch->recordStates[i]);
+        }
+    }
+    record_batch_destroy(batch);
+    
+    return 0;
+}
+
+static void *pipeline_read_thread(void *pipelinePtr)
+{
+    pipeline_t *pipeline = (pipeline_t *)pipelinePtr;
+    record_batch_t *batch;
+    char done = 0;
+    
+    while (done == 0 && pipeline_stopped(pipeline) == 0 && (batch = batch_queue_pop(pipeline->freeQueue)) != NULL) {
+        for (batch->recordCount = 0; batch->recordCount < batch->recordsAllocated; batch->recordCount++) {
+            if (pipeline->readFunction(pipeline->context, batch->records[batch->recordCount]) < 0) {
+                done = 1;
+                break;
+            }
+        }
+        batch_queue_push(pipeline->annotateQueue, batch);
+    }
+    batch_queue_close(pipeline->annotateQueue);
+    
+    return NULL;
+}
+
+static void *pipeline_annotate_thread(void *pipelinePtr)
+{
+    pipeline_t *pipeline = (pipeline_t *)pipelinePtr;
+    record_batch_t *batch;
+    char stopped = 0;
+    
+    while ((batch = batch_queue_pop(pipeline->annotateQueue)) != NULL) {
+        if (stopped) { // keep draining so that the reader can't block on a full queue
+            batch_queue_push(pipeline->freeQueue, batch);
+            continue;
+        }
+        int32_t writeCount = pipeline->annotateFunction(pipeline->context, batch->records, batch->recordStates, batch->recordCount);
+        if (writeCount < batch->recordCount) {
+            batch->recordCount = writeCount;
+            stopped = 1;
+            pipeline_stop(pipeline);
+        }
+        batch_queue_push(pipeline->writeQueue, batch);
+    }
+    batch_queue_close(pipeline->writeQueue);
+    
+    return NULL;
+}
+
+static int pipeline_run_threads(pipeline_t *pipeline)
+{
+    int32_t i;
+    
+    pipeline->freeQueue = batch_queue_init(pipeline->batchCount);
+    pipeline->annotateQueue = batch_queue_init(PIPELINE_QUEUE_DEPTH);
+    pipeline->writeQueue = batch_queue_init(PIPELINE_QUEUE_DEPTH);
+    record_batch_t **batches = (record_batch_t **)malloc(sizeof(record_batch_t *) * pipeline->batchCount);
+    for (i = 0; i < pipeline->batchCount; i++) {
+        batches[i] = record_batch_init(pipeline->batchSize);
+        batch_queue_push(pipeline->freeQueue, batches[i]);
+    }
+    
+    pthread_t readThread;
+    pthread_t annotateThread;
+    if (pthread_create(&readThread, NULL, pipeline_read_thread, pipeline) != 0) {
+        fprintf(stderr, "[%s:%d %s] Unable to create the reader thread\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    if (pthread_create(&annotateThread, NULL, pipeline_annotate_thread, pipeline) != 0) {
+        fprintf(stderr, "[%s:%d %s] Unable to create the annotator thread\n", __FILE__, __LINE__, __FUNCTION__);
+        abort();
+    }
+    
+    record_batch_t *batch;
+    while ((batch = batch_queue_pop(pipeline->writeQueue)) != NULL) {
+        for (i = 0; i < batch->recordCount; i++) {
+            pipeline->writeFunction(pipeline->context, batch->records[i], batch->recordStates[i]);
+        }
+        batch_queue_push(pipeline->freeQueue, batch);
+    }
+    
+    pthread_join(readThread, NULL);
+    pthread_join(annotateThread, NULL);
+    
+    for (i = 0; i < pipeline->batchCount; i++) {
+        record_batch_destroy(batches[i]);
+    }
+    free(batches);
+    batch_queue_destroy(pipeline->freeQueue);
+    batch_queue_destroy(pipeline->annotateQueue);
+    batch_queue_destroy(pipeline->writeQueue);
+    pipeline->freeQueue = NULL;
+    pipeline->annotateQueue = NULL;
+    pipeline->writeQueue = NULL;
+    
+    return 0;
+}
+
+int pipeline_run(pipeline_t *pipeline, int threadCount)
+{
+    if (threadCount <= 1) {
+        return pipeline_run_single_thread(pipeline);
+    } else {
+        return pipeline_run_threads(pipeline);
+    }
+}
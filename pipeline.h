@@ -0,0 +1,67 @@
+//
+//  pipeline.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_pipeline_h
+#define bcfgenemapper_pipeline_h
+
+#include <pthread.h>
+#include <htslib/vcf.h>
+
+/* Runs records through three stages: read -> annotate -> write. The records are annotated in batches. With a single
+   thread the stages are called one after the other for each batch. With more threads, the reader and the annotator run on
+   their own threads and hand batches of records to the next stage through bounded queues, the writer
+   runs on the calling thread. Records always reach the writer in the order they were read. */
+
+// same return values as bcf_read
+typedef int (*pipeline_read_function_t)(void *context, bcf1_t *record);
+// sets the states of a batch of records that will be given to the write function, returns the number of records
+// to write, fewer than recordCount to stop the pipeline after them
+typedef int32_t (*pipeline_annotate_function_t)(void *context, bcf1_t **records, int *recordStates, int32_t recordCount);
+typedef void (*pipeline_write_function_t)(void *context, bcf1_t *record, int recordState);
+
+typedef struct {
+    bcf1_t **records;
+    int *recordStates;
+    int32_t recordCount;
+    int32_t recordsAllocated;
+} record_batch_t;
+
+typedef struct { // bounded FIFO of batches
+    record_batch_t **batches;
+    int32_t capacity;
+    int32_t head;
+    int32_t count;
+    char closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} batch_queue_t;
+
+typedef struct {
+    void *context;
+    pipeline_read_function_t readFunction;
+    pipeline_annotate_function_t annotateFunction;
+    pipeline_write_function_t writeFunction;
+    
+    int32_t batchSize;
+    int32_t batchCount;
+    
+    batch_queue_t *freeQueue;
+    batch_queue_t *annotateQueue;
+    batch_queue_t *writeQueue;
+    
+    pthread_mutex_t stopMutex;
+    char stopped;
+} pipeline_t;
+
+pipeline_t *pipeline_init(void *context, pipeline_read_function_t readFunction, pipeline_annotate_function_t annotateFunction, pipeline_write_function_t writeFunction);
+void pipeline_destroy(pipeline_t *pipeline);
+
+// returns 0 on success
+int pipeline_run(pipeline_t *pipeline, int threadCount);
+
+#endif
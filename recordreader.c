@@ -0,0 +1,211 @@
+//
+//  recordreader.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "recordreader.h"
+
+record_reader_t *record_reader_init(htsFile *file, bcf_hdr_t *header, const char *filename)
+{
+    record_reader_t *newRecordReader = (record_reader_t *)malloc(sizeof(record_reader_t));
+    memset(newRecordReader, 0, sizeof(record_reader_t));
+    
+    newRecordReader->file = file;
+    newRecordReader->header = header;
+    newRecordReader->ownsIndex = 1;
+    
+    if (filename == NULL || strcmp(filename, "-") == 0) {
+        return newRecordReader; // stdin can't be indexed
+    }
+    
+    const htsFormat *format = hts_get_format(file);
+    if (format->format == bcf && format->compression == bgzf) {
+        newRecordReader->bcfIndex = bcf_index_load3(filename, NULL, HTS_IDX_SILENT_FAIL);
+        if (newRecordReader->bcfIndex) {
+            newRecordReader->sequenceNames = bcf_index_seqnames(newRecordReader->bcfIndex, header, &newRecordReader->sequenceNameCount);
+        }
+    } else if (format->format == vcf && format->compression == bgzf) {
+        newRecordReader->tbxIndex = tbx_index_load3(filename, NULL, HTS_IDX_SILENT_FAIL);
+        if (newRecordReader->tbxIndex) {
+            newRecordReader->sequenceNames = tbx_seqnames(newRecordReader->tbxIndex, &newRecordReader->sequenceNameCount);
+        }
+    }
+    
+    return newRecordReader;
+}
+
+record_reader_t *record_reader_init_sharing_index(htsFile *file, bcf_hdr_t *header, record_reader_t *indexedRecordReader)
+{
+    record_reader_t *newRecordReader = (record_reader_t *)malloc(sizeof(record_reader_t));
+    memset(newRecordReader, 0, sizeof(record_reader_t));
+    
+    newRecordReader->file = file;
+    newRecordReader->header = header;
+    newRecordReader->bcfIndex = indexedRecordReader->bcfIndex;
+    newRecordReader->tbxIndex = indexedRecordReader->tbxIndex;
+    newRecordReader->sequenceNames = indexedRecordReader->sequenceNames;
+    newRecordReader->sequenceNameCount = indexedRecordReader->sequenceNameCount;
+    
+    return newRecordReader;
+}
+
+void record_reader_destroy(record_reader_t *recordReader)
+{
+    if (recordReader->iterator) {
+        hts_itr_destroy(recordReader->iterator);
+    }
+    if (recordReader->ownsIndex) {
+        if (recordReader->bcfIndex) {
+            hts_idx_destroy(recordReader->bcfIndex);
+        }
+        if (recordReader->tbxIndex) {
+            tbx_destroy(recordReader->tbxIndex);
+        }
+        free(recordReader->sequenceNames);
+    }
+    free(recordReader->regions);
+    free(recordReader->line.s);
+    free(recordReader);
+}
+
+int record_reader_set_regions(record_reader_t *recordReader, const genomic_region_t *regions, int32_t regionCount)
+{
+    if (record_reader_is_indexed(recordReader) == 0) {
+        return -1;
+    }
+    
+    free(recordReader->regions);
+    int32_t regionsAllocated = regionCount + 1;
+    recordReader->regions = (genomic_region_t *)malloc(sizeof(genomic_region_t) * regionsAllocated);
+    recordReader->regionCount = 0;
+    
+    int i;
+    int32_t j;
+    for (i = 0; i < recordReader->sequenceNameCount; i++) {
+        const char *sequenceName = recordReader->sequenceNames[i];
+        int32_t sequenceRegionStart = recordReader->regionCount;
+        for (j = 0; j < regionCount; j++) {
+            if (regions[j].contig && contig_names_match(regions[j].contig, sequenceName) == 0) {
+                continue;
+            }
+            if (recordReader->regionCount == regionsAllocated) {
+                regionsAllocated *= 2;
+                recordReader->regions = (genomic_region_t *)realloc(recordReader->regions, sizeof(genomic_region_t) * regionsAllocated);
+            }
+            recordReader->regions[recordReader->regionCount] = regions[j];
+            recordReader->regions[recordReader->regionCount].contig = sequenceName;
+            recordReader->regionCount++;
+        }
+        // regions on any contig can overlap the regions of this sequence
+        recordReader->regionCount = sequenceRegionStart + genomic_regions_merge(recordReader->regions + sequenceRegionStart, recordReader->regionCount - sequenceRegionStart);
+    }
+    
+    recordReader->regionIndex = 0;
+    if (recordReader->iterator) {
+        hts_itr_destroy(recordReader->iterator);
+        recordReader->iterator = NULL;
+    }
+    return 0;
+}
+
+int record_reader_set_region(record_reader_t *recordReader, genomic_region_t region)
+{
+    if (record_reader_is_indexed(recordReader) == 0) {
+        return -1;
+    }
+    
+    free(recordReader->regions);
+    recordReader->regions = (genomic_region_t *)malloc(sizeof(genomic_region_t));
+    recordReader->regions[0] = region;
+    recordReader->regionCount = 1;
+    
+    recordReader->regionIndex = 0;
+    if (recordReader->iterator) {
+        hts_itr_destroy(recordReader->iterator);
+        recordReader->iterator = NULL;
+    }
+    return 0;
+}
+
+// moves the iterator to the next region, returns -1 when there are no regions left
+static int record_reader_next_iterator(record_reader_t *recordReader)
+{
+    if (recordReader->iterator) {
+        hts_itr_destroy(recordReader->iterator);
+        recordReader->iterator = NULL;
+    }
+    
+    while (recordReader->regionIndex < recordReader->regionCount) {
+        genomic_region_t region = recordReader->regions[recordReader->regionIndex];
+        recordReader->regionIndex++;
+        
+        // the iterators use 0-based half open intervals
+        if (recordReader->bcfIndex) {
+            int tid = bcf_hdr_name2id(recordReader->header, region.contig);
+            if (tid >= 0) {
+                recordReader->iterator = bcf_itr_queryi(recordReader->bcfIndex, tid, region.start, (hts_pos_t)region.end + 1);
+            }
+        } else {
+            int tid = tbx_name2id(recordReader->tbxIndex, region.contig);
+            if (tid >= 0) {
+                recordReader->iterator = tbx_itr_queryi(recordReader->tbxIndex, tid, region.start, (hts_pos_t)region.end + 1);
+            }
+        }
+        
+        if (recordReader->iterator) {
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+int record_reader_next(record_reader_t *recordReader, bcf1_t *record)
+{
+    if (recordReader->regions == NULL) {
+        return bcf_read(recordReader->file, recordReader->header, record);
+    }
+    
+    while (1) {
+        if (recordReader->iterator == NULL && record_reader_next_iterator(recordReader) < 0) {
+            return -1;
+        }
+        
+        int result;
+        if (recordReader->bcfIndex) {
+            result = bcf_itr_next(recordReader->file, recordReader->iterator, record);
+            if (result >= 0 && recordReader->header->keep_samples) { // bcf_read subsets the samples itself, the iterators don't
+                bcf_subset_format(recordReader->header, record);
+            }
+        } else {
+            result = tbx_itr_next(recordReader->file, recordReader->tbxIndex, recordReader->iterator, &recordReader->line);
+            if (result >= 0) {
+                result = vcf_parse(&recordReader->line, recordReader->header, record);
+                if (result < 0) {
+                    return -2;
+                }
+            }
+        }
+        
+        if (result == -1) {
+            hts_itr_destroy(recordReader->iterator);
+            recordReader->iterator = NULL;
+            continue;
+        } else if (result < -1) {
+            return result;
+        }
+        
+        // records overlapping the start of the region belong to the previous region (or to none), the regions
+        // don't overlap so every record is returned at most once
+        if (record->pos < recordReader->regions[recordReader->regionIndex - 1].start) {
+            continue;
+        }
+        return 0;
+    }
+}
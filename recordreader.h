@@ -0,0 +1,56 @@
+//
+//  recordreader.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_recordreader_h
+#define bcfgenemapper_recordreader_h
+
+#include <htslib/vcf.h>
+#include <htslib/tbx.h>
+
+#include "genemapper.h"
+
+/* Reads the records of an input file, either by streaming the whole file, or,
+   when regions are set and the input has a .csi/.tbi index, by only fetching
+   the records that start inside the regions. */
+
+typedef struct {
+    htsFile *file;
+    bcf_hdr_t *header;
+    
+    hts_idx_t *bcfIndex; // set for indexed BCF input
+    tbx_t *tbxIndex; // set for indexed bgzipped VCF input
+    char ownsIndex;
+    
+    const char **sequenceNames;
+    int sequenceNameCount;
+    
+    genomic_region_t *regions; // regions to read, on the sequences of the index and in index order
+    int32_t regionCount;
+    int32_t regionIndex;
+    
+    hts_itr_t *iterator;
+    kstring_t line;
+} record_reader_t;
+
+record_reader_t *record_reader_init(htsFile *file, bcf_hdr_t *header, const char *filename);
+// reads another handle of the same input with the index of indexedRecordReader, which must outlive the new reader
+record_reader_t *record_reader_init_sharing_index(htsFile *file, bcf_hdr_t *header, record_reader_t *indexedRecordReader);
+void record_reader_destroy(record_reader_t *recordReader);
+
+static inline int record_reader_is_indexed(record_reader_t *recordReader) {return recordReader->bcfIndex != NULL || recordReader->tbxIndex != NULL;}
+
+// returns 0 if the input is indexed and only the records starting in the regions will be read, -1 if the whole input will be streamed
+// regions without a contig are read on every sequence of the index
+int record_reader_set_regions(record_reader_t *recordReader, const genomic_region_t *regions, int32_t regionCount);
+
+// reads the records starting in a region that was returned by a reader of the same input, in recordReader->regions
+int record_reader_set_region(record_reader_t *recordReader, genomic_region_t region);
+
+// same return values as bcf_read, 0 on success, -1 at the end of the input and < -1 on error
+int record_reader_next(record_reader_t *recordReader, bcf1_t *record);
+
+#endif
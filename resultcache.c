@@ -0,0 +1,275 @@
+//
+//  resultcache.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <htslib/vcf.h>
+#include "resultcache.h"
+
+// the two halves of the key are 64 bit FNV-1a hashes with different primes
+#define RESULT_CACHE_HASH_BASIS 0xcbf29ce484222325ULL
+#define RESULT_CACHE_HASH_PRIME1 0x00000100000001b3ULL
+#define RESULT_CACHE_HASH_PRIME2 0x9e3779b97f4a7c15ULL
+
+static char *result_cache_path(const char *directory, const char *name)
+{
+    char *path = (char *)malloc(strlen(directory) + strlen(name) + 2);
+    sprintf(path, "%s/%s", directory, name);
+    return path;
+}
+
+result_cache_t *result_cache_init(const char *directory)
+{
+    struct stat directoryStat;
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create the cache directory '%s'.\n", directory);
+        return NULL;
+    }
+    if (stat(directory, &directoryStat) != 0 || S_ISDIR(directoryStat.st_mode) == 0) {
+        fprintf(stderr, "The cache directory '%s' is not a directory.\n", directory);
+        return NULL;
+    }
+
+    result_cache_t *newCache = (result_cache_t *)malloc(sizeof(result_cache_t));
+    memset(newCache, 0, sizeof(result_cache_t));
+
+    newCache->directory = (char *)malloc(strlen(directory) + 1);
+    strcpy(newCache->directory, directory);
+    newCache->hash[0] = RESULT_CACHE_HASH_BASIS;
+    newCache->hash[1] = RESULT_CACHE_HASH_BASIS;
+    result_cache_add_int(newCache, RESULT_CACHE_VERSION);
+
+    return newCache;
+}
+
+void result_cache_destroy(result_cache_t *resultCache)
+{
+    free(resultCache->directory);
+    free(resultCache->entryPath);
+    free(resultCache);
+}
+
+void result_cache_add_data(result_cache_t *resultCache, const void *data, size_t length)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t hash1 = resultCache->hash[0];
+    uint64_t hash2 = resultCache->hash[1];
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash1 = (hash1 ^ bytes[i]) * RESULT_CACHE_HASH_PRIME1;
+        hash2 = (hash2 ^ bytes[i]) * RESULT_CACHE_HASH_PRIME2;
+    }
+    resultCache->hash[0] = hash1;
+    resultCache->hash[1] = hash2;
+}
+
+void result_cache_add_string(result_cache_t *resultCache, const char *string)
+{
+    if (string == NULL) {
+        result_cache_add_int(resultCache, -1);
+        return;
+    }
+    size_t length = strlen(string);
+    result_cache_add_int(resultCache, (int64_t)length);
+    result_cache_add_data(resultCache, string, length);
+}
+
+int result_cache_add_file(result_cache_t *resultCache, const char *filename)
+{
+    struct stat fileStat;
+    if (stat(filename, &fileStat) != 0 || S_ISREG(fileStat.st_mode) == 0) {
+        return -1;
+    }
+    result_cache_add_int(resultCache, (int64_t)fileStat.st_size);
+    result_cache_add_int(resultCache, (int64_t)fileStat.st_mtime);
+    return 0;
+}
+
+int result_cache_add_input(result_cache_t *resultCache, const char *filename)
+{
+    if (strcmp(filename, "-") == 0 || result_cache_add_file(resultCache, filename) != 0) {
+        fprintf(stderr, "***WARNING*** The outputs of '%s' can't be cached, it is not a file.\n", filename);
+        return -1;
+    }
+
+    htsFile *file = hts_open(filename, "r");
+    bcf_hdr_t *header = file ? bcf_hdr_read(file) : NULL;
+    if (header == NULL) {
+        fprintf(stderr, "***WARNING*** The outputs of '%s' can't be cached, its header can't be read.\n", filename);
+        if (file) {
+            hts_close(file);
+        }
+        return -1;
+    }
+    int headerTextLength = 0;
+    char *headerText = bcf_hdr_fmt_text(header, 0, &headerTextLength);
+    result_cache_add_int(resultCache, headerTextLength);
+    result_cache_add_data(resultCache, headerText, headerTextLength);
+    free(headerText);
+    bcf_hdr_destroy(header);
+    hts_close(file);
+
+    // the index decides which records are read when only the exon regions are read
+    static const char *indexExtensions[] = {".csi", ".tbi"};
+    int i;
+    for (i = 0; i < 2; i++) {
+        char *indexFilename = (char *)malloc(strlen(filename) + strlen(indexExtensions[i]) + 1);
+        sprintf(indexFilename, "%s%s", filename, indexExtensions[i]);
+        if (result_cache_add_file(resultCache, indexFilename) != 0) {
+            result_cache_add_int(resultCache, -1);
+        }
+        free(indexFilename);
+    }
+
+    return 0;
+}
+
+void result_cache_add_gene_mapper(result_cache_t *resultCache, gene_mapper_t *geneMapper)
+{
+    if (geneMapper == NULL) {
+        result_cache_add_int(resultCache, -1);
+        return;
+    }
+
+    int32_t i;
+    result_cache_add_int(resultCache, geneMapper->geneCount);
+    for (i = 0; i < geneMapper->geneCount; i++) {
+        gene_t *gene = geneMapper->genes[i];
+        result_cache_add_string(resultCache, gene->name);
+        result_cache_add_string(resultCache, gene->contig);
+        result_cache_add_int(resultCache, gene_strand(gene));
+        result_cache_add_int(resultCache, gene->exonCount);
+        result_cache_add_data(resultCache, gene->exons, sizeof(exon_range_t) * gene->exonCount);
+        result_cache_add_string(resultCache, gene->referenceGenome);
+        result_cache_add_int(resultCache, gene->essentialPositionCount);
+        result_cache_add_data(resultCache, gene->essentialPositions, sizeof(int32_t) * gene->essentialPositionCount);
+    }
+}
+
+void result_cache_finish_key(result_cache_t *resultCache)
+{
+    sprintf(resultCache->key, "%016llx%016llx", (unsigned long long)resultCache->hash[0], (unsigned long long)resultCache->hash[1]);
+    free(resultCache->entryPath);
+    resultCache->entryPath = result_cache_path(resultCache->directory, resultCache->key);
+}
+
+// returns 0 if the file was copied
+static int result_cache_copy_file(const char *sourceFilename, const char *destinationFilename)
+{
+    FILE *sourceFp = fopen(sourceFilename, "rb");
+    if (sourceFp == NULL) {
+        return -1;
+    }
+    FILE *destinationFp = fopen(destinationFilename, "wb");
+    if (destinationFp == NULL) {
+        fclose(sourceFp);
+        return -1;
+    }
+
+    size_t bufferLength = 1 << 20;
+    char *buffer = (char *)malloc(bufferLength);
+    int result = 0;
+    size_t readLength;
+    while ((readLength = fread(buffer, 1, bufferLength, sourceFp)) > 0) {
+        if (fwrite(buffer, 1, readLength, destinationFp) != readLength) {
+            result = -1;
+            break;
+        }
+    }
+    if (ferror(sourceFp)) {
+        result = -1;
+    }
+    free(buffer);
+    fclose(sourceFp);
+    if (fclose(destinationFp) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+int result_cache_fetch(result_cache_t *resultCache, const char *outputFilename, const char *csvFilename, int32_t *countsOut)
+{
+    char *countsPath = result_cache_path(resultCache->entryPath, "counts");
+    FILE *countsFp = fopen(countsPath, "r");
+    free(countsPath);
+    if (countsFp == NULL) {
+        return -1;
+    }
+    int counts[3];
+    int countCount = fscanf(countsFp, "%d %d %d", counts, counts + 1, counts + 2);
+    fclose(countsFp);
+    if (countCount != 3) {
+        return -1;
+    }
+
+    int result = 0;
+    if (outputFilename) {
+        char *outputPath = result_cache_path(resultCache->entryPath, "output");
+        result = result_cache_copy_file(outputPath, outputFilename);
+        free(outputPath);
+    }
+    if (result == 0 && csvFilename) {
+        char *csvPath = result_cache_path(resultCache->entryPath, "csv");
+        result = result_cache_copy_file(csvPath, csvFilename);
+        free(csvPath);
+    }
+    if (result == 0) {
+        countsOut[0] = counts[0];
+        countsOut[1] = counts[1];
+        countsOut[2] = counts[2];
+    }
+    return result;
+}
+
+void result_cache_store(result_cache_t *resultCache, const char *outputFilename, const char *csvFilename, const int32_t *counts)
+{
+    char *temporaryPath = (char *)malloc(strlen(resultCache->entryPath) + 32);
+    sprintf(temporaryPath, "%s.%d.tmp", resultCache->entryPath, (int)getpid());
+    char *outputPath = result_cache_path(temporaryPath, "output");
+    char *csvPath = result_cache_path(temporaryPath, "csv");
+    char *countsPath = result_cache_path(temporaryPath, "counts");
+
+    int result = mkdir(temporaryPath, 0777);
+    if (result == 0 && outputFilename) {
+        result = result_cache_copy_file(outputFilename, outputPath);
+    }
+    if (result == 0 && csvFilename) {
+        result = result_cache_copy_file(csvFilename, csvPath);
+    }
+    if (result == 0) {
+        FILE *countsFp = fopen(countsPath, "w");
+        if (countsFp == NULL || fprintf(countsFp, "%d %d %d\n", (int)counts[0], (int)counts[1], (int)counts[2]) < 0) {
+            result = -1;
+        }
+        if (countsFp && fclose(countsFp) != 0) {
+            result = -1;
+        }
+    }
+    if (result == 0 && rename(temporaryPath, resultCache->entryPath) != 0) {
+        if (errno != EEXIST && errno != ENOTEMPTY) { // another run kept the same outputs
+            fprintf(stderr, "***WARNING*** Unable to keep the outputs in the cache directory '%s'.\n", resultCache->directory);
+        }
+        result = 1;
+    } else if (result != 0) {
+        fprintf(stderr, "***WARNING*** Unable to keep the outputs in the cache directory '%s'.\n", resultCache->directory);
+    }
+    if (result != 0) {
+        unlink(outputPath);
+        unlink(csvPath);
+        unlink(countsPath);
+        rmdir(temporaryPath);
+    }
+
+    free(outputPath);
+    free(csvPath);
+    free(countsPath);
+    free(temporaryPath);
+}
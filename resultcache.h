@@ -0,0 +1,49 @@
+//
+//  resultcache.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_resultcache_h
+#define bcfgenemapper_resultcache_h
+
+#include <stdint.h>
+#include "genemapper.h"
+
+/* The result cache keeps the outputs of the runs in a directory, a subdirectory per run named by the hash of
+   everything that makes the outputs: the input files (size, modification time, header and index), the gene model
+   (genes, strands, exons, reference sequences and essential positions) and the options. A run with the same key copies the
+   outputs of the subdirectory instead of reading its inputs.
+   The subdirectory has the "output" and "csv" files if they were written, and "counts" with the kept, updated
+   and removed record counts. It is written under a temporary name and renamed once it is complete. */
+
+#define RESULT_CACHE_VERSION 1
+
+typedef struct {
+    char *directory;
+    uint64_t hash[2];
+    char key[33]; // hexadecimal hash, set by result_cache_finish_key
+    char *entryPath;
+} result_cache_t;
+
+// creates the directory if it doesn't exist, returns NULL and prints the reason if it can't be used
+result_cache_t *result_cache_init(const char *directory);
+void result_cache_destroy(result_cache_t *resultCache);
+
+void result_cache_add_data(result_cache_t *resultCache, const void *data, size_t length);
+void result_cache_add_string(result_cache_t *resultCache, const char *string); // NULL is not the same as ""
+static inline void result_cache_add_int(result_cache_t *resultCache, int64_t value) {result_cache_add_data(resultCache, &value, sizeof(int64_t));}
+// adds the size and modification time of the file, returns -1 if it is not a regular file
+int result_cache_add_file(result_cache_t *resultCache, const char *filename);
+// adds the file, its header and its index, returns -1 and prints the reason if the input can't be cached (stdin)
+int result_cache_add_input(result_cache_t *resultCache, const char *filename);
+void result_cache_add_gene_mapper(result_cache_t *resultCache, gene_mapper_t *geneMapper); // geneMapper can be NULL
+void result_cache_finish_key(result_cache_t *resultCache);
+
+// copies the cached outputs to the files that are not NULL, returns 0 if they were all in the cache
+int result_cache_fetch(result_cache_t *resultCache, const char *outputFilename, const char *csvFilename, int32_t *countsOut);
+// keeps a copy of the outputs that are not NULL, prints a warning if they can't be kept
+void result_cache_store(result_cache_t *resultCache, const char *outputFilename, const char *csvFilename, const int32_t *counts);
+
+#endif
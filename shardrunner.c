@@ -0,0 +1,138 @@
+//
+//  shardrunner.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "shardrunner.h"
+
+#define SHARD_RUNNER_SHARDS_AHEAD_PER_THREAD 4
+
+typedef struct {
+    shard_runner_t *shardRunner;
+    void *workerState;
+} shard_worker_t;
+
+shard_runner_t *shard_runner_init(void *context, int32_t shardCount,
+                                  shard_worker_init_function_t workerInitFunction, shard_run_function_t runFunction,
+                                  shard_merge_function_t mergeFunction, shard_worker_destroy_function_t workerDestroyFunction)
+{
+    shard_runner_t *newShardRunner = (shard_runner_t *)malloc(sizeof(shard_runner_t));
+    memset(newShardRunner, 0, sizeof(shard_runner_t));
+    
+    newShardRunner->context = context;
+    newShardRunner->workerInitFunction = workerInitFunction;
+    newShardRunner->runFunction = runFunction;
+    newShardRunner->mergeFunction = mergeFunction;
+    newShardRunner->workerDestroyFunction = workerDestroyFunction;
+    newShardRunner->shardCount = shardCount;
+    newShardRunner->shardResults = (void **)malloc(sizeof(void *) * (shardCount + 1));
+    memset(newShardRunner->shardResults, 0, sizeof(void *) * (shardCount + 1));
+    newShardRunner->shardsDone = (char *)malloc(shardCount + 1);
+    memset(newShardRunner->shardsDone, 0, shardCount + 1);
+    pthread_mutex_init(&newShardRunner->mutex, NULL);
+    pthread_cond_init(&newShardRunner->shardDoneCondition, NULL);
+    pthread_cond_init(&newShardRunner->shardMergedCondition, NULL);
+    
+    return newShardRunner;
+}
+
+void shard_runner_destroy(shard_runner_t *shardRunner)
+{
+    pthread_mutex_destroy(&shardRunner->mutex);
+    pthread_cond_destroy(&shardRunner->shardDoneCondition);
+    pthread_cond_destroy(&shardRunner->shardMergedCondition);
+    free(shardRunner->shardResults);
+    free(shardRunner->shardsDone);
+    free(shardRunner);
+}
+
+static void *shard_runner_worker_thread(void *workerPtr)
+{
+    shard_worker_t *worker = (shard_worker_t *)workerPtr;
+    shard_runner_t *shardRunner = worker->shardRunner;
+    
+    worker->workerState = shardRunner->workerInitFunction(shardRunner->context);
+    
+    while (1) {
+        pthread_mutex_lock(&shardRunner->mutex);
+        while (shardRunner->nextShardIndex < shardRunner->shardCount &&
+               shardRunner->nextShardIndex >= shardRunner->mergedShardCount + shardRunner->maxShardsAhead) {
+            pthread_cond_wait(&shardRunner->shardMergedCondition, &shardRunner->mutex);
+        }
+        int32_t shardIndex = shardRunner->nextShardIndex;
+        if (shardIndex < shardRunner->shardCount) {
+            shardRunner->nextShardIndex++;
+        }
+        pthread_mutex_unlock(&shardRunner->mutex);
+        
+        if (shardIndex >= shardRunner->shardCount) {
+            break;
+        }
+        
+        void *shardResult = shardRunner->runFunction(shardRunner->context, worker->workerState, shardIndex);
+        
+        pthread_mutex_lock(&shardRunner->mutex);
+        shardRunner->shardResults[shardIndex] = shardResult;
+        shardRunner->shardsDone[shardIndex] = 1;
+        pthread_cond_broadcast(&shardRunner->shardDoneCondition);
+        pthread_mutex_unlock(&shardRunner->mutex);
+    }
+    
+    return NULL;
+}
+
+int shard_runner_run(shard_runner_t *shardRunner, int threadCount)
+{
+    int i;
+    
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    shardRunner->maxShardsAhead = threadCount * SHARD_RUNNER_SHARDS_AHEAD_PER_THREAD;
+    
+    shard_worker_t *workers = (shard_worker_t *)malloc(sizeof(shard_worker_t) * threadCount);
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * threadCount);
+    memset(workers, 0, sizeof(shard_worker_t) * threadCount);
+    for (i = 0; i < threadCount; i++) {
+        workers[i].shardRunner = shardRunner;
+        if (pthread_create(threads + i, NULL, shard_runner_worker_thread, workers + i) != 0) {
+            fprintf(stderr, "[%s:%d %s] Unable to create a worker thread\n", __FILE__, __LINE__, __FUNCTION__);
+            abort();
+        }
+    }
+    
+    while (shardRunner->mergedShardCount < shardRunner->shardCount) {
+        pthread_mutex_lock(&shardRunner->mutex);
+        while (shardRunner->shardsDone[shardRunner->mergedShardCount] == 0) {
+            pthread_cond_wait(&shardRunner->shardDoneCondition, &shardRunner->mutex);
+        }
+        int32_t shardIndex = shardRunner->mergedShardCount;
+        void *shardResult = shardRunner->shardResults[shardIndex];
+        shardRunner->shardResults[shardIndex] = NULL;
+        pthread_mutex_unlock(&shardRunner->mutex);
+        
+        shardRunner->mergeFunction(shardRunner->context, shardIndex, shardResult);
+        
+        pthread_mutex_lock(&shardRunner->mutex);
+        shardRunner->mergedShardCount++;
+        pthread_cond_broadcast(&shardRunner->shardMergedCondition);
+        pthread_mutex_unlock(&shardRunner->mutex);
+    }
+    
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < threadCount; i++) {
+        shardRunner->workerDestroyFunction(shardRunner->context, workers[i].workerState);
+    }
+    free(threads);
+    free(workers);
+    
+    return 0;
+}
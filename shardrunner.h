@@ -0,0 +1,51 @@
+//
+//  shardrunner.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_shardrunner_h
+#define bcfgenemapper_shardrunner_h
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Processes independent shards on a pool of worker threads and merges their results in shard order.
+   Each worker thread gets its own state, and is given the shards in increasing order. The results are
+   merged on the calling thread as soon as all the shards before them are merged. Workers don't get
+   more than a few shards ahead of the merge, so only a bounded number of results are kept in memory. */
+
+typedef void *(*shard_worker_init_function_t)(void *context); // called on the worker thread
+typedef void *(*shard_run_function_t)(void *context, void *workerState, int32_t shardIndex); // returns the result of the shard
+typedef void (*shard_merge_function_t)(void *context, int32_t shardIndex, void *shardResult); // called on the calling thread, in shard order
+typedef void (*shard_worker_destroy_function_t)(void *context, void *workerState); // called on the calling thread once all the shards are merged
+
+typedef struct {
+    void *context;
+    shard_worker_init_function_t workerInitFunction;
+    shard_run_function_t runFunction;
+    shard_merge_function_t mergeFunction;
+    shard_worker_destroy_function_t workerDestroyFunction;
+    
+    int32_t shardCount;
+    int32_t nextShardIndex;
+    int32_t mergedShardCount;
+    int32_t maxShardsAhead;
+    void **shardResults;
+    char *shardsDone;
+    
+    pthread_mutex_t mutex;
+    pthread_cond_t shardDoneCondition;
+    pthread_cond_t shardMergedCondition;
+} shard_runner_t;
+
+shard_runner_t *shard_runner_init(void *context, int32_t shardCount,
+                                  shard_worker_init_function_t workerInitFunction, shard_run_function_t runFunction,
+                                  shard_merge_function_t mergeFunction, shard_worker_destroy_function_t workerDestroyFunction);
+void shard_runner_destroy(shard_runner_t *shardRunner);
+
+// returns 0 on success
+int shard_runner_run(shard_runner_t *shardRunner, int threadCount);
+
+#endif
@@ -0,0 +1,63 @@
+//
+//  stats.c
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+static const char *stageNames[statsstagecount] = {
+    "header",
+    "read",
+    "map",
+    "annotate",
+    "write",
+    "csv_add_record",
+    "csv_collapse",
+    "csv_print",
+    "csv_merge"
+};
+
+stats_t *stats_init(void)
+{
+    stats_t *newStats = (stats_t *)malloc(sizeof(stats_t));
+    memset(newStats, 0, sizeof(stats_t));
+    return newStats;
+}
+
+void stats_destroy(stats_t *stats)
+{
+    free(stats);
+}
+
+void stats_add(stats_t *stats, const stats_t *otherStats)
+{
+    int i;
+    for (i = 0; i < statsstagecount; i++) {
+        stats->counts[i] += otherStats->counts[i];
+        stats->nanoseconds[i] += otherStats->nanoseconds[i];
+    }
+}
+
+int stats_write_json(const stats_t *stats, const stats_summary_t *summary, FILE *fp)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"threads\": %d,\n", summary->threadCount);
+    fprintf(fp, "  \"wall_seconds\": %.6f,\n", summary->wallSeconds);
+    fprintf(fp, "  \"records\": {\"read\": %lld, \"kept\": %lld, \"updated\": %lld, \"removed\": %lld},\n",
+            (long long)stats->counts[statsstageread], (long long)summary->keptRecords, (long long)summary->updatedRecords, (long long)summary->removedRecords);
+    fprintf(fp, "  \"stages\": {\n");
+    int i;
+    for (i = 0; i < statsstagecount; i++) {
+        fprintf(fp, "    \"%s\": {\"count\": %lld, \"seconds\": %.6f}%s\n", stageNames[i], (long long)stats->counts[i],
+                (double)stats->nanoseconds[i] * 1e-9, i + 1 < statsstagecount ? "," : "");
+    }
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+    
+    return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,70 @@
+//
+//  stats.h
+//  bcfgenemapper
+//
+//  Copyright (c) 2014 Spaltenstein Natural Image. All rights reserved.
+//
+
+#ifndef bcfgenemapper_stats_h
+#define bcfgenemapper_stats_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Counts and cumulative times of the processing stages. A stage must only be timed by one thread at a time, the
+   threads that run the same stages concurrently keep their own stats which are added together at the end. */
+
+typedef enum {
+    statsstageheader, // reading the input header and writing the output header
+    statsstageread, // reading and decoding the records
+    statsstagemap, // mapping the positions of the records
+    statsstageannotate, // updating or removing the gene mapper info of the records
+    statsstagewrite, // encoding and writing the records
+    statsstagecsvaddrecord,
+    statsstagecsvcollapse, // sorting and collapsing the positions, part of printing
+    statsstagecsvprint,
+    statsstagecsvmerge, // merging the csv formatters of the input files
+    statsstagecount
+} stats_stage_t;
+
+typedef struct {
+    int64_t counts[statsstagecount];
+    int64_t nanoseconds[statsstagecount];
+} stats_t;
+
+stats_t *stats_init(void);
+void stats_destroy(stats_t *stats);
+
+static inline int64_t stats_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// stats can be NULL, in which case nothing is timed
+static inline int64_t stats_start(stats_t *stats) {return stats ? stats_now() : 0;}
+static inline void stats_stop_count(stats_t *stats, stats_stage_t stage, int64_t start, int64_t count) // for stages that process several items at once
+{
+    if (stats) {
+        stats->counts[stage] += count;
+        stats->nanoseconds[stage] += stats_now() - start;
+    }
+}
+static inline void stats_stop(stats_t *stats, stats_stage_t stage, int64_t start) {stats_stop_count(stats, stage, start, 1);}
+
+void stats_add(stats_t *stats, const stats_t *otherStats);
+
+typedef struct { // totals of the run written with the stages
+    int threadCount;
+    double wallSeconds;
+    int64_t keptRecords;
+    int64_t updatedRecords;
+    int64_t removedRecords;
+} stats_summary_t;
+
+// returns 0 on success
+int stats_write_json(const stats_t *stats, const stats_summary_t *summary, FILE *fp);
+
+#endif